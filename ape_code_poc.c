@@ -111,8 +111,16 @@ INTERRUPT void ISR_Exception(isr_args *args) {
 #endif
 }
 
-INTERRUPT void ISR_SysTick(isr_args *args) {
-  ISR_GET_REGS();
+// The CPU doesn't pass the stacked frame to handlers, so find it from
+// whichever stack pointer was in use when the interrupt was taken.
+__attribute__((naked)) void ISR_SysTick(isr_args *args) {
+  asm(
+    "tst lr, #4\n"
+    "ite eq\n"
+    "mrseq r0, msp\n"
+    "mrsne r0, psp\n"
+    "b AProfSample\n"
+    );
 }
 
 INTERRUPT void ISR_SVCall(isr_args *args) {
@@ -171,6 +179,103 @@ INTERRUPT void ISR_RMUEgress(isr_args *args) {
 }
 
 
+/* Logging {{{1
+ * -------
+ * Appends deferred-formatting records to the debug log ring read by otgdbg
+ * apelog, which formats them using the format strings extracted from this
+ * image's ELF. See APE_DBGLOG_TYPE__FMT.
+ */
+static void _ALogEntry(uint32_t typeArg, uint32_t ts) {
+  uint32_t idx = (GetSHM(0, REG_APE__NCSI_DBGLOG_INDEX)+1) % APE_DBGLOG_NUM_ENTRIES;
+  SetSHM(0, APE_DBGLOG_BASE + idx*8 + 0, typeArg);
+  SetSHM(0, APE_DBGLOG_BASE + idx*8 + 4, ts);
+  SetSHM(0, REG_APE__NCSI_DBGLOG_INDEX, idx);
+}
+
+// Use ALOG rather than calling this directly. Not safe to call from an ISR
+// which may interrupt another call, as the entries would be interleaved.
+void ALog(uint32_t fmtID, uint32_t nargs, const uint32_t *args) {
+  _ALogEntry(APE_DBGLOG_TYPE__FMT | (fmtID << 8) | (nargs << 28),
+    GetSHM(0, REG_APE__HEARTBEAT) & 0x0FFFFFFF);
+  for (uint32_t i=0; i<nargs; ++i)
+    _ALogEntry(APE_DBGLOG_TYPE__FMT_ARG | (i << 8), args[i]);
+}
+
+// e.g. ALOG("port %u link up\n", port); fmt must be a string literal and the
+// arguments integers.
+#define ALOG(fmt, ...) do { \
+    const uint32_t _alogArgs[] = {0, ##__VA_ARGS__}; \
+    static_assert(sizeof(_alogArgs)/4 - 1 <= 0xF, "too many ALOG arguments"); \
+    ALog(LOG_FMT_ID(fmt), sizeof(_alogArgs)/4 - 1, _alogArgs + 1); \
+  } while (0)
+
+void ALogInit(void) {
+  // Advertise the ring: 64 two-word entries at offset 0xE00.
+  SetSHM(0, REG_APE__NCSI_DBGLOG_LEN_OFFSET, ((APE_DBGLOG_NUM_ENTRIES*2) << 18) | (APE_DBGLOG_BASE - APE_REG(0x4000)));
+  SetSHM(0, REG_APE__NCSI_DBGLOG_INDEX, APE_DBGLOG_NUM_ENTRIES-1);
+}
+
+/* Profiler {{{1
+ * --------
+ * Samples the interrupted PC on every SysTick into gAProf, which otgdbg
+ * apeprof finds by symbol, drains and symbolizes. See ape_prof.
+ */
+__attribute__((used)) volatile ape_prof gAProf;
+
+static uint32_t _AProfReload(void) {
+  uint32_t reload = gAProf.reload;
+  if (!reload)
+    return APE_PROF_RELOAD__DEFAULT;
+  return reload > APE_PROF_RELOAD__MAX ? APE_PROF_RELOAD__MAX : reload;
+}
+
+// Sets the SysTick period. activeReload is 0 for the idle period, in which
+// ticks only check whether the host has enabled sampling.
+static void _AProfStart(uint32_t reload, uint32_t activeReload) {
+  // Count processor clocks and interrupt on wrap.
+  SetNVIC(NVIC_SYSTICK_CONTROL, 0);
+  SetNVIC(NVIC_SYSTICK_RELOAD_VALUE, reload);
+  SetNVIC(NVIC_SYSTICK_CUR_VALUE, 0);
+  SetNVIC(NVIC_SYSTICK_CONTROL, 0x7);
+  gAProf.activeReload = activeReload;
+}
+
+__attribute__((used)) void AProfSample(isr_args *frame) {
+  // Follow the host's settings, so that it can start, retune or stop
+  // sampling without restarting the image.
+  if (!(gAProf.ctrl & APE_PROF_CTRL__ENABLE)) {
+    if (gAProf.activeReload)
+      _AProfStart(APE_PROF_RELOAD__MAX, 0);
+    return;
+  }
+
+  uint32_t reload = _AProfReload();
+  if (reload != gAProf.activeReload) {
+    // This tick ended an idle or differently sized period, so don't count it.
+    _AProfStart(reload, reload);
+    return;
+  }
+
+  uint32_t prod = gAProf.prod;
+  if (prod - gAProf.cons >= APE_PROF_LEN) {
+    ++gAProf.drops;
+    return;
+  }
+
+  gAProf.pcs[prod % APE_PROF_LEN] = frame->pc;
+  gAProf.prod = prod+1;
+}
+
+void AProfInit(void) {
+  SetNVIC(NVIC_SYSTICK_CONTROL, 0);
+  gAProf.prod  = 0;
+  gAProf.cons  = 0;
+  gAProf.drops = 0;
+  gAProf.ctrl  = 0;
+  gAProf.magic = APE_PROF_MAGIC;
+  _AProfStart(APE_PROF_RELOAD__MAX, 0);
+}
+
 /* Utilities {{{1
  * ---------
  */
@@ -1055,6 +1160,10 @@ INTERRUPT void ISR_RMUEgress(isr_args *args) {
 #endif
 
 NO_INLINE void AStart(void) {
+  AProfInit();
+  ALogInit();
+  ALOG("OTG NCSI %u.%u.%u started\n", APE_VER_MAJOR, APE_VER_MINOR, APE_VER_PATCH);
+
 #ifdef PROPRIETARY
 /*               scrubbed                    */
 /*               scrubbed                    */
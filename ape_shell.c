@@ -7,6 +7,7 @@
 #define APE_VER_PATCH  7
 
 #define CONSTP32(X)    (*(uint32_t*)(X))
+#define CONSTVP32(X)   (*(volatile uint32_t*)(X))
 #define CONSTPP(X)     (*(void**)(X))
 
 #define APEDBG_STATE CONSTP32(0x60220260)
@@ -15,8 +16,26 @@
 #define APEDBG_ARG1  CONSTP32(0x6022026C)
 #define APEDBG_CMD_ERROR_FLAGS             CONSTP32(0x60220270)
 #define APEDBG_CMD_ERROR_FLAGS__EXCEPTION  0x00000001
+#define APEDBG_CMD_ERROR_FLAGS__INVALID    0x00000002
 #define APEDBG_EXCEPTION_COUNT             CONSTP32(0x60220274)
 #define APEDBG_EXCEPTION_IGNORE            CONSTP32(0x60220278)
+#define APEDBG_ARG2                        CONSTP32(0x6022027C)
+#define APEDBG_STAGE                       0x60220400
+#define APEDBG_STAGE_SIZE                  0x200
+#define APEDBG_RING_PROD                   CONSTVP32(0x60220600)
+#define APEDBG_RING_CONS                   CONSTVP32(0x60220604)
+#define APEDBG_RING_MAGIC                  CONSTVP32(0x60220608)
+#define APEDBG_RING_MAGIC__VALUE           0x52494E47 /* "RING" */
+#define APEDBG_RING_BASE                   0x60220610
+#define APEDBG_RING_LEN                    15
+#define APEDBG_WATCH_PROD                  CONSTVP32(0x60220280)
+#define APEDBG_WATCH_CONS                  CONSTVP32(0x60220284)
+#define APEDBG_WATCH_DROPS                 CONSTVP32(0x60220288)
+#define APEDBG_WATCH_ARMED                 CONSTVP32(0x6022028C)
+#define APEDBG_WATCH_BASE                  0x60220290
+#define APEDBG_WATCH_LEN                   7
+#define APEDBG_WATCH_ALL                   0xFFFFFFFF
+#define APEDBG_WATCH_NO_VALUE              0x80000000
 
 #define APEDBG_STATE_RUNNING    0xBEEFCAFE
 #define APEDBG_STATE_EXITED     0xBEEF0FFE
@@ -39,6 +58,14 @@ enum {
   APEDBG_CMD__MEM_SET       = 0x0002,
   APEDBG_CMD__CALL_0        = 0x0003,
   APEDBG_CMD__RETURN        = 0x0004,
+  APEDBG_CMD__DECOMPRESS_BEGIN = 0x0005,
+  APEDBG_CMD__DECOMPRESS    = 0x0006,
+  APEDBG_CMD__MEM_READ_BLOCK  = 0x0007,
+  APEDBG_CMD__MEM_WRITE_BLOCK = 0x0008,
+  APEDBG_CMD__FILL          = 0x0009,
+  APEDBG_CMD__CRC32         = 0x000A,
+  APEDBG_CMD__WATCH_SET     = 0x000B,
+  APEDBG_CMD__WATCH_CLEAR   = 0x000C,
 };
 
 typedef struct {
@@ -57,7 +84,416 @@ void _IntHandler_HardFault(exc_frame_t *sp) {
   }
 }
 
-static inline uint32_t _GetCommand(void) {
+// Watchpoints
+// -----------
+// DWT comparators raise the DebugMonitor exception when they match, which is
+// logged to a ring in SHM for the host to drain. The handler stays installed
+// after RETURN, so that the firmware the shell was injected into is watched;
+// it is only taken while interrupts are enabled, i.e. not while the shell is
+// processing commands. Since the handler is shell code, the host must clear
+// the watchpoints before replacing the shell or the image it is running in,
+// and APEDBG_WATCH_ARMED tells it whether there are any.
+extern void APEShell_IntHandler_DebugMon(void);
+
+// Whether the word at addr can be read without side effects or faulting,
+// which is only known for RAM.
+static inline int _IsRAM(uint32_t addr) {
+  return (addr >= 0x00100000 && addr < STACK_END)
+      || (addr >= APE_SHM_BASE && addr < APE_SHM_BASE + 0x4000);
+}
+
+void _IntHandler_DebugMon(exc_frame_t *sp) {
+  uint32_t numComp = GetNVIC(DWT_CONTROL) >> DWT_CONTROL__NUM_COMP__SHIFT;
+  for (uint32_t i=0; i<numComp; ++i) {
+    if (!(GetNVIC(DWT_FUNCTION(i)) & DWT_FUNCTION__MATCHED))
+      continue;
+
+    uint32_t prod = APEDBG_WATCH_PROD;
+    if (prod - APEDBG_WATCH_CONS >= APEDBG_WATCH_LEN) {
+      ++APEDBG_WATCH_DROPS;
+      continue;
+    }
+
+    uint32_t addr = GetNVIC(DWT_COMP(i));
+    volatile uint32_t *e = &CONSTVP32(APEDBG_WATCH_BASE + (prod % APEDBG_WATCH_LEN)*16);
+    e[0] = sp->pc;
+    e[1] = addr;
+    e[2] = _IsRAM(addr) ? CONSTVP32(addr & ~3U) : 0;
+    e[3] = _IsRAM(addr) ? i : i | APEDBG_WATCH_NO_VALUE;
+    APEDBG_WATCH_PROD = prod+1;
+  }
+
+  SetNVIC(NVIC_DEBUG_FAULT_STATUS, NVIC_DEBUG_FAULT_STATUS__DWTTRAP);
+}
+
+// ARG0: address, ARG1: number of low address bits to ignore, ARG2:
+// comparator in bits 0-7, mode (1: read, 2: write, 3: either) in bits 8-15.
+// Returns the number of comparators in ARG2.
+static void _WatchSet(volatile uint32_t *arg0, volatile uint32_t *arg1, volatile uint32_t *arg2) {
+  uint32_t demcr = GetNVIC(NVIC_DEBUG_EXC_MON_CONTROL);
+  SetNVIC(NVIC_DEBUG_EXC_MON_CONTROL, demcr | NVIC_DEBUG_EXC_MON_CONTROL__TRCENA);
+
+  uint32_t numComp = GetNVIC(DWT_CONTROL) >> DWT_CONTROL__NUM_COMP__SHIFT;
+  uint32_t comp = *arg2 & 0xFF, mode = (*arg2 >> 8) & 0xFF;
+  if (comp >= numComp || mode < 1 || mode > 3 || *arg1 > 31) {
+    APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+    return;
+  }
+
+  if (!(demcr & NVIC_DEBUG_EXC_MON_CONTROL__MON_EN)) {
+    APEDBG_WATCH_PROD  = 0;
+    APEDBG_WATCH_CONS  = 0;
+    APEDBG_WATCH_DROPS = 0;
+    ((void**)NVIC_VECTOR_TABLE_OFFSET)[INT_DEBUGMON] = APEShell_IntHandler_DebugMon;
+  }
+
+  SetNVIC(DWT_FUNCTION(comp), DWT_FUNCTION__DISABLED);
+  SetNVIC(DWT_COMP(comp), *arg0);
+  SetNVIC(DWT_MASK(comp), *arg1);
+  SetNVIC(DWT_FUNCTION(comp), DWT_FUNCTION__WATCH_READ - 1 + mode);
+  SetNVIC(NVIC_DEBUG_EXC_MON_CONTROL, GetNVIC(NVIC_DEBUG_EXC_MON_CONTROL)
+    | NVIC_DEBUG_EXC_MON_CONTROL__TRCENA | NVIC_DEBUG_EXC_MON_CONTROL__MON_EN);
+  APEDBG_WATCH_ARMED = 1;
+
+  *arg2 = numComp;
+}
+
+static void _WatchClearAll(void) {
+  uint32_t numComp = GetNVIC(DWT_CONTROL) >> DWT_CONTROL__NUM_COMP__SHIFT;
+  for (uint32_t comp=0; comp<numComp; ++comp)
+    SetNVIC(DWT_FUNCTION(comp), DWT_FUNCTION__DISABLED);
+  SetNVIC(NVIC_DEBUG_EXC_MON_CONTROL,
+    GetNVIC(NVIC_DEBUG_EXC_MON_CONTROL) & ~NVIC_DEBUG_EXC_MON_CONTROL__MON_EN);
+  APEDBG_WATCH_ARMED = 0;
+}
+
+// ARG2: comparator, or APEDBG_WATCH_ALL, which also disables the
+// DebugMonitor exception.
+static void _WatchClear(volatile uint32_t *arg2) {
+  uint32_t numComp = GetNVIC(DWT_CONTROL) >> DWT_CONTROL__NUM_COMP__SHIFT;
+  uint32_t comp = *arg2;
+  if (comp == APEDBG_WATCH_ALL)
+    _WatchClearAll();
+  else if (comp < numComp)
+    SetNVIC(DWT_FUNCTION(comp), DWT_FUNCTION__DISABLED);
+  else {
+    APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+    return;
+  }
+
+  *arg2 = numComp;
+}
+
+// Loads and stores which may fault. The HardFault handler skips the faulting
+// instruction when APEDBG_EXCEPTION_IGNORE is set, assuming it is 16 bits
+// long, so these use forms which are guaranteed to be: low registers and no
+// offset.
+static inline uint32_t _SafeLoad(uint32_t addr) {
+  uint32_t v = 0xFFFFFFFF;
+  APEDBG_EXCEPTION_IGNORE = 1;
+  asm volatile ("ldr %0, [%1]" : "+l" (v) : "l" (addr) : "memory");
+  APEDBG_EXCEPTION_IGNORE = 0;
+  return v;
+}
+
+static inline void _SafeStore(uint32_t addr, uint32_t v) {
+  APEDBG_EXCEPTION_IGNORE = 1;
+  asm volatile ("str %0, [%1]" :: "l" (v), "l" (addr) : "memory");
+  APEDBG_EXCEPTION_IGNORE = 0;
+}
+
+// Standard CRC32, a nibble at a time to keep the table small. crc is the
+// running value, which starts at 0xFFFFFFFF and is inverted at the end.
+static uint32_t _CRC32Byte(uint32_t crc, uint8_t c) {
+  static const uint32_t tbl[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+
+  crc ^= c;
+  crc = (crc >> 4) ^ tbl[crc & 15];
+  crc = (crc >> 4) ^ tbl[crc & 15];
+  return crc;
+}
+
+// On-device CMPS decompression. The host stages compressed data in
+// APEDBG_STAGE a piece at a time and the output is written directly to its
+// load address. The output written so far doubles as the dictionary, so no
+// 2 KiB ring is needed: a match at dictionary position p, when the next output
+// byte is at offset k, copies from offset k - ((k + N - F - p) mod N), or from
+// the 0x20 prefill where that is negative. Output is stored a word at a time.
+#define CMPS_N          2048
+#define CMPS_F          34
+#define CMPS_THRESHOLD  2
+
+typedef struct {
+  uint32_t dst;         // Load address of the output.
+  uint32_t size;        // Expected output size in bytes.
+  uint32_t pos;         // Bytes output so far.
+  uint32_t word;        // Output bytes not yet stored, little endian.
+  uint32_t crc;         // Running CRC32 of the output.
+  uint16_t flags;       // Unconsumed flag bits, with 0xFF00 above them.
+  uint16_t dist;        // Distance back to the source of the match being copied.
+  uint8_t  copyLeft;    // Bytes of the match still to be copied.
+  uint8_t  matchLo;     // First byte of a match code whose second byte has not
+  uint8_t  haveMatchLo; // arrived yet.
+} decomp_state;
+
+static inline uint8_t _StageByte(uint32_t i) {
+  return CONSTP32(APEDBG_STAGE + (i & ~3)) >> ((i & 3)*8);
+}
+
+static inline uint8_t _DecompGetOutput(const decomp_state *d, uint32_t dist) {
+  if (dist > d->pos)
+    return 0x20;
+
+  uint32_t i = d->pos - dist;
+  if ((i & ~3) == (d->pos & ~3))
+    return d->word >> ((i & 3)*8);
+  return CONSTP32(d->dst + (i & ~3)) >> ((i & 3)*8);
+}
+
+static inline void _DecompPutOutput(decomp_state *d, uint8_t c) {
+  d->word |= (uint32_t)c << ((d->pos & 3)*8);
+  d->crc = _CRC32Byte(d->crc, c);
+  if (!(++d->pos & 3)) {
+    CONSTP32(d->dst + d->pos - 4) = d->word;
+    d->word = 0;
+  }
+}
+
+static void _DecompBegin(decomp_state *d, uint32_t dst, uint32_t size) {
+  d->dst         = dst;
+  d->size        = size;
+  d->pos         = 0;
+  d->word        = 0;
+  d->crc         = 0xFFFFFFFF;
+  d->flags       = 0;
+  d->copyLeft    = 0;
+  d->haveMatchLo = 0;
+}
+
+// Consumes len bytes of staged input, stopping early only if the expected
+// output size is reached.
+static void _Decomp(decomp_state *d, uint32_t len) {
+  uint32_t i = 0;
+
+  for (;;) {
+    while (d->copyLeft && d->pos < d->size) {
+      _DecompPutOutput(d, _DecompGetOutput(d, d->dist));
+      --d->copyLeft;
+    }
+
+    if (d->pos >= d->size)
+      break;
+
+    if (!(d->flags & 0x100)) {
+      if (i == len)
+        break;
+      d->flags = _StageByte(i++) | 0xFF00;
+    }
+
+    if (d->flags & 1) {
+      if (i == len)
+        break;
+      _DecompPutOutput(d, _StageByte(i++));
+    } else {
+      if (!d->haveMatchLo) {
+        if (i == len)
+          break;
+        d->matchLo = _StageByte(i++);
+        d->haveMatchLo = 1;
+      }
+      if (i == len)
+        break;
+      uint8_t hi = _StageByte(i++);
+      d->haveMatchLo = 0;
+
+      uint32_t p = d->matchLo | ((hi & 0xE0) << 3);
+      d->dist = (d->pos + CMPS_N - CMPS_F - p) & (CMPS_N-1);
+      if (!d->dist)
+        d->dist = CMPS_N;
+      d->copyLeft = (hi & 0x1F) + CMPS_THRESHOLD + 1;
+    }
+
+    d->flags >>= 1;
+  }
+}
+
+// Runs a command. arg0-2 point to the command's arguments, which are also
+// where results are returned: either APEDBG_ARG0-2 or a ring descriptor.
+// RETURN is handled by the caller.
+static void _RunCommand(uint32_t cmd, volatile uint32_t *arg0, volatile uint32_t *arg1, volatile uint32_t *arg2, decomp_state *decomp) {
+  switch (cmd) {
+    case APEDBG_CMD__MEM_GET:
+      *arg1 = _SafeLoad(*arg0);
+      break;
+
+    case APEDBG_CMD__MEM_SET:
+      _SafeStore(*arg0, *arg1);
+      break;
+
+    case APEDBG_CMD__CALL_0: {
+      uint32_t addr = *arg0;
+      *arg0 = 0;
+
+      typedef uint32_t (*funcp0_t)(void);
+      *arg1 = ((funcp0_t)addr)();
+    } break;
+
+    // ARG0: load address, ARG1: uncompressed size. Both must be word
+    // aligned. ARG0 is zeroed to acknowledge the command.
+    case APEDBG_CMD__DECOMPRESS_BEGIN:
+      if ((*arg0 | *arg1) & 3) {
+        APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+        break;
+      }
+
+      _DecompBegin(decomp, *arg0, *arg1);
+      *arg0 = 0;
+      break;
+
+    // ARG0: number of bytes of compressed data in APEDBG_STAGE. Returns the
+    // number of bytes output so far in ARG0 and their CRC32 in ARG1.
+    case APEDBG_CMD__DECOMPRESS:
+      if (*arg0 > APEDBG_STAGE_SIZE) {
+        APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+        break;
+      }
+
+      _Decomp(decomp, *arg0);
+      *arg0 = decomp->pos;
+      *arg1 = ~decomp->crc;
+      break;
+
+    // ARG0: APE address, ARG1: number of words, at most APEDBG_STAGE_SIZE/4.
+    // Copies between the address and APEDBG_STAGE, stopping at the first
+    // access which faults. Returns the number of words copied in ARG1 and
+    // advances ARG0 past them.
+    case APEDBG_CMD__MEM_READ_BLOCK:
+    case APEDBG_CMD__MEM_WRITE_BLOCK: {
+      uint32_t addr = *arg0, n = *arg1, i;
+      if (n > APEDBG_STAGE_SIZE/4) {
+        APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+        break;
+      }
+
+      for (i=0; i<n; ++i) {
+        if (cmd == APEDBG_CMD__MEM_READ_BLOCK)
+          CONSTP32(APEDBG_STAGE + i*4) = _SafeLoad(addr + i*4);
+        else
+          _SafeStore(addr + i*4, CONSTP32(APEDBG_STAGE + i*4));
+
+        if (APEDBG_CMD_ERROR_FLAGS)
+          break;
+      }
+
+      *arg0 = addr + i*4;
+      *arg1 = i;
+    } break;
+
+    // ARG0: word-aligned APE address, ARG1: pattern, ARG2: number of words.
+    // Stops at the first store which faults. Advances ARG0 past the words
+    // filled.
+    case APEDBG_CMD__FILL: {
+      uint32_t addr = *arg0, v = *arg1, n = *arg2, i;
+      if (addr & 3) {
+        APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+        break;
+      }
+
+      for (i=0; i<n; ++i) {
+        _SafeStore(addr + i*4, v);
+        if (APEDBG_CMD_ERROR_FLAGS)
+          break;
+      }
+
+      *arg0 = addr + i*4;
+    } break;
+
+    // ARG0: word-aligned APE address, ARG1: length in bytes, a multiple of 4,
+    // ARG2: CRC32 to continue from, or 0. Returns the CRC32 in ARG1 and
+    // advances ARG0 past the bytes covered, stopping at the first load which
+    // faults.
+    case APEDBG_CMD__CRC32: {
+      uint32_t addr = *arg0, n = *arg1, crc = ~*arg2, i;
+      if ((addr | n) & 3) {
+        APEDBG_CMD_ERROR_FLAGS |= APEDBG_CMD_ERROR_FLAGS__INVALID;
+        break;
+      }
+
+      for (i=0; i<n; i += 4) {
+        uint32_t v = _SafeLoad(addr + i);
+        if (APEDBG_CMD_ERROR_FLAGS)
+          break;
+
+        crc = _CRC32Byte(crc, v);
+        crc = _CRC32Byte(crc, v >> 8);
+        crc = _CRC32Byte(crc, v >> 16);
+        crc = _CRC32Byte(crc, v >> 24);
+      }
+
+      *arg0 = addr + i;
+      *arg1 = ~crc;
+    } break;
+
+    case APEDBG_CMD__WATCH_SET:
+      _WatchSet(arg0, arg1, arg2);
+      break;
+
+    case APEDBG_CMD__WATCH_CLEAR:
+      _WatchClear(arg2);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Command Ring
+// ------------
+// As well as the APEDBG_CMD mailbox, which holds one command at a time, the
+// host may queue commands in a ring of descriptors in SHM, which is drained
+// whenever the shell is otherwise idle. Each descriptor is four words: the
+// command (with magic), ARG0, ARG1 and ARG2. On completion the command word
+// is replaced with the command's error flags, and results are left in the
+// argument words as for the mailbox. Indices run from 0 to
+// APEDBG_RING_LEN-1; the host owns PROD and the shell owns CONS, and the ring
+// is full when PROD is one behind CONS. Only commands which don't use the
+// staging area, and which return, may be queued.
+static inline int _IsRingCommand(uint32_t cmd) {
+  return cmd == APEDBG_CMD__MEM_GET || cmd == APEDBG_CMD__MEM_SET
+      || cmd == APEDBG_CMD__FILL    || cmd == APEDBG_CMD__CRC32;
+}
+
+static void _DrainRing(decomp_state *decomp) {
+  uint32_t cons = APEDBG_RING_CONS, prod = APEDBG_RING_PROD;
+  if (cons == prod || prod >= APEDBG_RING_LEN || cons >= APEDBG_RING_LEN)
+    return;
+
+  // Don't disturb the error flags of a mailbox command which the host has not
+  // collected yet.
+  uint32_t savedFlags = APEDBG_CMD_ERROR_FLAGS;
+  do {
+    volatile uint32_t *desc = &CONSTVP32(APEDBG_RING_BASE + cons*16);
+    uint32_t cmd = desc[0];
+
+    APEDBG_CMD_ERROR_FLAGS = 0;
+    if ((cmd & APEDBG_CMD_MAGIC_MASK) == APEDBG_CMD_MAGIC && _IsRingCommand(cmd & APEDBG_CMD_TYPE_MASK))
+      _RunCommand(cmd & APEDBG_CMD_TYPE_MASK, &desc[1], &desc[2], &desc[3], decomp);
+    else
+      APEDBG_CMD_ERROR_FLAGS = APEDBG_CMD_ERROR_FLAGS__INVALID;
+
+    desc[0] = APEDBG_CMD_ERROR_FLAGS;
+    if (++cons == APEDBG_RING_LEN)
+      cons = 0;
+    APEDBG_RING_CONS = cons;
+  } while (cons != prod);
+
+  APEDBG_CMD_ERROR_FLAGS = savedFlags;
+}
+
+static inline uint32_t _GetCommand(decomp_state *decomp) {
   for (;;) {
     APEDBG_STATE = APEDBG_STATE_RUNNING;
 
@@ -67,6 +503,8 @@ static inline uint32_t _GetCommand(void) {
       APEDBG_CMD &= ~APEDBG_CMD_MAGIC_MASK;
       return cmd & APEDBG_CMD_TYPE_MASK;
     }
+
+    _DrainRing(decomp);
   }
 }
 
@@ -84,6 +522,9 @@ void APEShellStart(void) {
   APEDBG_CMD_ERROR_FLAGS = 0;
   APEDBG_EXCEPTION_IGNORE = 0;
   APEDBG_CMD = 0;
+  APEDBG_RING_PROD = 0;
+  APEDBG_RING_CONS = 0;
+  APEDBG_RING_MAGIC = APEDBG_RING_MAGIC__VALUE;
 
   void **nvicTable = (void**)NVIC_VECTOR_TABLE_OFFSET;
 #ifdef APE_SHELL_LOAD
@@ -95,46 +536,30 @@ void APEShellStart(void) {
   }
 #endif
 
+  // Watchpoints left by an earlier shell, e.g. one which ran before an APE
+  // reset, have a handler which may no longer be there.
+  _WatchClearAll();
+
   void *oldHardFaultHandler = nvicTable[INT_HARD_FAULT];
   nvicTable[INT_HARD_FAULT] = APEShell_IntHandler_HardFault;
 
+  decomp_state decomp = {};
+
   // Process commands.
   for (;;) {
-    uint32_t cmd = _GetCommand();
+    uint32_t cmd = _GetCommand(&decomp);
 
     APEDBG_CMD_ERROR_FLAGS = 0;
-    switch (cmd) {
-      case APEDBG_CMD__MEM_GET:
-        APEDBG_EXCEPTION_IGNORE = 1;
-        APEDBG_ARG1 = *(uint32_t*)APEDBG_ARG0;
-        APEDBG_EXCEPTION_IGNORE = 0;
-        break;
-
-      case APEDBG_CMD__MEM_SET:
-        APEDBG_EXCEPTION_IGNORE = 1;
-        *(uint32_t*)APEDBG_ARG0 = APEDBG_ARG1;
-        APEDBG_EXCEPTION_IGNORE = 0;
-        break;
-
-      case APEDBG_CMD__CALL_0: {
-        uint32_t addr = APEDBG_ARG0;
-        APEDBG_ARG0 = 0;
-
-        typedef uint32_t (*funcp0_t)(void);
-        APEDBG_ARG1 = ((funcp0_t)addr)();
-      } break;
-
-      case APEDBG_CMD__RETURN:
-        _CommandComplete();
-        nvicTable[INT_HARD_FAULT] = oldHardFaultHandler;
-        APEDBG_STATE = APEDBG_STATE_EXITED;
-        asm ("msr PRIMASK, %0" :: "r" (status));
-        return;
-
-      default:
-        break;
+    if (cmd == APEDBG_CMD__RETURN) {
+      APEDBG_RING_MAGIC = 0;
+      _CommandComplete();
+      nvicTable[INT_HARD_FAULT] = oldHardFaultHandler;
+      APEDBG_STATE = APEDBG_STATE_EXITED;
+      asm ("msr PRIMASK, %0" :: "r" (status));
+      return;
     }
 
+    _RunCommand(cmd, &APEDBG_ARG0, &APEDBG_ARG1, &APEDBG_ARG2, &decomp);
     _CommandComplete();
   }
 }
@@ -160,6 +585,15 @@ asm(
   "  pop {r4-r11}\n"
   "  pop {pc}\n"
   "  \n"
+  ".global APEShell_IntHandler_DebugMon\n"
+  ".thumb_func\n"
+  "APEShell_IntHandler_DebugMon:\n"
+  "  push {lr}\n"
+  "  push {r4-r11}\n"
+  "  mov r0, sp\n"
+  "  bl _IntHandler_DebugMon\n"
+  "  pop {r4-r11}\n"
+  "  pop {pc}\n"
   "\n"
   ".popsection\n"
 );
@@ -173,7 +607,7 @@ const __attribute__((section(".header"))) ape_header gAPE_header = {
   .imageName      = APE_IMAGE_NAME " " STRINGIFY(APE_VER_MAJOR) "." STRINGIFY(APE_VER_MINOR) "." STRINGIFY(APE_VER_PATCH),
   .imageVersion   = (APE_VER_MAJOR<<24) | (APE_VER_MINOR<<16) | (APE_VER_PATCH<<8),
 
-  .entrypoint     = (0x00100A00)|1,
+  .entrypoint     = (0x00100000)|1,
 
   .unk020         = 0x00,                       // Unknown, not read by boot ROM.
   .headerSize     = sizeof(ape_header)/4,
@@ -183,7 +617,7 @@ const __attribute__((section(".header"))) ape_header gAPE_header = {
 
   .sections = {
     [0] = {
-      .loadAddr         = 0x00100A00,
+      .loadAddr         = 0x00100000,
       .offsetFlags      = 0x78|BIT(26)|BIT(27),
       .uncompressedSize = (uint32_t)_TextSize,
       .compressedSize   = 0,
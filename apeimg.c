@@ -14,11 +14,6 @@
 #define HEX32  "0x%04X_%04X"
 #define HEX32_ "%04X_%04X"
 
-static ssize_t _Write(uint8_t ch, void *arg) {
-  *(*(uint8_t**)arg)++ = ch;
-  return 1;
-}
-
 int _OpenImage(const char *fn, struct stat *st, void **pVirt) {
   int ec, fd = -1;
   void *virt = NULL;
@@ -183,9 +178,7 @@ int _CmdInfo(int pargc, int argc, char **argv) {
           uncompBuf = malloc(uncompSize);
           assert(uncompBuf);
 
-          uint8_t *ptr = uncompBuf;
-          size_t bytesRead = 0, bytesWritten = 0;
-          Decompress(compBuf, compSize, uncompSize, _Write, &ptr, &bytesRead, &bytesWritten);
+          DecompressBuf(compBuf, compSize, uncompBuf, uncompSize);
         } else {
           uncompBuf = compBuf;
           uncompSize = compSize;
@@ -258,8 +251,8 @@ int _CmdInfo(int pargc, int argc, char **argv) {
   return 0;
 }
 
-static ssize_t _WriteStdout(uint8_t ch, void *arg) {
-  return fputc(ch, stdout) != ch ? 0 : 1;
+static ssize_t _WriteStdout(const uint8_t *buf, size_t len, void *arg) {
+  return fwrite(buf, 1, len, stdout);
 }
 
 static int _CmdExtract(int pargc, int argc, char **argv) {
@@ -321,7 +314,7 @@ static int _CmdExtract(int pargc, int argc, char **argv) {
   }
 
   size_t bytesRead, bytesWritten;
-  Decompress((uint8_t*)virt + offset, compSize, uncompSize, _WriteStdout, NULL, &bytesRead, &bytesWritten);
+  DecompressStream((uint8_t*)virt + offset, compSize, uncompSize, _WriteStdout, NULL, &bytesRead, &bytesWritten);
   return 0;
 }
 
@@ -5,12 +5,18 @@
 #include <assert.h>
 #include <endian.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <time.h>
+#include <pthread.h>
 #include "otg.h"
 #include "otg_common.c"
 
 #define BCM1A_MAGIC 0x1A4D4342 /* "BCM\x1A" */
+#define APE_MAX_SECTIONS ARRAYLEN(((ape_header*)0)->sections)
 
 static const void *g_virt;
 
@@ -23,6 +29,25 @@ static uint32_t L32(uint32_t offset) {
 #define THRESHOLD 2
 #define NIL N
 
+// Growable output buffer for the compressors.
+typedef struct {
+  uint8_t *buf;
+  size_t len, cap;
+} out_buf;
+
+static void _OutPut(out_buf *o, const uint8_t *p, size_t n) {
+  if (o->len + n > o->cap) {
+    o->cap = o->cap ? o->cap*2 : 4096;
+    if (o->cap < o->len + n)
+      o->cap = o->len + n;
+    o->buf = realloc(o->buf, o->cap);
+    assert(o->buf);
+  }
+
+  memcpy(o->buf + o->len, p, n);
+  o->len += n;
+}
+
 typedef struct {
   uint8_t dict[N+F-1];
 
@@ -138,13 +163,14 @@ static void _DeleteNode(compressor_state *st, int p) {
 
 // Compression routine adapted from original 1989 LZSS.C by Haruhiko Okumura.
 // "Use, distribute, and modify this program freely."
-static void _Compress(const void *in, size_t inBytes, FILE *fo, size_t *bytesRead, size_t *bytesWritten) {
+static void _CompressTree(const void *in, size_t inBytes, out_buf *out, size_t *bytesRead, size_t *bytesWritten) {
   const uint8_t *in_ = in;
   const uint8_t *inEnd = in_ + inBytes;
   size_t bytesWritten_ = 0;
 
   compressor_state st;
 
+  *bytesRead = *bytesWritten = 0;
   if (!inBytes)
     return;
 
@@ -201,8 +227,7 @@ static void _Compress(const void *in, size_t inBytes, FILE *fo, size_t *bytesRea
     mask <<= 1;
     if (!mask) {
       // Send at most eight units of code together.
-      for (i=0; i<codeBufPtr; ++i)
-        fputc(codeBuf[i], fo);
+      _OutPut(out, codeBuf, codeBufPtr);
       bytesWritten_ += codeBufPtr;
       codeBuf[0] = 0;
       codeBufPtr = mask = 1;
@@ -237,8 +262,7 @@ static void _Compress(const void *in, size_t inBytes, FILE *fo, size_t *bytesRea
 
   // Send remaining code.
   if (codeBufPtr > 1) {
-    for (i=0; i<codeBufPtr; ++i)
-      fputc(codeBuf[i], fo);
+    _OutPut(out, codeBuf, codeBufPtr);
     bytesWritten_ += codeBufPtr;
   }
 
@@ -246,21 +270,884 @@ static void _Compress(const void *in, size_t inBytes, FILE *fo, size_t *bytesRea
   *bytesWritten = bytesWritten_;
 }
 
-static ssize_t _WriteBuf(uint8_t ch, void *arg) {
-  *(*(uint8_t**)arg)++ = ch;
-  return 1;
+/* Hash Chain Compressor
+ * ---------------------
+ * A faster alternative to the tree-based compressor above which produces the
+ * same format. Rather than a ring buffer, the input is treated as a linear
+ * buffer preceded by N-F bytes of 0x20, which is what the decompressor's
+ * dictionary holds before any output is produced. A match at distance dist
+ * from linear position p then refers to dictionary position (p-dist)%N, since
+ * the decompressor's cursor starts at N-F. Distances are limited to N-F, the
+ * same as the tree compressor, so that a match never refers to dictionary
+ * bytes the decompressor has not initialized.
+ *
+ * Each position is entered into a hash chain keyed on its first three bytes
+ * (the shortest match worth encoding). The number of chain entries examined
+ * per position, and whether lazy matching is used (deferring a match by one
+ * byte if the next position has a longer one), are set by the level.
+ */
+#define HC_PREFIX     (N-F)
+#define HC_HASH_BITS  15
+#define HC_HASH_SIZE  (1U<<HC_HASH_BITS)
+#define HC_MAX_DIST   (N-F)
+
+typedef struct {
+  uint16_t maxChain;  // Maximum number of chain entries to examine.
+  uint8_t  niceLen;   // Stop searching once a match this long is found.
+  bool     lazy;
+} hc_level;
+
+// Level 0 selects _CompressTree, and level 10 _CompressOptimal. Each level
+// compresses at least as well as the one below it and runs no faster; on code,
+// levels 1-5 give larger output than level 0 (but run several times faster),
+// and levels 6-9 give smaller output. Check changes with apestamp -b.
+static const hc_level _hcLevels[] = {
+  [1] = {   2,  8, false},
+  [2] = {   4, 16, false},
+  [3] = {   8, 16, false},
+  [4] = {  16, 16, false},
+  [5] = {  32,  F, false},
+  [6] = {  16, 16, true },
+  [7] = {  32, 16, true },
+  [8] = {  64,  F, true },
+  [9] = {4096,  F, true },
+};
+
+#define MAX_HC_LEVEL 9
+#define MAX_LEVEL    10 // Optimal parse; see _CompressOptimal.
+
+typedef struct {
+  const uint8_t *buf;   // HC_PREFIX bytes of 0x20 followed by the input.
+  size_t end;           // Length of buf.
+  int32_t head[HC_HASH_SIZE];
+  int32_t *prev;        // Indexed by position in buf.
+  size_t numInserted;   // All positions below this are in the chains.
+} hc_state;
+
+static inline uint32_t _HCHash(const uint8_t *p) {
+  return ((p[0]<<10) ^ (p[1]<<5) ^ p[2]) & (HC_HASH_SIZE-1);
+}
+
+static void _HCInsertUpTo(hc_state *hc, size_t pos) {
+  for (; hc->numInserted < pos; ++hc->numInserted) {
+    size_t q = hc->numInserted;
+    if (q + 3 > hc->end)
+      continue;
+    uint32_t h = _HCHash(hc->buf + q);
+    hc->prev[q] = hc->head[h];
+    hc->head[h] = q;
+  }
+}
+
+// Returns the length of the longest match for position p, or 0 if there is
+// no match longer than THRESHOLD, and sets *distOut.
+static int _HCFindMatch(const hc_state *hc, size_t p, const hc_level *lvl, size_t *distOut) {
+  const uint8_t *buf = hc->buf;
+  size_t maxLen = hc->end - p;
+  if (maxLen > F)
+    maxLen = F;
+  if (maxLen <= THRESHOLD)
+    return 0;
+
+  size_t bestLen = THRESHOLD, bestDist = 0;
+  unsigned chain = lvl->maxChain;
+  for (int32_t q = hc->head[_HCHash(buf + p)]; q >= 0 && p - q <= HC_MAX_DIST && chain--; q = hc->prev[q]) {
+    // Quick rejection: a candidate can only be better if it matches at
+    // bestLen.
+    if (buf[q + bestLen] != buf[p + bestLen])
+      continue;
+
+    size_t len = 0;
+    while (len < maxLen && buf[q+len] == buf[p+len])
+      ++len;
+
+    if (len > bestLen) {
+      bestLen  = len;
+      bestDist = p - q;
+      if (len >= lvl->niceLen || len == maxLen)
+        break;
+    }
+  }
+
+  *distOut = bestDist;
+  return bestLen > THRESHOLD ? bestLen : 0;
+}
+
+// Emits literals and matches, grouping them into units of eight under a flags
+// byte as the decompressor expects.
+typedef struct {
+  out_buf *out;
+  size_t flagsPos;
+  uint8_t mask;
+} cmps_encoder;
+
+static void _EncLiteral(cmps_encoder *enc, uint8_t c) {
+  if (!enc->mask) {
+    enc->flagsPos = enc->out->len;
+    _OutPut(enc->out, (const uint8_t*)"", 1);
+    enc->mask = 1;
+  }
+
+  enc->out->buf[enc->flagsPos] |= enc->mask;
+  _OutPut(enc->out, &c, 1);
+  enc->mask <<= 1;
+}
+
+static void _EncMatch(cmps_encoder *enc, uint32_t pos, uint32_t len) {
+  if (!enc->mask) {
+    enc->flagsPos = enc->out->len;
+    _OutPut(enc->out, (const uint8_t*)"", 1);
+    enc->mask = 1;
+  }
+
+  assert(len > THRESHOLD && len <= F && pos < N);
+  uint8_t code[2] = {
+    (uint8_t)pos,
+    (uint8_t)(((pos >> 3) & 0xE0) | (len - (THRESHOLD+1))),
+  };
+  _OutPut(enc->out, code, 2);
+  enc->mask <<= 1;
+}
+
+// Sets up hc for compressing in, which it copies after the 0x20 prefix.
+static hc_state *_HCNew(const void *in, size_t inBytes) {
+  hc_state *hc = malloc(sizeof(hc_state));
+  uint8_t *buf = malloc(HC_PREFIX + inBytes);
+  assert(hc && buf);
+  memset(buf, 0x20, HC_PREFIX);
+  memcpy(buf + HC_PREFIX, in, inBytes);
+
+  hc->buf  = buf;
+  hc->end  = HC_PREFIX + inBytes;
+  hc->prev = malloc(hc->end * sizeof(*hc->prev));
+  assert(hc->prev);
+  hc->numInserted = 0;
+  for (size_t i=0; i<HC_HASH_SIZE; ++i)
+    hc->head[i] = -1;
+
+  _HCInsertUpTo(hc, HC_PREFIX);
+  return hc;
+}
+
+static void _HCFree(hc_state *hc) {
+  free((void*)hc->buf);
+  free(hc->prev);
+  free(hc);
+}
+
+static void _CompressHashChain(const void *in, size_t inBytes, int level, out_buf *out, size_t *bytesRead, size_t *bytesWritten) {
+  const hc_level *lvl = &_hcLevels[level];
+  size_t outStart = out->len;
+
+  *bytesRead = *bytesWritten = 0;
+  if (!inBytes)
+    return;
+
+  hc_state *hc = _HCNew(in, inBytes);
+  const uint8_t *buf = hc->buf;
+  cmps_encoder enc = {.out = out};
+  size_t p = HC_PREFIX;
+  while (p < hc->end) {
+    size_t dist;
+    size_t len = _HCFindMatch(hc, p, lvl, &dist);
+
+    // Lazy matching: if the next position has a longer match, emit this byte
+    // as a literal and take that match instead.
+    while (lvl->lazy && len && len < lvl->niceLen && p+1 < hc->end) {
+      size_t dist2;
+      _HCInsertUpTo(hc, p+1);
+      size_t len2 = _HCFindMatch(hc, p+1, lvl, &dist2);
+      if (len2 <= len)
+        break;
+
+      _EncLiteral(&enc, buf[p]);
+      ++p;
+      len  = len2;
+      dist = dist2;
+    }
+
+    if (len) {
+      _EncMatch(&enc, (p - dist) % N, len);
+      p += len;
+    } else {
+      _EncLiteral(&enc, buf[p]);
+      ++p;
+    }
+
+    _HCInsertUpTo(hc, p);
+  }
+
+  _HCFree(hc);
+
+  *bytesRead = inBytes;
+  *bytesWritten = out->len - outStart;
+}
+
+/* Optimal Parse
+ * -------------
+ * Every literal costs 9 bits (a flag bit and a byte) and every match 17 bits
+ * (a flag bit and two bytes), whatever its length or distance, so the
+ * smallest encoding is a shortest path through the input where from each
+ * position one can advance by one byte for 9, or by any length from 3 up to
+ * the longest match available there for 17. Because the match cost does not
+ * depend on the length, only the longest match at each position (and its
+ * distance, which serves for every shorter length too) needs to be known.
+ *
+ * The longest matches are found with an exhaustive hash chain search, then
+ * the path is computed backwards from the end of the input.
+ */
+#define OPT_LEVEL       (MAX_HC_LEVEL+1)
+#define OPT_COST_LIT    9
+#define OPT_COST_MATCH  17
+
+static void _CompressOptimal(const void *in, size_t inBytes, out_buf *out, size_t *bytesRead, size_t *bytesWritten) {
+  static const hc_level lvl = {HC_MAX_DIST, F, false};
+  size_t outStart = out->len;
+
+  *bytesRead = *bytesWritten = 0;
+  if (!inBytes)
+    return;
+
+  hc_state *hc = _HCNew(in, inBytes);
+  uint8_t  *matchLen  = malloc(inBytes);
+  uint16_t *matchDist = malloc(inBytes * sizeof(uint16_t));
+  uint32_t *cost      = malloc((inBytes+1) * sizeof(uint32_t));
+  uint8_t  *choice    = malloc(inBytes);
+  assert(matchLen && matchDist && cost && choice);
+
+  for (size_t i=0; i<inBytes; ++i) {
+    size_t dist = 0;
+    _HCInsertUpTo(hc, HC_PREFIX + i);
+    matchLen[i]  = _HCFindMatch(hc, HC_PREFIX + i, &lvl, &dist);
+    matchDist[i] = dist;
+  }
+
+  // choice[i] is the length of the step taken from i: 1 for a literal,
+  // otherwise a match length.
+  cost[inBytes] = 0;
+  for (size_t i=inBytes; i--;) {
+    cost[i]   = cost[i+1] + OPT_COST_LIT;
+    choice[i] = 1;
+    for (size_t len=THRESHOLD+1; len<=matchLen[i]; ++len)
+      if (cost[i+len] + OPT_COST_MATCH < cost[i]) {
+        cost[i]   = cost[i+len] + OPT_COST_MATCH;
+        choice[i] = len;
+      }
+  }
+
+  cmps_encoder enc = {.out = out};
+  for (size_t i=0; i<inBytes; i += choice[i]) {
+    if (choice[i] == 1)
+      _EncLiteral(&enc, hc->buf[HC_PREFIX + i]);
+    else
+      _EncMatch(&enc, (HC_PREFIX + i - matchDist[i]) % N, choice[i]);
+  }
+
+  free(choice);
+  free(cost);
+  free(matchDist);
+  free(matchLen);
+  _HCFree(hc);
+
+  *bytesRead = inBytes;
+  *bytesWritten = out->len - outStart;
+}
+
+static void _Compress(const void *in, size_t inBytes, int level, out_buf *out, size_t *bytesRead, size_t *bytesWritten) {
+  if (level == OPT_LEVEL)
+    _CompressOptimal(in, inBytes, out, bytesRead, bytesWritten);
+  else if (level)
+    _CompressHashChain(in, inBytes, level, out, bytesRead, bytesWritten);
+  else
+    _CompressTree(in, inBytes, out, bytesRead, bytesWritten);
+}
+
+typedef struct {
+  uint8_t *p, *end;
+} buf_writer;
+
+static ssize_t _WriteBufChunk(const uint8_t *buf, size_t len, void *arg) {
+  buf_writer *w = arg;
+  if (len > (size_t)(w->end - w->p))
+    len = w->end - w->p;
+  memcpy(w->p, buf, len);
+  w->p += len;
+  return len;
+}
+
+// Checks that compressed data decompresses to expected with the reentrant
+// decoder, when given the whole buffer at once, through the streaming
+// callback, and when fed input and output a few bytes at a time. Returns NULL
+// on success or a description of the failure.
+static const char *_VerifyDecompress(const uint8_t *comp, size_t compLen, const uint8_t *expected, size_t uncompSize) {
+  static const size_t chunkSizes[] = {1, 2, 3, 5, 7, 13, 34, 35, 64, 257, 4096};
+  const char *err = NULL;
+  uint8_t *buf = malloc(uncompSize+1);
+  assert(buf);
+
+  if (DecompressBuf(comp, compLen, buf, uncompSize) != uncompSize || memcmp(buf, expected, uncompSize)) {
+    err = "DecompressBuf output differs from input";
+    goto out;
+  }
+
+  memset(buf, 0, uncompSize);
+  buf_writer w = {buf, buf + uncompSize};
+  size_t rd, wr;
+  DecompressStream(comp, compLen, uncompSize, _WriteBufChunk, &w, &rd, &wr);
+  if (wr != uncompSize || memcmp(buf, expected, uncompSize)) {
+    err = "DecompressStream output differs from input";
+    goto out;
+  }
+
+  memset(buf, 0, uncompSize);
+  cmps_decoder d;
+  DecompressInit(&d, uncompSize);
+  size_t inOff = 0, outOff = 0;
+  for (size_t i=0;; ++i) {
+    size_t inChunk  = chunkSizes[i % ARRAYLEN(chunkSizes)];
+    size_t outChunk = chunkSizes[(i*7 + 3) % ARRAYLEN(chunkSizes)];
+    if (inChunk > compLen - inOff)
+      inChunk = compLen - inOff;
+    if (outChunk > uncompSize - outOff)
+      outChunk = uncompSize - outOff;
+
+    size_t used;
+    size_t n = DecompressChunk(&d, comp + inOff, inChunk, &used, buf + outOff, outChunk);
+    inOff  += used;
+    outOff += n;
+    if (!n && !used)
+      break;
+  }
+  if (outOff != uncompSize || memcmp(buf, expected, uncompSize))
+    err = "chunked DecompressChunk output differs from input";
+
+out:
+  free(buf);
+  return err;
+}
+
+static double _Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static bool _IsAPEImage(const void *virt, size_t size) {
+  const ape_header *hdr = virt;
+  return size >= sizeof(ape_header) && !memcmp(hdr->magic, "BCM\x1A", 4) && hdr->numSections <= ARRAYLEN(hdr->sections);
+}
+
+// Returns the contents of section i of an APE image in a new buffer,
+// decompressing it first if the image is stamped. Returns NULL with *skip set
+// for sections which have no contents in the image, and NULL after printing an
+// error if the section is malformed.
+static uint8_t *_LoadSection(const void *virt, size_t size, size_t i, uint32_t *uncompSize, bool *skip) {
+  const ape_header *hdr = virt;
+  uint32_t offsetFlags = le32toh(hdr->sections[i].offsetFlags);
+  uint32_t offset      = offsetFlags & 0xFFFFFF;
+  uint32_t compSize    = le32toh(hdr->sections[i].compressedSize);
+  *uncompSize = le32toh(hdr->sections[i].uncompressedSize);
+  *skip = !!(offsetFlags & APE_SECTION_FLAG_ZERO_ON_FAST_BOOT);
+  if (*skip)
+    return NULL;
+
+  uint32_t inSize = (offsetFlags & APE_SECTION_FLAG_COMPRESSED) ? compSize : *uncompSize;
+  if (offset > size || inSize > size - offset) {
+    fprintf(stderr, "section %zu exceeds file length\n", i);
+    return NULL;
+  }
+
+  uint8_t *data = malloc(*uncompSize);
+  assert(data);
+  if (offsetFlags & APE_SECTION_FLAG_COMPRESSED) {
+    if (DecompressBuf((uint8_t*)virt + offset, compSize, data, *uncompSize) != *uncompSize) {
+      fprintf(stderr, "section %zu does not decompress\n", i);
+      free(data);
+      return NULL;
+    }
+  } else
+    memcpy(data, (uint8_t*)virt + offset, *uncompSize);
+
+  return data;
+}
+
+// Compresses each section of an APE image at every level, verifying the
+// result, and reports the compressed sizes and throughput. The image may be
+// either unstamped or stamped (in which case sections are decompressed first).
+static int _Bench(const void *virt, size_t size) {
+  const ape_header *hdr = virt;
+  if (!_IsAPEImage(virt, size)) {
+    fprintf(stderr, "not an APE image\n");
+    return 1;
+  }
+
+  size_t totalIn = 0, totalOut[MAX_LEVEL+1] = {};
+  double totalTime[MAX_LEVEL+1] = {};
+
+  printf("Sec  Level  Uncomp Sz  Comp Sz    Ratio   Time (ms)  MB/s\n");
+  printf("---  -----  ---------  ---------  ------  ---------  -------\n");
+  for (size_t i=0; i<hdr->numSections; ++i) {
+    uint32_t uncompSize;
+    bool skip;
+    uint8_t *data = _LoadSection(virt, size, i, &uncompSize, &skip);
+    if (skip)
+      continue;
+    if (!data)
+      return 1;
+
+    totalIn += uncompSize;
+    for (int level=0; level<=MAX_LEVEL; ++level) {
+      // Repeat small sections to get a usable timing.
+      out_buf out = {};
+      size_t rd, wr, reps = 0;
+      double start = _Now(), elapsed;
+      do {
+        out.len = 0;
+        _Compress(data, uncompSize, level, &out, &rd, &wr);
+        ++reps;
+        elapsed = _Now() - start;
+      } while (elapsed < 0.05);
+      elapsed /= reps;
+
+      const char *err = _VerifyDecompress(out.buf, out.len, data, uncompSize);
+
+      printf("%3zu  %5d  %9u  %9zu  %5.1f%%  %9.3f  %7.2f%s%s\n",
+        i, level, uncompSize, out.len, uncompSize ? 100.0*out.len/uncompSize : 0.0,
+        elapsed*1e3, uncompSize/elapsed/1e6, err ? "  VERIFY FAILED: " : "", err ? err : "");
+      totalOut[level]  += out.len;
+      totalTime[level] += elapsed;
+      free(out.buf);
+    }
+
+    free(data);
+  }
+
+  for (int level=0; level<=MAX_LEVEL; ++level)
+    printf("all  %5d  %9zu  %9zu  %5.1f%%  %9.3f  %7.2f\n",
+      level, totalIn, totalOut[level], totalIn ? 100.0*totalOut[level]/totalIn : 0.0,
+      totalTime[level]*1e3, totalIn/totalTime[level]/1e6);
+
+  return 0;
+}
+
+/* Self Test
+ * ---------
+ * Exercises the compressors and the reentrant decoder without any hardware:
+ *  - round trips at every level over generated corpora: random bytes, text
+ *    made of a small vocabulary, code-like data built from repeated words,
+ *    runs of 0x20 and zero (which interact with the dictionary prefill), and
+ *    every length from 0 to 64;
+ *  - truncated and corrupted streams fed to DecompressChunk with guard bytes
+ *    around the output buffer, which must never be overrun;
+ *  - compression and decompression throughput for each level;
+ *  - round trips at every level over any files given on the command line, so
+ *    that real firmware and text are covered too. APE images are split into
+ *    their sections, which are decompressed first if the image is stamped.
+ * The PRNG is seeded with a constant, so failures are reproducible.
+ */
+static uint32_t _testRand = 0x2545F491;
+
+static uint32_t _TestRand(void) {
+  _testRand ^= _testRand << 13;
+  _testRand ^= _testRand >> 17;
+  _testRand ^= _testRand << 5;
+  return _testRand;
+}
+
+enum {
+  CORPUS_RANDOM = 0,
+  CORPUS_TEXT,
+  CORPUS_CODE,
+  CORPUS_SPACES,
+  CORPUS_ZEROES,
+  CORPUS__COUNT,
+};
+
+static const char *const _corpusNames[] = {"random", "text", "code", "spaces", "zeroes"};
+
+static void _GenCorpus(int type, uint8_t *buf, size_t len) {
+  static const char *const words[] = {
+    "the ", "APE ", "firmware ", "section ", "of ", "and ", "NCSI ", "packet ",
+    "\n", "0x", "register ", "to ", "a ", "is ", "BCM5719 ", ", ",
+  };
+  uint32_t insns[16];
+  for (size_t i=0; i<ARRAYLEN(insns); ++i)
+    insns[i] = _TestRand();
+
+  for (size_t i=0; i<len;) {
+    switch (type) {
+      case CORPUS_RANDOM:
+        buf[i++] = _TestRand();
+        break;
+      case CORPUS_TEXT: {
+        const char *w = words[_TestRand() % ARRAYLEN(words)];
+        for (; *w && i<len; ++w)
+          buf[i++] = *w;
+      } break;
+      case CORPUS_CODE: {
+        // Mostly a small set of instruction words with occasional varying
+        // immediates, roughly like Thumb-2 code.
+        uint32_t v = insns[_TestRand() % ARRAYLEN(insns)];
+        if (!(_TestRand() % 4))
+          v ^= _TestRand() & 0xFFF;
+        for (size_t j=0; j<4 && i<len; ++j)
+          buf[i++] = v >> (j*8);
+      } break;
+      case CORPUS_SPACES:
+        buf[i++] = (_TestRand() % 64) ? 0x20 : _TestRand();
+        break;
+      default:
+        buf[i++] = 0;
+        break;
+    }
+  }
+}
+
+#define GUARD_LEN 64
+
+// Decodes a (possibly corrupt) stream in randomly sized pieces, checking that
+// the decoder stays within its buffers. Returns false on failure.
+static bool _TestDecodeRobust(const uint8_t *comp, size_t compLen, size_t uncompSize) {
+  uint8_t *buf = malloc(uncompSize + 2*GUARD_LEN);
+  assert(buf);
+  memset(buf, 0xA5, uncompSize + 2*GUARD_LEN);
+
+  cmps_decoder d;
+  DecompressInit(&d, uncompSize);
+  size_t inOff = 0, outOff = 0;
+  bool ok = true;
+  for (;;) {
+    size_t inChunk  = 1 + _TestRand() % 64;
+    size_t outChunk = 1 + _TestRand() % 256;
+    if (inChunk > compLen - inOff)
+      inChunk = compLen - inOff;
+    if (outChunk > uncompSize - outOff)
+      outChunk = uncompSize - outOff;
+
+    size_t used;
+    size_t n = DecompressChunk(&d, comp + inOff, inChunk, &used, buf + GUARD_LEN + outOff, outChunk);
+    if (used > inChunk || n > outChunk) {
+      ok = false;
+      break;
+    }
+    inOff  += used;
+    outOff += n;
+    if (!n && !used)
+      break;
+  }
+
+  for (size_t i=0; i<GUARD_LEN; ++i)
+    if (buf[i] != 0xA5 || buf[GUARD_LEN + uncompSize + i] != 0xA5)
+      ok = false;
+  if (outOff > uncompSize)
+    ok = false;
+
+  free(buf);
+  return ok;
+}
+
+// Round-trips one file corpus at every level. Returns the number of failures.
+static unsigned _SelfTestCorpus(const char *name, const uint8_t *data, size_t len, unsigned *roundTrips) {
+  unsigned failures = 0;
+  for (int level=0; level<=MAX_LEVEL; ++level) {
+    out_buf out = {};
+    size_t rd, wr;
+    _Compress(data, len, level, &out, &rd, &wr);
+    const char *err = _VerifyDecompress(out.buf, out.len, data, len);
+    if (err) {
+      printf("FAIL: %s, level %d: %s\n", name, level, err);
+      ++failures;
+    }
+    ++*roundTrips;
+    free(out.buf);
+  }
+  return failures;
+}
+
+// Round-trips a file, or each section of it if it is an APE image. Returns the
+// number of failures.
+static unsigned _SelfTestFile(const char *fn, unsigned *roundTrips) {
+  FILE *f = fopen(fn, "rb");
+  if (!f) {
+    printf("FAIL: %s: can't open\n", fn);
+    return 1;
+  }
+
+  size_t size = 0, cap = 0;
+  uint8_t *buf = NULL;
+  for (;;) {
+    if (size == cap) {
+      cap = cap ? cap*2 : 65536;
+      buf = realloc(buf, cap);
+      assert(buf);
+    }
+    size_t n = fread(buf + size, 1, cap - size, f);
+    if (!n)
+      break;
+    size += n;
+  }
+  bool readErr = ferror(f);
+  fclose(f);
+  if (readErr) {
+    printf("FAIL: %s: can't read\n", fn);
+    free(buf);
+    return 1;
+  }
+
+  unsigned failures = 0;
+  char name[PATH_MAX+32];
+  if (_IsAPEImage(buf, size)) {
+    const ape_header *hdr = (const ape_header*)buf;
+    for (size_t i=0; i<hdr->numSections; ++i) {
+      uint32_t uncompSize;
+      bool skip;
+      uint8_t *data = _LoadSection(buf, size, i, &uncompSize, &skip);
+      if (skip)
+        continue;
+      snprintf(name, sizeof(name), "%s section %zu", fn, i);
+      if (!data) {
+        printf("FAIL: %s: can't load\n", name);
+        ++failures;
+        continue;
+      }
+      failures += _SelfTestCorpus(name, data, uncompSize, roundTrips);
+      printf("%s: %u bytes\n", name, uncompSize);
+      free(data);
+    }
+  } else {
+    failures += _SelfTestCorpus(fn, buf, size, roundTrips);
+    printf("%s: %zu bytes\n", fn, size);
+  }
+
+  free(buf);
+  return failures;
+}
+
+static int _SelfTest(char **files, size_t numFiles) {
+  enum { CORPUS_SIZE = 64*1024 };
+  unsigned failures = 0, roundTrips = 0, robustness = 0;
+  uint8_t *data = malloc(CORPUS_SIZE);
+  uint8_t *dec  = malloc(CORPUS_SIZE);
+  assert(data && dec);
+
+  printf("Corpus  Level  Comp Sz    Ratio   Comp MB/s  Decomp MB/s\n");
+  printf("------  -----  ---------  ------  ---------  -----------\n");
+  for (int type=0; type<CORPUS__COUNT; ++type) {
+    _GenCorpus(type, data, CORPUS_SIZE);
+    for (int level=0; level<=MAX_LEVEL; ++level) {
+      // Short inputs of every length.
+      for (size_t len=0; len<=64; ++len) {
+        out_buf out = {};
+        size_t rd, wr;
+        _Compress(data, len, level, &out, &rd, &wr);
+        const char *err = _VerifyDecompress(out.buf, out.len, data, len);
+        if (err) {
+          printf("FAIL: %s, level %d, length %zu: %s\n", _corpusNames[type], level, len, err);
+          ++failures;
+        }
+        ++roundTrips;
+        free(out.buf);
+      }
+
+      // Full corpus, timed.
+      out_buf out = {};
+      size_t rd, wr;
+      double t0 = _Now();
+      _Compress(data, CORPUS_SIZE, level, &out, &rd, &wr);
+      double t1 = _Now();
+      size_t decLen = DecompressBuf(out.buf, out.len, dec, CORPUS_SIZE);
+      double t2 = _Now();
+      const char *err = _VerifyDecompress(out.buf, out.len, data, CORPUS_SIZE);
+      if (decLen != CORPUS_SIZE || err) {
+        printf("FAIL: %s, level %d: %s\n", _corpusNames[type], level, err ? err : "short output");
+        ++failures;
+      }
+      ++roundTrips;
+
+      printf("%-6s  %5d  %9zu  %5.1f%%  %9.2f  %11.2f\n", _corpusNames[type], level, out.len,
+        100.0*out.len/CORPUS_SIZE, CORPUS_SIZE/(t1-t0)/1e6, CORPUS_SIZE/(t2-t1)/1e6);
+
+      // Truncation and corruption. Only the reentrant decoder is exercised
+      // here; the output is meaningless, but the decoder must stay in bounds.
+      if (level == 0 || level == MAX_LEVEL) {
+        uint8_t *bad = malloc(out.len + 1);
+        assert(bad);
+        for (size_t i=0; i<200; ++i) {
+          size_t badLen = out.len ? _TestRand() % (out.len+1) : 0;
+          memcpy(bad, out.buf, badLen);
+          for (size_t j=_TestRand() % 4; j && badLen; --j)
+            bad[_TestRand() % badLen] = _TestRand();
+          if (!_TestDecodeRobust(bad, badLen, CORPUS_SIZE)) {
+            printf("FAIL: %s, level %d: decoder overran its buffers on a damaged stream\n", _corpusNames[type], level);
+            ++failures;
+            break;
+          }
+          ++robustness;
+        }
+        for (size_t i=0; i<200; ++i) {
+          // Pure garbage, with a small output size so matches run past it.
+          size_t badLen = _TestRand() % (out.len+1);
+          for (size_t j=0; j<badLen; ++j)
+            bad[j] = _TestRand();
+          if (!_TestDecodeRobust(bad, badLen, _TestRand() % 512)) {
+            printf("FAIL: decoder overran its buffers on a random stream\n");
+            ++failures;
+            break;
+          }
+          ++robustness;
+        }
+        free(bad);
+      }
+
+      free(out.buf);
+    }
+  }
+
+  free(data);
+  free(dec);
+
+  for (size_t i=0; i<numFiles; ++i)
+    failures += _SelfTestFile(files[i], &roundTrips);
+
+  printf("%u round trips, %u damaged streams, %u failures\n", roundTrips, robustness, failures);
+  return failures ? 1 : 0;
 }
 
+// Parallel Section Compression
+// ----------------------------
+// Sections are independent, so each is compressed into its own buffer by a
+// pool of worker threads taking sections in turn. The output is then written
+// out in section order by the main thread, so it is byte-identical whatever
+// the number of threads. Each section is verified by the main thread as it
+// is written out.
+typedef struct {
+  const uint8_t *in;
+  uint32_t      uncompSize;
+  int           level;
+  bool          wantRef;      // Also compress at level 0 for comparison.
+
+  out_buf       comp;         // Padded to a multiple of 4 bytes.
+  size_t        readBytes;
+  size_t        refLen;       // Padded level 0 size, if wantRef.
+} section_job;
+
+typedef struct {
+  section_job *jobs;
+  size_t      numJobs;
+  size_t      next;
+} job_queue;
+
+static void _CompressSection(section_job *job) {
+  size_t writtenBytes = 0;
+  _Compress(job->in, job->uncompSize, job->level, &job->comp, &job->readBytes, &writtenBytes);
+
+  size_t r = writtenBytes % 4;
+  if (r) {
+    static const uint8_t _zeroes[4] = {};
+    _OutPut(&job->comp, _zeroes, 4-r);
+  }
+
+  if (job->wantRef) {
+    out_buf ref = {};
+    size_t refRead, refWritten;
+    _Compress(job->in, job->uncompSize, 0, &ref, &refRead, &refWritten);
+    job->refLen = (refWritten+3) & ~(size_t)3;
+    free(ref.buf);
+  }
+}
+
+static void *_CompressWorker(void *arg) {
+  job_queue *q = arg;
+  size_t i;
+  while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->numJobs)
+    _CompressSection(&q->jobs[i]);
+  return NULL;
+}
+
+// Runs all jobs using up to numThreads threads, including the calling thread.
+static void _CompressSections(section_job *jobs, size_t numJobs, int numThreads) {
+  job_queue q = {.jobs = jobs, .numJobs = numJobs};
+  pthread_t threads[APE_MAX_SECTIONS];
+  size_t numStarted = 0;
+
+  for (int i=1; i<numThreads && numStarted+1 < numJobs; ++i) {
+    if (pthread_create(&threads[numStarted], NULL, _CompressWorker, &q))
+      break; // Just use fewer threads.
+    ++numStarted;
+  }
+
+  _CompressWorker(&q);
+
+  for (size_t i=0; i<numStarted; ++i)
+    pthread_join(threads[i], NULL);
+}
+
+static int _level = 0;
+static int _jobs = APE_MAX_SECTIONS;
+static bool _bench = false;
+static bool _selfTest = false;
+static bool _verbose = false;
+
+static error_t _ParseOpt(int key, char *arg, struct argp_state *state) {
+  char *end;
+  switch (key) {
+    case 'l':
+      _level = strtol(arg, &end, 10);
+      if (*end || _level < 0 || _level > MAX_LEVEL)
+        argp_error(state, "level must be between 0 and %d", MAX_LEVEL);
+      return 0;
+    case 'j':
+      _jobs = strtol(arg, &end, 10);
+      if (*end || _jobs < 1)
+        argp_error(state, "number of threads must be at least 1");
+      return 0;
+    case 'b':
+      _bench = true;
+      return 0;
+    case 't':
+      _selfTest = true;
+      return 0;
+    case 'v':
+      _verbose = true;
+      return 0;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+}
+
+static const struct argp_option _argpOpts[] = {
+  {"level", 'l', "N",  0, "Compression level. 0 (the default) uses the original tree compressor; 1-9 use the hash chain compressor, from fastest to smallest output; 10 finds the smallest possible output (slow)"},
+  {"jobs", 'j', "N", 0, "Compress up to N sections at once (default 4); the output is the same for any N"},
+  {"verbose", 'v', NULL, 0, "Report the compressed size of each section, and with -l, the size level 0 would have produced"},
+  {"bench", 'b', NULL, 0, "Compress every section of an APE image at every level and report sizes and times, instead of stamping"},
+  {"self-test", 't', NULL, 0, "Run round-trip, damaged stream and throughput tests of the compressors and decompressor on generated data, and round trips on any files given, instead of stamping"},
+  {},
+};
+
+static const struct argp _argp = {
+  .options = _argpOpts,
+  .parser = _ParseOpt,
+  .args_doc = "<input-image-file> <output-image-file>\n-b <image-file>\n-t [<file>...]",
+  .doc = "Stamps APE code image with CRC, compresses sections, performs sanity checks. Build system use only.\n",
+};
+
 int main(int argc, char **argv) {
   int ec;
+  int argidx;
+
+  error_t argerr = argp_parse(&_argp, argc, argv, 0, &argidx, NULL);
+  if (!argerr && _selfTest)
+    return _SelfTest(argv + argidx, argc - argidx);
 
-  if (argc < 3) {
-    fprintf(stderr, "usage: <input-image-file output-image-file>\n");
-    fprintf(stderr, "Stamps APE code image with CRC, compresses sections, performs sanity checks. Build system use only.\n");
+  if (argerr || !argv[argidx] || (!_bench && !argv[argidx+1])) {
+    argp_help(&_argp, stderr, ARGP_HELP_STD_USAGE, argv[0]);
     return 2;
   }
 
-  int fd = open(argv[1], O_RDONLY|O_SYNC);
+  const char *inFn  = argv[argidx];
+  const char *outFn = argv[argidx+1];
+
+  int fd = open(inFn, O_RDONLY|O_SYNC);
   if (fd < 0)
     return 1;
 
@@ -277,6 +1164,9 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (_bench)
+    return _Bench(virt, st.st_size);
+
   if (st.st_size % 4) {
     fprintf(stderr, "error: filesize not a multiple of 4\n");
     return 1;
@@ -327,7 +1217,7 @@ int main(int argc, char **argv) {
       return 1;
     }
 
-  FILE *fo = fopen(argv[2], "w+b");
+  FILE *fo = fopen(outFn, "w+b");
   if (!fo) {
     fprintf(stderr, "cannot open output file\n");
     return 1;
@@ -400,10 +1290,25 @@ int main(int argc, char **argv) {
     curOffset += uncompSize;
   }
 
-  void *verifyInBuf = NULL, *verifyOutBuf = NULL;
-  size_t verifyInBufSize = 0, verifyOutBufSize = 0;
+  // Compress sections.
+  section_job jobs[APE_MAX_SECTIONS] = {};
+  section_job *jobForSection[APE_MAX_SECTIONS] = {};
+  size_t numJobs = 0;
+  for (size_t i=0; i<hdr2->numSections; ++i) {
+    if (le32toh(hdr2->sections[i].offsetFlags) & APE_SECTION_FLAG_ZERO_ON_FAST_BOOT)
+      continue;
 
-  // Compress and output sections.
+    section_job *job = &jobs[numJobs++];
+    job->in         = (uint8_t*)hdr + (le32toh(hdr2->sections[i].offsetFlags) & 0xFFFFFF);
+    job->uncompSize = le32toh(hdr->sections[i].uncompressedSize);
+    job->level      = _level;
+    job->wantRef    = _verbose && _level;
+    jobForSection[i] = job;
+  }
+
+  _CompressSections(jobs, numJobs, _jobs);
+
+  // Output sections.
   for (size_t i=0; i<hdr2->numSections; ++i) {
     if (le32toh(hdr2->sections[i].offsetFlags) & APE_SECTION_FLAG_ZERO_ON_FAST_BOOT) {
       // Zero the offset for BSS sections, it's not used anyway.
@@ -411,7 +1316,8 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    uint32_t uncompSize = le32toh(hdr->sections[i].uncompressedSize);
+    section_job *job = jobForSection[i];
+    uint32_t uncompSize = job->uncompSize;
 
     long compStart = ftell(fo);
     if (compStart < 0) {
@@ -419,88 +1325,42 @@ int main(int argc, char **argv) {
       return 1;
     }
 
-    uint32_t offset = le32toh(hdr2->sections[i].offsetFlags) & 0xFFFFFF;
     hdr2->sections[i].offsetFlags = htole32(compStart
       | APE_SECTION_FLAG_COMPRESSED | APE_SECTION_FLAG_CHECKSUM_IS_CRC32 | (1U<<27) | (i<2 ? (1U<<26) : 0));
-    size_t readBytes = 0;
-    size_t writtenBytes = 0;
-    _Compress(
-      (uint8_t*)hdr + offset,
-      uncompSize,
-      fo, &readBytes, &writtenBytes);
-
-    if (readBytes < uncompSize) {
-      fprintf(stderr, "did not read all input bytes?\n");
-      return 1;
-    }
 
-    size_t r = writtenBytes % 4;
-    if (r) {
-      static const uint8_t _zeroes[4] = {};
-      ec = fwrite(_zeroes, 4-r, 1, fo);
-      if (ec < 1) {
-        fprintf(stderr, "fwrite\n");
-        return 1;
-      }
-      writtenBytes += 4-r;
-    }
-
-    hdr2->sections[i].compressedSize = htole32(writtenBytes);
-
-    long compEnd = ftell(fo);
-    if (compEnd < 0)
-      return 1;
-
-    assert(compEnd - compStart == writtenBytes);
-
-    ec = fseek(fo, compStart, SEEK_SET);
-    if (ec < 0) {
-      fprintf(stderr, "fseek\n");
+    if (job->readBytes < uncompSize) {
+      fprintf(stderr, "did not read all input bytes?\n");
       return 1;
     }
 
-    if (compEnd - compStart > verifyInBufSize) {
-      verifyInBufSize = compEnd - compStart;
-      verifyInBuf = realloc(verifyInBuf, verifyInBufSize);
-      assert(verifyInBuf);
-    }
-
-    if (uncompSize > verifyOutBufSize) {
-      verifyOutBufSize = uncompSize;
-      verifyOutBuf = realloc(verifyOutBuf, verifyOutBufSize);
-      assert(verifyOutBuf);
-    }
-
-    ssize_t rd = fread(verifyInBuf, compEnd - compStart, 1, fo);
-    if (compEnd != compStart && rd < 1) {
-      fprintf(stderr, "fread verify %ld\n", rd);
-      return 1;
+    size_t writtenBytes = job->comp.len;
+    if (_verbose) {
+      fprintf(stderr, "section %zu: %u bytes, compressed %zu (%.1f%%)", i, uncompSize, writtenBytes,
+        uncompSize ? 100.0*writtenBytes/uncompSize : 0.0);
+      if (job->wantRef)
+        fprintf(stderr, ", level 0 would give %zu (%+zd)", job->refLen,
+          (ssize_t)writtenBytes - (ssize_t)job->refLen);
+      fprintf(stderr, "\n");
     }
 
-    ec = fseek(fo, compEnd, SEEK_SET);
-    if (ec < 0) {
-      fprintf(stderr, "compEnd\n");
+    const char *verifyErr = _VerifyDecompress(job->comp.buf, job->comp.len, job->in, uncompSize);
+    if (verifyErr) {
+      fprintf(stderr, "compression verification failed: %s\n", verifyErr);
       return 1;
     }
 
-    uint8_t *p = verifyOutBuf;
-    size_t verifyRead, verifyWritten;
-    Decompress(verifyInBuf, compEnd - compStart, uncompSize, _WriteBuf, &p, &verifyRead, &verifyWritten);
-
-    if (verifyWritten != uncompSize) {
-      fprintf(stderr, "compression verification outputted wrong amount of data (got %u bytes, expected %u)\n", verifyWritten, uncompSize);
-      return 1;
+    if (job->comp.len) {
+      ec = fwrite(job->comp.buf, job->comp.len, 1, fo);
+      if (ec < 1) {
+        fprintf(stderr, "fwrite\n");
+        return 1;
+      }
     }
 
-    if (memcmp(verifyOutBuf, (uint8_t*)hdr + offset, uncompSize)) {
-      fprintf(stderr, "compression verification failed\n");
-      //fwrite((uint8_t*)hdr + offset, uncompSize, 1, stdout);
-      //fwrite(verifyOutBuf, uncompSize, 1, stdout);
-      return 1;
-    }
+    free(job->comp.buf);
 
-    hdr2->sections[i].checksum = htole32(ComputeCRC((uint8_t*)hdr + offset, uncompSize/4, 0));
-    hdr2->sections[i].compressedSize = compEnd - compStart;
+    hdr2->sections[i].checksum = htole32(ComputeCRC(job->in, uncompSize/4, 0));
+    hdr2->sections[i].compressedSize = htole32(writtenBytes);
   }
 
   ec = fseek(fo, 0, SEEK_SET);
@@ -1486,6 +1486,53 @@ static inline void SetGencom16(uint32_t offset, uint16_t value) {
 #define GEN_DBG_SCRATCH_BEGIN  0x300
 #define GEN_DBG_SCRATCH_END    0x3FF
 
+// Bootcode debug log, see DebugPrint. Logging is enabled while the host holds
+// GEN_DBG_LOG_ENABLE at GEN_DBG_LOG_ENABLE__MAGIC. If the host has also set
+// GEN_DBG_LOG_RING_CTRL to GEN_DBG_LOG_RING_CTRL__MAGIC, the firmware appends
+// to the ring at GEN_DBG_LOG_RING, advancing HEAD, and the host consumes up
+// to HEAD and advances TAIL; messages which don't fit are dropped and their
+// bytes counted in DROPS. Otherwise, each 4 bytes are handed over through
+// GEN_DBG_LOG_DATA, with GEN_DBG_LOG_STATUS set until the host clears it.
+//
+// HEAD, TAIL and DROPS are free-running byte counts. Byte n of the ring is
+// in the word at GEN_DBG_LOG_RING + (n % GEN_DBG_LOG_RING_SIZE & ~3), most
+// significant byte first.
+#define GEN_DBG_LOG_DATA                0x360
+#define GEN_DBG_LOG_STATUS              0x364
+#define GEN_DBG_LOG_ENABLE              0x368
+#define GEN_DBG_LOG_ENABLE__MAGIC         0xDECAFBAD
+#define GEN_DBG_LOG_RING_CTRL           0x36C
+#define GEN_DBG_LOG_RING_CTRL__MAGIC      0x4C4F4752 /* 'LOGR' */
+#define GEN_DBG_LOG_HEAD                0x370
+#define GEN_DBG_LOG_TAIL                0x374
+#define GEN_DBG_LOG_DROPS               0x378
+#define GEN_DBG_LOG_RING                0x380
+#define GEN_DBG_LOG_RING_SIZE           0x80 // Power of two.
+
+// Deferred-formatting log records (see DLOG) are sent through the ring as a
+// GEN_DBG_LOG_RECORD byte, a byte holding the source (LOG_SOURCE_*) in bits
+// 4-7 and the number of arguments in bits 0-3, the 16-bit format ID and then
+// the 32-bit arguments, all most significant byte first. Text never contains
+// GEN_DBG_LOG_RECORD, so records and DebugPrint output can be mixed.
+#define GEN_DBG_LOG_RECORD              0xFF
+#define GEN_DBG_LOG_RECORD_MAX_ARGS     8
+
+// Sources of log records, and so which image's format strings they refer to.
+#define LOG_SOURCE_APE                  0
+#define LOG_SOURCE_STAGE1               1
+#define LOG_SOURCE_STAGE2               2
+#define LOG_SOURCE_NUM                  3
+
+// Places a string literal in the .logfmt section and yields its format ID,
+// which is its offset in that section. The linker scripts keep .logfmt in the
+// ELF but do not load it, so the string costs no image space and must not be
+// dereferenced by firmware; the Makefile extracts it into a .logfmt file for
+// use by otgdbg.
+#define LOG_FMT_ID(fmt) ({ \
+    static const char __attribute__((section(".logfmt"))) _logFmt[] = fmt; \
+    (uint32_t)_logFmt; \
+  })
+
 /* ---------------------------------------------------------------- */
 #define APE_RCPU_MAGIC 0x52435055 /* 'RCPU' */
 #define APE_APE_MAGIC  0x41504521 /* 'APE!' */
@@ -2386,8 +2433,10 @@ static inline uint32_t REG_APE__RX_POOL_RET(uint32_t func) {
 #define REG_APE__APEDBG_ARG1             APE_REG(0x426C)
 #define REG_APE__APEDBG_CMD_ERROR_FLAGS  APE_REG(0x4270)
 #define REG_APE__APEDBG_CMD_ERROR_FLAGS__EXCEPTION  0x00000001
+#define REG_APE__APEDBG_CMD_ERROR_FLAGS__INVALID    0x00000002
 #define REG_APE__APEDBG_EXCEPTION_COUNT  APE_REG(0x4274)
 #define REG_APE__APEDBG_EXCEPTION_IGNORE APE_REG(0x4278)
+#define REG_APE__APEDBG_ARG2             APE_REG(0x427C)
 
 #define REG_APE__APEDBG_STATE__RUNNING   0xBEEFCAFE
 #define REG_APE__APEDBG_STATE__EXITED    0xBEEF0FFE
@@ -2400,6 +2449,78 @@ static inline uint32_t REG_APE__RX_POOL_RET(uint32_t func) {
 #define REG_APE__APEDBG_CMD__TYPE__MEM_SET     0x0002
 #define REG_APE__APEDBG_CMD__TYPE__CALL_0      0x0003
 #define REG_APE__APEDBG_CMD__TYPE__RETURN      0x0004
+#define REG_APE__APEDBG_CMD__TYPE__DECOMPRESS_BEGIN  0x0005
+#define REG_APE__APEDBG_CMD__TYPE__DECOMPRESS        0x0006
+#define REG_APE__APEDBG_CMD__TYPE__MEM_READ_BLOCK    0x0007
+#define REG_APE__APEDBG_CMD__TYPE__MEM_WRITE_BLOCK   0x0008
+#define REG_APE__APEDBG_CMD__TYPE__FILL              0x0009
+#define REG_APE__APEDBG_CMD__TYPE__CRC32             0x000A
+#define REG_APE__APEDBG_CMD__TYPE__WATCH_SET         0x000B
+#define REG_APE__APEDBG_CMD__TYPE__WATCH_CLEAR       0x000C
+
+// WATCH_SET: ARG0 is the address, ARG1 the number of low address bits to
+// ignore, and ARG2 the comparator in bits 0-7 with the mode in bits 8-15. On
+// completion ARG2 is the number of comparators. WATCH_CLEAR: ARG2 is the
+// comparator, or WATCH_ALL.
+#define REG_APE__APEDBG_WATCH_MODE__READ   1
+#define REG_APE__APEDBG_WATCH_MODE__WRITE  2
+#define REG_APE__APEDBG_WATCH_MODE__RW     3
+#define REG_APE__APEDBG_WATCH_ALL          0xFFFFFFFF
+
+// Watchpoint hits, appended at PROD by the shell's DebugMonitor handler and
+// consumed by the host, which advances CONS. Hits while the ring is full are
+// counted in DROPS. Entries are four words: PC (of an instruction shortly
+// after the access, since DWT matches are imprecise), watched address, word
+// at that address after the access, and comparator. The word is only read if
+// the address is RAM; otherwise the comparator has WATCH_NO_VALUE set. ARMED
+// is nonzero while the shell's handler is installed, including after RETURN.
+#define REG_APE__APEDBG_WATCH_PROD       APE_REG(0x4280)
+#define REG_APE__APEDBG_WATCH_CONS       APE_REG(0x4284)
+#define REG_APE__APEDBG_WATCH_DROPS      APE_REG(0x4288)
+#define REG_APE__APEDBG_WATCH_ARMED      APE_REG(0x428C)
+#define REG_APE__APEDBG_WATCH_NO_VALUE   0x80000000
+#define REG_APE__APEDBG_WATCH_BASE       APE_REG(0x4290)
+#define REG_APE__APEDBG_WATCH_LEN        7
+
+// Staging area for APEDBG commands which take more data than fits in the
+// argument registers. Also borrowed, like the above.
+#define REG_APE__APEDBG_STAGE            APE_REG(0x4400)
+#define REG_APE__APEDBG_STAGE_SIZE       0x200
+
+// Command ring, see ape_shell.c. Descriptors are four words: command (replaced
+// with error flags on completion), ARG0, ARG1, ARG2.
+#define REG_APE__APEDBG_RING_PROD        APE_REG(0x4600)
+#define REG_APE__APEDBG_RING_CONS        APE_REG(0x4604)
+#define REG_APE__APEDBG_RING_MAGIC       APE_REG(0x4608)
+#define REG_APE__APEDBG_RING_MAGIC__VALUE  0x52494E47 /* "RING" */
+#define REG_APE__APEDBG_RING_BASE        APE_REG(0x4610)
+#define REG_APE__APEDBG_RING_LEN         15
+
+// PC sample ring for the profiler in ape_code_poc.c. This is the image's own
+// gAProf, in its .bss; the host finds it from the ELF symbol table and reaches
+// it through the 0xF8 window (GetAPEWord). The image's SysTick handler appends
+// the interrupted PC at prod; the host consumes up to prod and advances cons,
+// and samples taken while the ring is full are counted in drops.
+//
+// SysTick always runs, once every APE_PROF_RELOAD__MAX+1 cycles while idle.
+// Each tick the image follows ctrl and reload, so the host can start, retune
+// and stop sampling at any time. activeReload is the reload value in effect,
+// or 0 if not sampling.
+#define APE_PROF_MAGIC           0x50524F46 /* "PROF" */
+#define APE_PROF_LEN             128 // Power of two.
+#define APE_PROF_CTRL__ENABLE    0x00000001
+#define APE_PROF_RELOAD__DEFAULT 99999  // Used if reload is 0.
+#define APE_PROF_RELOAD__MAX     0x00FFFFFF // SysTick is 24 bits.
+
+typedef struct {
+  uint32_t magic;        // APE_PROF_MAGIC once the image has initialized.
+  uint32_t prod, cons, drops;
+  uint32_t reload;       // SysTick reload value, i.e. cycles per sample - 1. Host only.
+  uint32_t ctrl;         // APE_PROF_CTRL__*. Host only.
+  uint32_t activeReload;
+  uint32_t pcs[APE_PROF_LEN];
+} ape_prof;
+static_assert((APE_PROF_LEN & (APE_PROF_LEN-1)) == 0, "APE_PROF_LEN");
 
 
 // +++ EVENT SECTION ++++++++++++++++++++++++++++++++++++++++++++++++++++++43+
@@ -2908,6 +3029,16 @@ static inline uint32_t REG_APE__RX_POOL_RET(uint32_t func) {
 // appended.
 #define APE_DBGLOG_BASE         APE_REG(0x4E00)
 #define APE_DBGLOG_NUM_ENTRIES  64
+#define APE_DBGLOG_TS_NS        1000000000ULL // Per timestamp unit, a guess: the heartbeat period, see REG_APE__HEARTBEAT.
+
+// Deferred-formatting log records, written by ALOG in ape_code_poc.c. A
+// record is an entry of type APE_DBGLOG_TYPE__FMT, with the format ID (see
+// LOG_FMT_ID) in bits 0-19 of its arg and the number of arguments in bits
+// 20-23, followed by an entry of type APE_DBGLOG_TYPE__FMT_ARG for each
+// argument, with the argument number as its arg and the argument in place of
+// the timestamp.
+#define APE_DBGLOG_TYPE__FMT      0xFB
+#define APE_DBGLOG_TYPE__FMT_ARG  0xFC
 
 // --- APE Periperals --------------------------------------------------------
 // Note: It seems odd but this could be "program space", some code in the
@@ -3599,6 +3730,22 @@ static inline uint32_t SwapHalves32(uint32_t x) {
 #define NVIC_BUS_FAULT_ADDR                       0xE000ED38
 #define NVIC_AUX_FAULT_STATUS                     0xE000ED3C
 #define NVIC_SW_TRIG_INT                          0xE000EF00
+#define NVIC_DEBUG_EXC_MON_CONTROL                0xE000EDFC
+#define NVIC_DEBUG_EXC_MON_CONTROL__MON_EN        0x00010000
+#define NVIC_DEBUG_EXC_MON_CONTROL__TRCENA        0x01000000
+#define NVIC_DEBUG_FAULT_STATUS__DWTTRAP          0x00000004
+
+// Data Watchpoint and Trace unit. Comparators are N = 0..NUM_COMP-1.
+#define DWT_CONTROL                               0xE0001000
+#define DWT_CONTROL__NUM_COMP__SHIFT              28
+#define DWT_COMP(N)                               (0xE0001020 + 16*(N))
+#define DWT_MASK(N)                               (0xE0001024 + 16*(N)) // Number of low address bits ignored.
+#define DWT_FUNCTION(N)                           (0xE0001028 + 16*(N))
+#define DWT_FUNCTION__DISABLED                    0x00000000
+#define DWT_FUNCTION__WATCH_READ                  0x00000005
+#define DWT_FUNCTION__WATCH_WRITE                 0x00000006
+#define DWT_FUNCTION__WATCH_RW                    0x00000007
+#define DWT_FUNCTION__MATCHED                     0x01000000 // Cleared on read.
 
 // The stack frame which the CPU generates automatically when entering an
 // interrupt.
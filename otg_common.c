@@ -1,6 +1,11 @@
 #include "otg.h"
 #ifdef OTG_HOST
 #  include <unistd.h>
+#  include <time.h>
+#  include <sched.h>
+#  include <inttypes.h>
+#  include <stdlib.h>
+#  include <string.h>
 #endif
 
 static const uint8_t g_apePortTable[] = {APE_PORT_PHY0, APE_PORT_PHY1, APE_PORT_PHY2, APE_PORT_PHY3}; //0,2,3,5
@@ -396,10 +401,54 @@ static uint32_t ComputeCRC(const void *base, uint32_t len, uint32_t initialValue
 #endif
 }
 
+// Appends len bytes to the log ring without waiting for the host, dropping
+// them if there is not enough room. This avoids multiplication and division,
+// since the RX CPU has neither.
+static void _DebugRingWrite(const uint8_t *buf, uint32_t len) {
+  // Words are written whole, so the last one may spill up to 3 bytes past
+  // the end of the message; keep those clear of anything not yet consumed.
+  uint32_t head = GetGencom32(GEN_DBG_LOG_HEAD);
+  if (len + 3 > GEN_DBG_LOG_RING_SIZE - (head - GetGencom32(GEN_DBG_LOG_TAIL))) {
+    SetGencom32(GEN_DBG_LOG_DROPS, GetGencom32(GEN_DBG_LOG_DROPS) + len);
+    return;
+  }
+
+  // Bytes are packed into words, so start with any partial word already
+  // there.
+  uint32_t x = (head & 3) ? GetGencom32(GEN_DBG_LOG_RING + (head & (GEN_DBG_LOG_RING_SIZE-4))) : 0;
+  for (const uint8_t *end = buf + len; buf != end; ++buf) {
+    uint32_t shift = (3 - (head & 3)) << 3;
+    x = (x & ~(0xFFU << shift)) | ((uint32_t)*buf << shift);
+    ++head;
+    if (!(head & 3)) {
+      SetGencom32(GEN_DBG_LOG_RING + ((head-4) & (GEN_DBG_LOG_RING_SIZE-4)), x);
+      x = 0;
+    }
+  }
+
+  if (head & 3)
+    SetGencom32(GEN_DBG_LOG_RING + (head & (GEN_DBG_LOG_RING_SIZE-4)), x);
+
+  SetGencom32(GEN_DBG_LOG_HEAD, head);
+}
+
 static void DebugPrint(const char *msg) {
 #ifdef OTG_HOST
   puts(msg);
 #else
+  if (GetGencom32(GEN_DBG_LOG_ENABLE) != GEN_DBG_LOG_ENABLE__MAGIC)
+    return;
+
+  if (GetGencom32(GEN_DBG_LOG_RING_CTRL) == GEN_DBG_LOG_RING_CTRL__MAGIC) {
+    uint32_t len = 0;
+    while (msg[len])
+      ++len;
+    _DebugRingWrite((const uint8_t*)msg, len);
+    return;
+  }
+
+  // The host is too old to drain the ring, so hand the message over 4 bytes
+  // at a time.
   for (;*msg;) {
     uint32_t x = 0;
     uint8_t c;
@@ -412,15 +461,86 @@ static void DebugPrint(const char *msg) {
       }
     }
 
-    SetGencom32(0x360, x);
-    SetGencom32(0x364, 1);
-    while (GetGencom32(0x364))
-      if (GetGencom32(0x368) != 0xDECAFBAD)
+    SetGencom32(GEN_DBG_LOG_DATA, x);
+    SetGencom32(GEN_DBG_LOG_STATUS, 1);
+    while (GetGencom32(GEN_DBG_LOG_STATUS))
+      if (GetGencom32(GEN_DBG_LOG_ENABLE) != GEN_DBG_LOG_ENABLE__MAGIC)
         return;
   }
 #endif
 }
 
+#ifndef OTG_HOST
+#  if defined(STAGE1)
+#    define LOG_SOURCE LOG_SOURCE_STAGE1
+#  else
+#    define LOG_SOURCE LOG_SOURCE_STAGE2
+#  endif
+
+// Appends "<n> " to p, with n in hexadecimal, returning the new end.
+static char *_DebugHex(char *p, uint32_t n) {
+  int shift = 28;
+  while (shift && !(n >> shift))
+    shift -= 4;
+  for (; shift >= 0; shift -= 4)
+    *p++ = "0123456789abcdef"[(n >> shift) & 0xF];
+  *p++ = ' ';
+  return p;
+}
+
+// Emits a deferred-formatting log record; use DLOG rather than calling this
+// directly. The format string is never touched here, since it is not loaded;
+// the host formats the record using the format strings extracted from the
+// ELF at build time.
+static void DebugLog(uint32_t fmtID, uint32_t nargs, const uint32_t *args) {
+  if (GetGencom32(GEN_DBG_LOG_ENABLE) != GEN_DBG_LOG_ENABLE__MAGIC)
+    return;
+
+  if (GetGencom32(GEN_DBG_LOG_RING_CTRL) != GEN_DBG_LOG_RING_CTRL__MAGIC) {
+    // An old host can't decode records, so send them as text which can be
+    // formatted by hand: "#<source>:<format ID> <args>...".
+    char buf[4 + 9 + 9*GEN_DBG_LOG_RECORD_MAX_ARGS + 1];
+    char *p = buf;
+    *p++ = '#';
+    *p++ = '0' + LOG_SOURCE;
+    *p++ = ':';
+    p = _DebugHex(p, fmtID);
+    for (uint32_t i=0; i<nargs; ++i)
+      p = _DebugHex(p, args[i]);
+    p[-1] = '\n';
+    *p = '\0';
+    DebugPrint(buf);
+    return;
+  }
+
+  uint8_t buf[4 + 4*GEN_DBG_LOG_RECORD_MAX_ARGS];
+  uint8_t *p = buf;
+  *p++ = GEN_DBG_LOG_RECORD;
+  *p++ = (LOG_SOURCE << 4) | nargs;
+  *p++ = fmtID >> 8;
+  *p++ = fmtID;
+  for (uint32_t i=0; i<nargs; ++i) {
+    *p++ = args[i] >> 24;
+    *p++ = args[i] >> 16;
+    *p++ = args[i] >>  8;
+    *p++ = args[i];
+  }
+
+  _DebugRingWrite(buf, p - buf);
+}
+
+// Logs a message without formatting it on the RX CPU, e.g.
+//   DLOG("link up, speed %u duplex %u\n", speed, duplex);
+// fmt must be a string literal and the arguments integers; only the format
+// ID and the arguments are sent, and the host does the formatting. See
+// GEN_DBG_LOG_RECORD.
+#define DLOG(fmt, ...) do { \
+    const uint32_t _dlogArgs[] = {0, ##__VA_ARGS__}; \
+    static_assert(sizeof(_dlogArgs)/4 - 1 <= GEN_DBG_LOG_RECORD_MAX_ARGS, "too many DLOG arguments"); \
+    DebugLog(LOG_FMT_ID(fmt), sizeof(_dlogArgs)/4 - 1, _dlogArgs + 1); \
+  } while (0)
+#endif
+
 
 #ifdef OTG_HOST
 static bool g_readFail = false;
@@ -627,6 +747,215 @@ void SetAPEEventScratchpadWord(uint32_t offset, uint32_t value) {
 #endif
 }
 
+// Host-side completion waiting
+// ----------------------------
+// Waits on a device mailbox spin (re-evaluating the condition, which is
+// usually a single MMIO read) for a short time, since most commands complete
+// within a few microseconds, then yield and sleep with exponential backoff so
+// that long waits do not burn a core. The spin and sleep limits can be set
+// with OTG_WAIT_SPIN_US and OTG_WAIT_MAX_SLEEP_US.
+//
+// Many short waits in a row can still keep a core busy, since each spins up
+// to the limit. OTG_WAIT_SPIN_BUDGET_US caps the spinning each site may do per
+// second of wall time: a site's budget refills at that rate (holding at most
+// one second's worth), each wait spins for no longer than what is left, and
+// once it is spent waits at that site go straight to sleeping. Without it,
+// spinning is limited only per wait.
+//
+// The latency of each wait is recorded in a per-site log2 histogram, along
+// with the CPU time spent waiting and spinning; see PrintWaitStats.
+enum {
+  WAIT_SITE_SHELL_CMD,    // APE shell command completion.
+  WAIT_SITE_SHELL_READY,  // APE shell start.
+  WAIT_SITE_SHELL_RING,   // APE shell command ring progress.
+  WAIT_SITE_TAIL,         // Bootcode debug log handshake.
+  WAIT_SITE_APE_LOG,      // New APE debug log entries.
+  WAIT_SITE__COUNT,
+};
+
+#define WAIT_HIST_BUCKETS 40 // Bucket i holds waits of [2^(i-1), 2^i) ns.
+#define WAIT_FOREVER      UINT64_MAX
+
+typedef struct {
+  const char *name;
+  uint64_t count, timeouts;
+  uint64_t totalNs, maxNs, cpuNs, spinNs;
+  uint64_t hist[WAIT_HIST_BUCKETS];
+  uint64_t budgetNs, budgetTime; // Spin budget left, and when it last refilled.
+} wait_stats;
+
+static wait_stats g_waitStats[WAIT_SITE__COUNT] = {
+  [WAIT_SITE_SHELL_CMD]   = {.name = "shell command"},
+  [WAIT_SITE_SHELL_READY] = {.name = "shell start"},
+  [WAIT_SITE_SHELL_RING]  = {.name = "shell ring"},
+  [WAIT_SITE_TAIL]        = {.name = "tail"},
+  [WAIT_SITE_APE_LOG]     = {.name = "APE log"},
+};
+
+static uint64_t g_waitSpinNs     = 20000;
+static uint64_t g_waitMaxSleepNs = 200000;
+static uint64_t g_waitSpinBudgetNs = 0; // Per site per second; 0 for none.
+
+typedef bool (wait_cond_t)(void *arg);
+
+static uint64_t _ClockNs(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void _WaitInit(void) {
+  static bool _done = false;
+  if (_done)
+    return;
+
+  const char *s = getenv("OTG_WAIT_SPIN_US");
+  if (s)
+    g_waitSpinNs = strtoull(s, NULL, 0)*1000;
+  s = getenv("OTG_WAIT_MAX_SLEEP_US");
+  if (s && strtoull(s, NULL, 0))
+    g_waitMaxSleepNs = strtoull(s, NULL, 0)*1000;
+  s = getenv("OTG_WAIT_SPIN_BUDGET_US");
+  if (s && strtoull(s, NULL, 0)) {
+    uint64_t us = strtoull(s, NULL, 0);
+    g_waitSpinBudgetNs = (us < 1000000) ? us*1000 : 1000000000;
+  }
+  _done = true;
+}
+
+// Returns how long a wait at the given site starting at now may spin.
+static uint64_t _WaitSpinLimit(int site, uint64_t now) {
+  if (!g_waitSpinBudgetNs)
+    return g_waitSpinNs;
+
+  wait_stats *st = &g_waitStats[site];
+  uint64_t dt = now - st->budgetTime;
+  if (!st->budgetTime || dt >= 1000000000)
+    st->budgetNs = g_waitSpinBudgetNs;
+  else if ((st->budgetNs += dt*g_waitSpinBudgetNs/1000000000) > g_waitSpinBudgetNs)
+    st->budgetNs = g_waitSpinBudgetNs;
+  st->budgetTime = now;
+
+  return (st->budgetNs < g_waitSpinNs) ? st->budgetNs : g_waitSpinNs;
+}
+
+static void _WaitRecord(int site, uint64_t ns, uint64_t cpuNs, uint64_t spinNs, bool timedOut) {
+  wait_stats *st = &g_waitStats[site];
+  unsigned b = 0;
+  for (uint64_t x = ns; x && b < WAIT_HIST_BUCKETS-1; x >>= 1)
+    ++b;
+
+  ++st->hist[b];
+  ++st->count;
+  st->totalNs += ns;
+  st->cpuNs   += cpuNs;
+  st->spinNs  += spinNs;
+  st->budgetNs = (st->budgetNs > spinNs) ? st->budgetNs - spinNs : 0;
+  if (ns > st->maxNs)
+    st->maxNs = ns;
+  if (timedOut)
+    ++st->timeouts;
+}
+
+// Waits until cond(arg) returns true. Returns 0 on success or -1 if timeoutNs
+// elapses first.
+static int WaitFor(int site, wait_cond_t *cond, void *arg, uint64_t timeoutNs) {
+  _WaitInit();
+
+  uint64_t start = _ClockNs(CLOCK_MONOTONIC), cpuStart = _ClockNs(CLOCK_THREAD_CPUTIME_ID);
+  uint64_t spinLimit = _WaitSpinLimit(site, start);
+  uint64_t elapsed = 0, sleepNs = 1000, spun = UINT64_MAX;
+  bool timedOut = false;
+
+  while (!cond(arg)) {
+    elapsed = _ClockNs(CLOCK_MONOTONIC) - start;
+    if (elapsed >= timeoutNs) {
+      timedOut = true;
+      break;
+    }
+
+    if (elapsed < spinLimit)
+      continue;
+
+    if (sleepNs == 1000) {
+      spun = elapsed;
+      sched_yield();
+    }
+
+    struct timespec ts = {.tv_sec = sleepNs/1000000000, .tv_nsec = sleepNs%1000000000};
+    nanosleep(&ts, NULL);
+    if (sleepNs < g_waitMaxSleepNs)
+      sleepNs = (sleepNs*2 < g_waitMaxSleepNs) ? sleepNs*2 : g_waitMaxSleepNs;
+  }
+
+  elapsed = _ClockNs(CLOCK_MONOTONIC) - start;
+  if (spun == UINT64_MAX)
+    spun = elapsed;
+  _WaitRecord(site, elapsed, _ClockNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart, spun, timedOut);
+  return timedOut ? -1 : 0;
+}
+
+static void _PrintNs(FILE *f, uint64_t ns) {
+  if (ns < 10000)
+    fprintf(f, "%7" PRIu64 " ns", ns);
+  else if (ns < 10000000)
+    fprintf(f, "%7.1f us", ns/1e3);
+  else
+    fprintf(f, "%7.1f ms", ns/1e6);
+}
+
+// Returns the upper bound of the bucket containing the given fraction of
+// waits.
+static uint64_t _WaitPercentile(const wait_stats *st, double frac) {
+  uint64_t want = (uint64_t)(st->count*frac + 0.5), seen = 0;
+  for (unsigned b=0; b<WAIT_HIST_BUCKETS; ++b) {
+    seen += st->hist[b];
+    if (seen >= want && seen)
+      return (uint64_t)1 << b;
+  }
+  return st->maxNs;
+}
+
+// Prints the latency histogram of each wait site which has been used.
+static void PrintWaitStats(FILE *f) {
+  for (size_t i=0; i<WAIT_SITE__COUNT; ++i) {
+    const wait_stats *st = &g_waitStats[i];
+    if (!st->count)
+      continue;
+
+    fprintf(f, "%s: %" PRIu64 " waits, %" PRIu64 " timeouts, CPU", st->name, st->count, st->timeouts);
+    _PrintNs(f, st->cpuNs);
+    fprintf(f, ", spinning");
+    _PrintNs(f, st->spinNs);
+    fprintf(f, "\n  mean");
+    _PrintNs(f, st->totalNs/st->count);
+    fprintf(f, "  p50 <");
+    _PrintNs(f, _WaitPercentile(st, 0.50));
+    fprintf(f, "  p99 <");
+    _PrintNs(f, _WaitPercentile(st, 0.99));
+    fprintf(f, "  max");
+    _PrintNs(f, st->maxNs);
+    fprintf(f, "\n");
+
+    uint64_t peak = 0;
+    for (unsigned b=0; b<WAIT_HIST_BUCKETS; ++b)
+      if (st->hist[b] > peak)
+        peak = st->hist[b];
+
+    for (unsigned b=0; b<WAIT_HIST_BUCKETS; ++b) {
+      if (!st->hist[b])
+        continue;
+
+      fprintf(f, "  <");
+      _PrintNs(f, (uint64_t)1 << b);
+      fprintf(f, " %10" PRIu64 " ", st->hist[b]);
+      for (uint64_t n = (st->hist[b]*50 + peak-1)/peak; n; --n)
+        fputc('#', f);
+      fputc('\n', f);
+    }
+  }
+}
+
 static void _WarnAboutAPEStateShell(const char *msg) {
   static bool _done = false;
   if (_done)
@@ -636,15 +965,14 @@ static void _WarnAboutAPEStateShell(const char *msg) {
   _done = true;
 }
 
-static int _WaitAPEShellCmd(void) {
-  uint32_t timeout = 10000/10;
-  while (GetReg(REG_APE__APEDBG_CMD)) {
-    if (!timeout--) {
-      _WarnAboutAPEState("command timed out");
-      return -1;
-    }
+static bool _APEShellCmdDone(void *arg) {
+  return !GetReg(REG_APE__APEDBG_CMD);
+}
 
-    usleep(10);
+static int _WaitAPEShellCmd(void) {
+  if (WaitFor(WAIT_SITE_SHELL_CMD, _APEShellCmdDone, NULL, 100000000)) {
+    _WarnAboutAPEState("command timed out");
+    return -1;
   }
 
   return 0;
@@ -698,6 +1026,390 @@ void SetAPEMemShell(uint32_t offset, uint32_t v) {
     _WarnAboutAPEState("exception caught");
 }
 
+// Issues a mailbox command taking up to three arguments and waits for it.
+// ARG0 and ARG1 are returned in args. Returns the command's error flags, or
+// -1 if the shell is not running or the command timed out.
+static int _APEShellCmdArgs(uint32_t type, uint32_t args[3]) {
+  if (GetReg(REG_APE__APEDBG_STATE) != REG_APE__APEDBG_STATE__RUNNING) {
+    _WarnAboutAPEState("apedbg not running");
+    return -1;
+  }
+
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  SetReg(REG_APE__APEDBG_ARG0, args[0]);
+  SetReg(REG_APE__APEDBG_ARG1, args[1]);
+  SetReg(REG_APE__APEDBG_ARG2, args[2]);
+  SetReg(REG_APE__APEDBG_CMD, REG_APE__APEDBG_CMD__MAGIC|type);
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  args[0] = GetReg(REG_APE__APEDBG_ARG0);
+  args[1] = GetReg(REG_APE__APEDBG_ARG1);
+  args[2] = GetReg(REG_APE__APEDBG_ARG2);
+  return GetReg(REG_APE__APEDBG_CMD_ERROR_FLAGS);
+}
+
+// FILL and CRC32 are split into pieces of this many words so that no single
+// command runs long enough to time out.
+#define APE_SHELL_CHUNK_WORDS 4096
+
+// Fills numWords words of APE memory at addr with v, on the APE. Returns the
+// number of words filled, which is short if a store faulted; -1 on error; or
+// -2 if the running shell predates FILL.
+static ssize_t FillAPEMemShell(uint32_t addr, uint32_t v, size_t numWords) {
+  size_t done = 0;
+  while (done < numWords) {
+    size_t n = numWords - done;
+    if (n > APE_SHELL_CHUNK_WORDS)
+      n = APE_SHELL_CHUNK_WORDS;
+
+    uint32_t start = addr + done*4;
+    uint32_t args[3] = {start, v, n};
+    int flags = _APEShellCmdArgs(REG_APE__APEDBG_CMD__TYPE__FILL, args);
+    if (flags < 0)
+      return -1;
+
+    // An older shell ignores the command, leaving ARG0 as it is.
+    if (!flags && args[0] == start)
+      return -2;
+
+    if (flags & REG_APE__APEDBG_CMD_ERROR_FLAGS__INVALID) {
+      _WarnAboutAPEState("invalid command arguments");
+      return -1;
+    }
+
+    done += (args[0] - start)/4;
+    if (flags) {
+      _WarnAboutAPEState("exception caught");
+      break;
+    }
+  }
+
+  return done;
+}
+
+// Computes the CRC32 (as per CRC32) of len bytes of APE memory at addr, on the
+// APE. addr and len must be multiples of 4. Returns 0 on success; -1 on error,
+// including a load which faulted; or -2 if the running shell predates CRC32.
+static int CRC32APEMemShell(uint32_t addr, size_t len, uint32_t *crc) {
+  *crc = 0;
+  for (size_t done=0; done < len;) {
+    size_t n = len - done;
+    if (n > APE_SHELL_CHUNK_WORDS*4)
+      n = APE_SHELL_CHUNK_WORDS*4;
+
+    uint32_t start = addr + done;
+    uint32_t args[3] = {start, n, *crc};
+    int flags = _APEShellCmdArgs(REG_APE__APEDBG_CMD__TYPE__CRC32, args);
+    if (flags < 0)
+      return -1;
+
+    if (!flags && args[0] == start)
+      return -2;
+
+    if (flags) {
+      _WarnAboutAPEState((flags & REG_APE__APEDBG_CMD_ERROR_FLAGS__INVALID) ? "invalid command arguments" : "exception caught");
+      return -1;
+    }
+
+    *crc  = args[1];
+    done += n;
+  }
+
+  return 0;
+}
+
+// Sets DWT comparator comp to watch for accesses to addr (ignoring the low
+// maskBits bits) of the given REG_APE__APEDBG_WATCH_MODE__*. Hits are logged
+// at REG_APE__APEDBG_WATCH_BASE. Returns the number of comparators; -1 on
+// error, including an invalid comparator; or -2 if the running shell predates
+// WATCH_SET.
+static int SetAPEWatchShell(uint32_t comp, uint32_t addr, uint32_t maskBits, uint32_t mode) {
+  uint32_t arg2 = (comp & 0xFF) | (mode << 8);
+  uint32_t args[3] = {addr, maskBits, arg2};
+  int flags = _APEShellCmdArgs(REG_APE__APEDBG_CMD__TYPE__WATCH_SET, args);
+  if (flags < 0)
+    return -1;
+
+  // An older shell ignores the command, leaving ARG2 as it is.
+  if (!flags && args[2] == arg2)
+    return -2;
+
+  if (flags) {
+    _WarnAboutAPEState("invalid watchpoint");
+    return -1;
+  }
+
+  return args[2];
+}
+
+// Clears DWT comparator comp, or all of them if comp is
+// REG_APE__APEDBG_WATCH_ALL. Returns as for SetAPEWatchShell.
+static int ClearAPEWatchShell(uint32_t comp) {
+  uint32_t args[3] = {0, 0, comp};
+  int flags = _APEShellCmdArgs(REG_APE__APEDBG_CMD__TYPE__WATCH_CLEAR, args);
+  if (flags < 0)
+    return -1;
+
+  if (!flags && args[2] == comp)
+    return -2;
+
+  if (flags) {
+    _WarnAboutAPEState("invalid watchpoint");
+    return -1;
+  }
+
+  return args[2];
+}
+
+// A command for RunAPEShellOps.
+typedef struct {
+  uint32_t type;    // REG_APE__APEDBG_CMD__TYPE__MEM_GET, MEM_SET, FILL or CRC32.
+  uint32_t arg0;    // On completion, ARG0 and ARG1 are as left by the
+  uint32_t arg1;    // command, e.g. ARG1 is the value read by MEM_GET.
+  uint32_t arg2;
+  uint32_t status;  // On completion, REG_APE__APEDBG_CMD_ERROR_FLAGS__*.
+} ape_shell_op;
+
+static bool APEShellHasRing(void) {
+  return GetReg(REG_APE__APEDBG_STATE) == REG_APE__APEDBG_STATE__RUNNING
+      && GetReg(REG_APE__APEDBG_RING_MAGIC) == REG_APE__APEDBG_RING_MAGIC__VALUE;
+}
+
+static bool _APEShellRingMoved(void *arg) {
+  return GetReg(REG_APE__APEDBG_RING_CONS) != *(const uint32_t*)arg;
+}
+
+// Runs commands through the shell's command ring, keeping the ring as full as
+// possible rather than waiting for each command in turn. Commands run in
+// order and each gets its own status, so a fault is attributed to the command
+// which caused it. Returns 0 once all have completed, -1 on timeout, or -2 if
+// the running shell has no ring.
+static int RunAPEShellOps(ape_shell_op *ops, size_t numOps) {
+  if (!APEShellHasRing())
+    return -2;
+
+  const uint32_t len = REG_APE__APEDBG_RING_LEN;
+  uint32_t prod = GetReg(REG_APE__APEDBG_RING_PROD);
+  uint32_t reap = prod; // Slot of the oldest command not yet collected.
+  size_t issued = 0, done = 0;
+
+  if (prod >= len)
+    return -1;
+
+  while (done < numOps) {
+    bool progress = false;
+    uint32_t cons = GetReg(REG_APE__APEDBG_RING_CONS);
+
+    for (; reap != cons && done < issued; reap = (reap+1) % len, ++done) {
+      uint32_t desc = REG_APE__APEDBG_RING_BASE + reap*16;
+      ops[done].status = GetReg(desc);
+      ops[done].arg0   = GetReg(desc + 4);
+      ops[done].arg1   = GetReg(desc + 8);
+      progress = true;
+    }
+
+    uint32_t oldProd = prod;
+    for (; issued < numOps && (prod+1) % len != cons; prod = (prod+1) % len, ++issued) {
+      uint32_t desc = REG_APE__APEDBG_RING_BASE + prod*16;
+      SetReg(desc + 4, ops[issued].arg0);
+      SetReg(desc + 8, ops[issued].arg1);
+      SetReg(desc + 12, ops[issued].arg2);
+      SetReg(desc,     REG_APE__APEDBG_CMD__MAGIC|ops[issued].type);
+    }
+
+    if (prod != oldProd) {
+      SetReg(REG_APE__APEDBG_RING_PROD, prod);
+      progress = true;
+    }
+
+    if (!progress && WaitFor(WAIT_SITE_SHELL_RING, _APEShellRingMoved, &cons, 100000000)) {
+      _WarnAboutAPEState("command ring timed out");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// Standard (zlib) CRC32, as computed by the APE shell. Unlike ComputeCRC, len
+// is in bytes. crc is 0 to start, or the result of a previous call to
+// continue.
+static uint32_t CRC32(const void *buf, size_t len, uint32_t crc) {
+  static const uint32_t tbl[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+
+  const uint8_t *p = buf;
+  crc = ~crc;
+  for (size_t i=0; i<len; ++i) {
+    crc ^= p[i];
+    crc = (crc >> 4) ^ tbl[crc & 15];
+    crc = (crc >> 4) ^ tbl[crc & 15];
+  }
+  return ~crc;
+}
+
+// Issues an APE shell command whose arguments have already been set, and
+// waits for it to complete. Returns -1 on timeout or if the command reported
+// an error.
+static int _APEShellCmd(uint32_t type) {
+  SetReg(REG_APE__APEDBG_CMD, REG_APE__APEDBG_CMD__MAGIC|type);
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  uint32_t exc = GetReg(REG_APE__APEDBG_CMD_ERROR_FLAGS);
+  if (exc) {
+    _WarnAboutAPEState((exc & REG_APE__APEDBG_CMD_ERROR_FLAGS__INVALID) ? "invalid command arguments" : "exception caught");
+    return -1;
+  }
+
+  return 0;
+}
+
+// Decompresses a CMPS stream into APE memory at dst using the shell's
+// on-device decompressor, so that only the compressed data is uploaded, a
+// staging area at a time. Returns the number of bytes output and sets *crc to
+// their CRC32 as computed by the APE. Returns -1 on error, or -2 if the
+// running shell predates on-device decompression.
+static ssize_t DecompressToAPEMemShell(uint32_t dst, const void *comp, size_t compLen, uint32_t uncompSize, uint32_t *crc) {
+  if (GetReg(REG_APE__APEDBG_STATE) != REG_APE__APEDBG_STATE__RUNNING) {
+    _WarnAboutAPEState("apedbg not running");
+    return -1;
+  }
+
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  // The shell zeroes ARG0 to acknowledge; an older shell ignores the command
+  // and leaves it as it is. dst is never zero, as that is ROM.
+  SetReg(REG_APE__APEDBG_ARG0, dst);
+  SetReg(REG_APE__APEDBG_ARG1, uncompSize);
+  if (_APEShellCmd(REG_APE__APEDBG_CMD__TYPE__DECOMPRESS_BEGIN))
+    return -1;
+
+  if (GetReg(REG_APE__APEDBG_ARG0))
+    return -2;
+
+  const uint8_t *in = comp;
+  uint32_t written = 0;
+  *crc = 0;
+  for (size_t off=0; off < compLen && written < uncompSize;) {
+    size_t n = compLen - off;
+    if (n > REG_APE__APEDBG_STAGE_SIZE)
+      n = REG_APE__APEDBG_STAGE_SIZE;
+
+    for (size_t i=0; i<n; i += 4) {
+      uint32_t w = 0;
+      for (size_t j=0; j<4 && i+j<n; ++j)
+        w |= (uint32_t)in[off+i+j] << (j*8);
+      SetReg(REG_APE__APEDBG_STAGE + i, w);
+    }
+
+    SetReg(REG_APE__APEDBG_ARG0, n);
+    if (_APEShellCmd(REG_APE__APEDBG_CMD__TYPE__DECOMPRESS))
+      return -1;
+
+    written = GetReg(REG_APE__APEDBG_ARG0);
+    *crc    = GetReg(REG_APE__APEDBG_ARG1);
+    off += n;
+  }
+
+  return written;
+}
+
+// Copies up to a staging area's worth of words between APE memory and the
+// staging area. Returns the number of words copied, which is short if an
+// access faulted; -1 on error; or -2 if the running shell predates block
+// commands.
+static ssize_t _APEMemBlockShell(uint32_t type, uint32_t addr, uint32_t numWords) {
+  if (GetReg(REG_APE__APEDBG_STATE) != REG_APE__APEDBG_STATE__RUNNING) {
+    _WarnAboutAPEState("apedbg not running");
+    return -1;
+  }
+
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  SetReg(REG_APE__APEDBG_ARG0, addr);
+  SetReg(REG_APE__APEDBG_ARG1, numWords);
+  SetReg(REG_APE__APEDBG_CMD, REG_APE__APEDBG_CMD__MAGIC|type);
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  // The shell advances ARG0 past the words copied; an older shell ignores
+  // the command, leaving ARG0 as it is without flagging an error.
+  uint32_t exc = GetReg(REG_APE__APEDBG_CMD_ERROR_FLAGS);
+  uint32_t done = GetReg(REG_APE__APEDBG_ARG1);
+  if (!exc && numWords && GetReg(REG_APE__APEDBG_ARG0) == addr)
+    return -2;
+
+  if (exc & REG_APE__APEDBG_CMD_ERROR_FLAGS__INVALID) {
+    _WarnAboutAPEState("invalid command arguments");
+    return -1;
+  }
+
+  if (exc)
+    _WarnAboutAPEState("exception caught");
+
+  return done;
+}
+
+// Reads numWords words of APE memory via the shell, a staging area at a time
+// rather than with a handshake per word. Returns the number of words read,
+// which is short if an access faulted; -1 on error; or -2 if the running
+// shell predates block commands, in which case use GetAPEMemShell.
+static ssize_t GetAPEMemBlockShell(uint32_t addr, uint32_t *buf, size_t numWords) {
+  const size_t stageWords = REG_APE__APEDBG_STAGE_SIZE/4;
+  size_t done = 0;
+  while (done < numWords) {
+    size_t n = numWords - done;
+    if (n > stageWords)
+      n = stageWords;
+
+    ssize_t got = _APEMemBlockShell(REG_APE__APEDBG_CMD__TYPE__MEM_READ_BLOCK, addr + done*4, n);
+    if (got < 0)
+      return got;
+
+    for (ssize_t i=0; i<got; ++i)
+      buf[done+i] = GetReg(REG_APE__APEDBG_STAGE + i*4);
+
+    done += got;
+    if (got < n)
+      break;
+  }
+
+  return done;
+}
+
+// Writes numWords words to APE memory via the shell. Return values are as for
+// GetAPEMemBlockShell.
+static ssize_t SetAPEMemBlockShell(uint32_t addr, const uint32_t *buf, size_t numWords) {
+  const size_t stageWords = REG_APE__APEDBG_STAGE_SIZE/4;
+  size_t done = 0;
+  while (done < numWords) {
+    size_t n = numWords - done;
+    if (n > stageWords)
+      n = stageWords;
+
+    for (size_t i=0; i<n; ++i)
+      SetReg(REG_APE__APEDBG_STAGE + i*4, buf[done+i]);
+
+    ssize_t put = _APEMemBlockShell(REG_APE__APEDBG_CMD__TYPE__MEM_WRITE_BLOCK, addr + done*4, n);
+    if (put < 0)
+      return put;
+
+    done += put;
+    if (put < n)
+      break;
+  }
+
+  return done;
+}
+
 // OTP Access
 // ---------------------------------------------------------------------------
 static uint32_t GetOTP(uint32_t offset) {
@@ -826,4 +1538,148 @@ static void Decompress(const void *inStart, size_t inBytes, size_t uncompSize, w
 #endif
 }
 
+// Reentrant decompressor. Unlike Decompress, all state is held in a
+// caller-owned cmps_decoder and output is produced into caller-provided
+// buffers rather than a byte at a time. Input and output may both be supplied
+// piecemeal: DecompressChunk stops when it runs out of either, and the next
+// call resumes exactly where it left off, even in the middle of a match.
+//
+// Decompress is scrubbed from this tree, so this decoder has not been checked
+// against it. It is checked by round trip instead: apestamp -t and -b compress
+// data at every level and compare the decoded output with the input.
+#define CMPS_N 2048
+#define CMPS_F 34
+#define CMPS_THRESHOLD 2
+
+typedef struct {
+  uint8_t  dict[CMPS_N];
+  uint16_t dictIdx;
+  uint16_t flags;       // Unconsumed flag bits, with 0xFF00 above them.
+  uint16_t copyPos;     // Dictionary position of the match being copied.
+  uint8_t  copyLeft;    // Bytes of the match still to be copied.
+  uint8_t  matchLo;     // First byte of a match code whose second byte has not
+  bool     haveMatchLo; // arrived yet.
+  size_t   remaining;   // Bytes of output still expected.
+} cmps_decoder;
+
+// uncompSize may be SIZE_MAX, in which case decoding continues for as long as
+// there is input.
+static void DecompressInit(cmps_decoder *d, size_t uncompSize) {
+  memset(d->dict, 0x20, sizeof(d->dict));
+  d->dictIdx     = CMPS_N - CMPS_F;
+  d->flags       = 0;
+  d->copyLeft    = 0;
+  d->haveMatchLo = false;
+  d->remaining   = uncompSize;
+}
+
+// Decodes as much of in as possible into out. Returns the number of bytes
+// written to out and sets *inUsed to the number of bytes consumed from in.
+// Returns zero once the expected output size has been reached, or if more
+// input is needed.
+static size_t DecompressChunk(cmps_decoder *d, const void *in_, size_t inBytes, size_t *inUsed, void *out_, size_t outBytes) {
+  const uint8_t *in = in_, *inEnd = in + inBytes;
+  uint8_t *out = out_, *outEnd = out + (outBytes < d->remaining ? outBytes : d->remaining);
+  uint8_t *dict = d->dict;
+  uint16_t r = d->dictIdx;
+
+  for (;;) {
+    // Finish any match in progress.
+    if (d->copyLeft) {
+      uint16_t pos = d->copyPos;
+      size_t n = d->copyLeft;
+      if (n > (size_t)(outEnd - out))
+        n = outEnd - out;
+      d->copyLeft -= n;
+      while (n--) {
+        uint8_t c = dict[pos];
+        pos = (pos+1) & (CMPS_N-1);
+        *out++ = c;
+        dict[r] = c;
+        r = (r+1) & (CMPS_N-1);
+      }
+      d->copyPos = pos;
+    }
+
+    if (out == outEnd)
+      break;
+
+    if (!(d->flags & 0x100)) {
+      if (in == inEnd)
+        break;
+      d->flags = *in++ | 0xFF00;
+    }
+
+    if (d->flags & 1) {
+      // Literal.
+      if (in == inEnd)
+        break;
+      uint8_t c = *in++;
+      *out++ = c;
+      dict[r] = c;
+      r = (r+1) & (CMPS_N-1);
+    } else {
+      // Match: 11-bit dictionary position and 5-bit length.
+      if (!d->haveMatchLo) {
+        if (in == inEnd)
+          break;
+        d->matchLo = *in++;
+        d->haveMatchLo = true;
+      }
+      if (in == inEnd)
+        break;
+      uint8_t hi = *in++;
+      d->haveMatchLo = false;
+      d->copyPos  = d->matchLo | ((hi & 0xE0) << 3);
+      d->copyLeft = (hi & 0x1F) + CMPS_THRESHOLD + 1;
+    }
+
+    d->flags >>= 1;
+  }
+
+  d->dictIdx = r;
+  if (d->remaining != SIZE_MAX)
+    d->remaining -= out - (uint8_t*)out_;
+  *inUsed = in - (const uint8_t*)in_;
+  return out - (uint8_t*)out_;
+}
+
+// Streaming variant of DecompressChunk which decompresses a whole buffer and
+// passes the output to writef a chunk at a time. writef returns the number of
+// bytes it accepted; if this is less than it was given, decompression stops.
+typedef ssize_t (chunk_write_t)(const uint8_t *buf, size_t len, void *arg);
+static void DecompressStream(const void *inStart, size_t inBytes, size_t uncompSize, chunk_write_t *writef, void *arg,
+    size_t *bytesRead_, size_t *bytesWritten_) {
+  cmps_decoder d;
+  uint8_t buf[4096];
+  size_t bytesRead = 0, bytesWritten = 0;
+
+  DecompressInit(&d, uncompSize);
+  for (;;) {
+    size_t used;
+    size_t n = DecompressChunk(&d, (const uint8_t*)inStart + bytesRead, inBytes - bytesRead, &used, buf, sizeof(buf));
+    bytesRead += used;
+    if (!n)
+      break;
+
+    ssize_t wr = writef(buf, n, arg);
+    if (wr > 0)
+      bytesWritten += wr;
+    if (wr < (ssize_t)n)
+      break;
+  }
+
+  *bytesRead_    = bytesRead;
+  *bytesWritten_ = bytesWritten;
+}
+
+// Decompresses a whole buffer at once into out, which must have room for
+// uncompSize bytes. Returns the number of bytes written.
+static size_t DecompressBuf(const void *in, size_t inBytes, void *out, size_t uncompSize) {
+  cmps_decoder d;
+  size_t used;
+  DecompressInit(&d, uncompSize);
+  return DecompressChunk(&d, in, inBytes, &used, out, uncompSize);
+}
+
 #endif
@@ -0,0 +1,643 @@
+/* Log Decoding
+ * ------------
+ * Host-side decoding of firmware logs: formatting of deferred-formatting log
+ * records (see LOG_FMT_ID) from the bootcode log ring and the APE debug log,
+ * and decoding of APE debug log entries.
+ *
+ * An APE debug log entry (see APE_DBGLOG_BASE) is a type byte, a 24-bit
+ * argument and a timestamp. Entries are decoded by looking up their type in
+ * _apeLogTypes, a 256-entry table generated from APE_LOG_TYPES, which gives
+ * the kind of the entry, the function which describes its argument, and the
+ * parameters which that function needs (the port and interrupt of per-port
+ * types, the names of NC-SI commands, and so on). Decoding an entry is thus a
+ * single indexed load and call regardless of the number of types known.
+ *
+ * Output is built in a caller-provided log_buf rather than written through
+ * stdio, so that large captures can be decoded quickly.
+ */
+// Format strings for deferred-formatting log records, by source
+// (LOG_SOURCE_*), as extracted from each image's ELF into a .logfmt file at
+// build time. A format ID is an offset into this data.
+typedef struct {
+  char   *data;
+  size_t  len;
+} log_fmt_table;
+
+static log_fmt_table g_logFmt[LOG_SOURCE_NUM];
+
+static int LoadLogFmt(int source, const char *fn) {
+  FILE *f = fopen(fn, "rb");
+  if (!f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", fn);
+    return -1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  // Terminate the data so that a truncated table can't run off the end.
+  char *data = (len >= 0) ? malloc(len+1) : NULL;
+  if (!data || fread(data, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "error: couldn't read file: %s\n", fn);
+    fclose(f);
+    free(data);
+    return -1;
+  }
+  fclose(f);
+
+  // Any table already loaded is only replaced once the new one is complete.
+  log_fmt_table *t = &g_logFmt[source];
+  free(t->data);
+  data[len] = '\0';
+  t->data = data;
+  t->len  = len;
+  return 0;
+}
+
+// Formats a log record into buf. Only integer conversions are supported, as
+// the arguments are raw 32-bit words; length modifiers are ignored. If the
+// format string isn't known, the record is formatted as firmware does for a
+// host which can't decode records: "#<source>:<format ID> <args>...".
+static void FormatLogRecord(char *buf, size_t bufLen, uint32_t source, uint32_t fmtID,
+                            const uint32_t *args, uint32_t nargs) {
+  size_t n = 0;
+#define LOGFMT_APPEND(...) \
+  (n += snprintf((n < bufLen) ? buf + n : NULL, (n < bufLen) ? bufLen - n : 0, __VA_ARGS__))
+
+  if (source >= LOG_SOURCE_NUM || fmtID >= g_logFmt[source].len) {
+    LOGFMT_APPEND("#%u:%x", source, fmtID);
+    for (uint32_t i=0; i<nargs; ++i)
+      LOGFMT_APPEND(" %x", args[i]);
+    LOGFMT_APPEND("\n");
+    return;
+  }
+
+  const char *fmt = g_logFmt[source].data + fmtID;
+  uint32_t argNo = 0;
+  buf[0] = '\0';
+  while (*fmt) {
+    if (*fmt != '%') {
+      const char *lit = fmt;
+      while (*fmt && *fmt != '%')
+        ++fmt;
+      LOGFMT_APPEND("%.*s", (int)(fmt - lit), lit);
+      continue;
+    }
+
+    char spec[16] = "%";
+    size_t specLen = 1;
+    for (++fmt; *fmt && strchr("-+ #0123456789.", *fmt); ++fmt)
+      if (specLen < sizeof(spec)-2)
+        spec[specLen++] = *fmt;
+    while (*fmt && strchr("hljztL", *fmt))
+      ++fmt;
+
+    char conv = *fmt;
+    if (conv)
+      ++fmt;
+    spec[specLen++] = conv;
+
+    if (conv == '%')
+      LOGFMT_APPEND("%%");
+    else if (argNo >= nargs)
+      LOGFMT_APPEND("<missing>");
+    else if (conv == 'd' || conv == 'i')
+      LOGFMT_APPEND(spec, (int32_t)args[argNo++]);
+    else if (conv && strchr("ouxXc", conv))
+      LOGFMT_APPEND(spec, args[argNo++]);
+    else {
+      LOGFMT_APPEND("<%%%c?>", conv ? conv : ' ');
+      ++argNo;
+    }
+  }
+#undef LOGFMT_APPEND
+}
+
+// A bounded output buffer. len continues to count past cap, so that
+// truncation can be detected, but data is always kept terminated.
+typedef struct {
+  char   *data;
+  size_t  len, cap;
+} log_buf;
+
+static void LogBufPrintf(log_buf *b, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf((b->len < b->cap) ? b->data + b->len : NULL,
+                    (b->len < b->cap) ? b->cap - b->len : 0, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    b->len += n;
+}
+
+static void LogBufPuts(log_buf *b, const char *s) {
+  size_t n = strlen(s);
+  if (b->len + n < b->cap) {
+    memcpy(b->data + b->len, s, n+1);
+    b->len += n;
+  } else
+    LogBufPrintf(b, "%s", s);
+}
+
+// Returns the length of the line in b, which ends in a newline even if it
+// was truncated.
+static size_t LogBufLineLen(log_buf *b) {
+  if (b->len >= b->cap) {
+    b->len = b->cap-1;
+    b->data[b->len-1] = '\n';
+  }
+  return b->len;
+}
+
+// Appends s as a JSON string, quoted and escaped.
+static void LogBufJSONString(log_buf *b, const char *s) {
+  LogBufPuts(b, "\"");
+  for (const char *lit = s;; ++s) {
+    if (*s && *s != '"' && *s != '\\' && (uint8_t)*s >= 0x20)
+      continue;
+
+    LogBufPrintf(b, "%.*s", (int)(s - lit), lit);
+    if (!*s)
+      break;
+    if (*s == '"' || *s == '\\')
+      LogBufPrintf(b, "\\%c", *s);
+    else
+      LogBufPrintf(b, "\\u%04x", (uint8_t)*s);
+    lit = s+1;
+  }
+  LogBufPuts(b, "\"");
+}
+
+// APE Debug Log Entries
+// ---------------------
+// Names of the command types of NC-SI entries (types 0xF0, 0xE0, 0xE1, bits
+// 16-23 of the argument) and of their results (bits 0-7).
+static const char *const _ncsiCmdNames[] = {
+  [0x00] = "ClrInitState",
+  [0x01] = "SelPkg",
+  [0x02] = "DeSelPkg",
+  [0x03] = "EnableCh",
+  [0x04] = "DisableCh",
+  [0x05] = "ResetCh",
+  [0x06] = "EnableChTx",
+  [0x07] = "DisableChTx",
+  [0x08] = "EnableAEN",
+  [0x09] = "SetLnk",
+  [0x0A] = "GetLnkStatus",
+  [0x0B] = "SetVlanFilt",
+  [0x0C] = "EnableVlan",
+  [0x0D] = "DisableVlan",
+  [0x0E] = "SetMacAddr",
+  [0x10] = "EnBcastFilt",
+  [0x11] = "DisBcastFilt",
+  [0x12] = "EnMcastFilt",
+  [0x13] = "DisMcastFilt",
+  [0x14] = "SetNcsiFc",
+  [0x15] = "GetVerId",
+  [0x16] = "GetCaps",
+  [0x17] = "GetParams",
+  [0x18] = "GetChPktStat",
+  [0x19] = "GetNcsiStat",
+  [0x1A] = "GetPtStat",
+  [0x50] = "OEM",
+};
+
+static const char *const _ncsiBrcmOemNames[] = {
+  [0x00] = "BrcmOem.SetVirMac",
+  [0x01] = "BrcmOem.GetNcsiParam",
+  [0x05] = "BrcmOem.GetTempRead",
+};
+
+static const char *const _ncsiDellOemNames[] = {
+  [0x00] = "DellOem.GetInventory", // Listed by the firmware as -1.
+  [0x01] = "DellOem.GetExtCap",
+  [0x02] = "DellOem.GetPartInfo",
+  [0x03] = "DellOem.GetFcoeCap",
+  [0x04] = "DellOem.GetVirLink",
+  [0x05] = "DellOem.GetLanStat",
+  [0x06] = "DellOem.GetFcoeStat",
+  [0x07] = "DellOem.SetAddr",
+  [0x08] = "DellOem.GetAddr",
+  [0x09] = "DellOem.SetLicense",
+  [0x0A] = "DellOem.GetLicense",
+  [0x0B] = "DellOem.SetPtCtrl",
+  [0x0C] = "DellOem.GetPtCtrl",
+  [0x0D] = "DellOem.SetPartTxBw",
+  [0x0E] = "DellOem.GetPartTxBw",
+  [0x10] = "DellOem.SetMcIpAddr",
+  [0x11] = "DellOem.GetTeamInfo",
+  [0x12] = "DellOem.DisablePort",
+  [0x13] = "DellOem.GetTemp",
+  [0x14] = "DellOem.SetLinkTune",
+  [0x15] = "DellOem.EnableOobWoL",
+  [0x16] = "DellOem.DisOobWoL",
+};
+
+static const char *const _ncsiResultNames[] = {
+  [0x00] = "OK",
+  [0x01] = "ErrInstanceId",
+  [0x02] = "ErrCmdType",
+  [0x03] = "ErrPayloadLen",
+  [0x04] = "ErrChksum",
+  [0x05] = "ErrInitReq",
+  [0x06] = "ErrPkgId",
+  [0x07] = "ErrChId",
+  [0x08] = "ErrSysBusy",
+  [0x09] = "OemOK",
+  [0x0A] = "ErrOemIana",
+  [0x0B] = "ErrOemCmdType",
+  [0x0C] = "ErrOemPkgPayloadLen",
+  [0x0D] = "ErrOemCmdPayloadLen",
+  [0x0E] = "ErrHdrRev",
+  [0x80] = "RMU->SMbus",
+  [0x81] = "SMBus->RMU",
+};
+
+// MCTP control commands (type 0xF7, bits 8-15) and their completion codes
+// (bits 16-23, for responses).
+static const char *const _mctpCmdNames[] = {
+  [0x01] = "SetEndpointID",
+  [0x02] = "GetEndpointID",
+  [0x04] = "GetMCTPVerSupport",
+  [0x05] = "GetMsgTypeSupport",
+};
+
+static const char *const _mctpCompletionNames[] = {
+  [0x00] = "SUCCESS",
+  [0x01] = "ERROR",
+  [0x02] = "InvalidData",
+  [0x03] = "InvalidLen",
+  [0x04] = "NotReady",
+  [0x05] = "UnsupportedCmd",
+};
+
+// NC-SI AEN types (type 0xF1, bits 0-7).
+static const char *const _aenNames[] = {
+  [0x00] = "LinkChg",
+  [0x01] = "CfgReq",
+  [0x02] = "DrvrChg",
+};
+
+// Host driver events (type 0xF6): the driver's OS (bits 16-23) and the event
+// (bits 8-15). OS values 0xF1-0xFF which aren't named here are printed in hex
+// and all other unnamed values are NDIS versions.
+static const char *const _driverOSNames[] = {
+  [0x01] = "DIAG",
+  [0x10] = "ODI",
+  [0x12] = "UNDI",
+  [0x13] = "UEFI",
+  [0xF0] = "LINUX",
+  [0xF4] = "SOLARIS",
+  [0xF6] = "FREEBSD",
+  [0xF8] = "NETWARE",
+};
+
+static const char *const _driverEventNames[] = {
+  [0x01] = "start",
+  [0x02] = "unload",
+  [0x03] = "WOL",
+  [0x04] = "suspend",
+};
+
+typedef struct {
+  uint32_t    mask;
+  const char *name;
+} ape_log_flag;
+
+// Type 0x14.
+static const ape_log_flag _statusFlags[] = {
+  {0x000001, "PCIereset"},
+  {0x000002, "P0_GRCrst"},
+  {0x000004, "P0_DsChg"},
+  {0x000080, "P1_GRCrst"},
+  {0x000100, "P1_DsChg"},
+  {0x002000, "P2_GRCrst"},
+  {0x004000, "P2_DsChg"},
+  {0x100000, "P3_GRCrst"},
+  {0x080000, "P3_DsChg"},
+};
+
+// Type 0xF4.
+static const ape_log_flag _fixFlags[] = {
+  {0x002000, "ARPMerr"},
+  {0x004000, "ARPMresetted"},
+  {0x008000, "RegRepair"},
+  {0x080000, "PhyBusy"}, // MIIWait timed out
+  {0x100000, "MacResetted"},
+  {0x200000, "MacPhyMismatch"},
+  {0x400000, "DriverBusy"},
+  {0x800000, "DriverDead"},
+};
+
+struct ape_log_type;
+
+// Describes the entry e, whose type is t, into b. avail is the number of
+// entries from e onwards which are available, since the arguments of a log
+// record follow it.
+typedef void ape_log_describe_t(log_buf *b, const struct ape_log_type *t,
+                                const uint32_t (*e)[2], size_t avail);
+
+typedef struct ape_log_type {
+  const char          *kind;   // Short name of the kind of entry, e.g. "link".
+  ape_log_describe_t  *describe;
+  uint8_t              port;   // For per-port types: the port, and the
+  uint8_t              intNo;  // interrupt it is shared with other ports as.
+  const char *const   *names;  // Names by subtype, where the type has them.
+  size_t               numNames;
+} ape_log_type;
+
+static const char *_APELogName(const char *const *names, size_t numNames, uint32_t i) {
+  return (i < numNames) ? names[i] : NULL;
+}
+
+static void _APELogFlags(log_buf *b, const ape_log_flag *flags, size_t numFlags,
+                         const char *sep, uint32_t arg) {
+  for (size_t i=0; i<numFlags; ++i)
+    if (arg & flags[i].mask) {
+      LogBufPuts(b, sep);
+      LogBufPuts(b, flags[i].name);
+    }
+}
+
+static void _APELogStatus(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  LogBufPuts(b, "INT 0x14 General Status Change:");
+  _APELogFlags(b, _statusFlags, ARRAYLEN(_statusFlags), " ", e[0][0] >> 8);
+}
+
+static void _APELogPower(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  // Note: The bit tested here is actually from bit 19 of
+  // REG_MISCELLANEOUS_CONFIGURATION. Which is listed as "PME_EN_State".
+  // Does this bit mean Vmain?
+  LogBufPrintf(b, "INT 0x18: enter %s", (e[0][0] & 0x08000000) ? "Vmain" : "Vaux");
+}
+
+static void _APELogLink(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  static const char *const _str[] = {"1000mb", "100mb", "10mb", "nolnk"};
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "INT 0x%02X Link Status Change: port%u D%u ps=%u ms=%u lnk=%s %s",
+    t->intNo, t->port,
+    (arg >>  8) & 0x3,
+    (arg >>  4) & 0x7,
+    (arg      ) & 0xF,
+    _str[(arg >> 19) & 0x3],
+    (arg & 0x02000) ? "Vmain" : "Vaux");
+}
+
+static void _APELogRXPacket(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "INT 0x%02X RX Packet: port%u head=0x%02X tail=0x%02X bufCount=0x%X",
+    t->intNo, t->port,
+    (arg >> 8) & 0xFF, arg & 0xFF, (arg>>18) & 0xF);
+}
+
+static void _APELogRMUEgress(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "INT 0x11 RMU Egress: %s%s saHit=%d len=%u%s",
+    (arg & 0x02) ? "pt" : "cmd",
+    (arg & 0x01) ? " bad" : "",
+    (arg & 0x04) ? (int)((arg >> 9) & 0xF) : -1,
+    (arg >> 13) & 0x7FF,
+    (arg & 0x08) ? " vlan" : "");
+}
+
+static void _APELogH2B(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "INT 0x0D H2B: %u lwords%s%s",
+    (arg >> 2) & 0x3FFFFF,
+    (arg & 0x02) ? " underflow" : "",
+    (arg & 0x01) ? " !empty" : "");
+}
+
+static void _APELogFault(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  LogBufPrintf(b, "fault: chip%u 0x%06x", t->port, e[0][0] >> 8);
+}
+
+static void _APELogVPD(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "VPD: update chip%u %s version", (arg >> 8) & 0xFF, (arg & 0xFF) ? "IMFW" : "BOOT");
+}
+
+// "<command>_<name> (ch:<y>/<z>) <result>", as the firmware's own log viewer
+// does.
+static void _APELogNCSI(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  const char *cmd    = _APELogName(t->names, t->numNames, (arg >> 16) & 0xFF);
+  const char *result = _APELogName(_ncsiResultNames, ARRAYLEN(_ncsiResultNames), arg & 0xFF);
+  LogBufPrintf(b, "%02X_%s (ch:%X/%X) ",
+    (arg >> 16) & 0xFF, cmd ? cmd : "invalid", (arg >> 13) & 0x7FF, (arg >> 8) & 0x1F);
+  if (result)
+    LogBufPuts(b, result);
+  else
+    LogBufPrintf(b, "%02x_???", arg & 0xFF);
+}
+
+static void _APELogAEN(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  const char *name = _APELogName(_aenNames, ARRAYLEN(_aenNames), arg & 0xFF);
+  if (name)
+    LogBufPrintf(b, "aen: %s", name);
+  else
+    LogBufPrintf(b, "aen: 0x%02X", arg & 0xFF);
+}
+
+static void _APELogCrash(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  LogBufPrintf(b, "!!!: crashed PC=0x%06x", e[0][0] >> 8);
+}
+
+static void _APELogDriverPresent(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  if (arg & 0xFFFF00)
+    LogBufPrintf(b, "drv: p%u present %u.%u", arg & 0xFF, (arg >> 16) & 0xFF, (arg >> 8) & 0xFF);
+  else
+    LogBufPrintf(b, "drv: p%u absent", arg & 0xFF);
+}
+
+static void _APELogFix(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "FIX: p%02x", arg & 0xFF);
+  _APELogFlags(b, _fixFlags, ARRAYLEN(_fixFlags), "  ", arg);
+}
+
+static void _APELogFailedResponse(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  LogBufPrintf(b, "!failed rsps=%02x reason=%02x-%02x",
+    (arg >> 16) & 0xFF, arg & 0xFF, (arg >> 8) & 0xFF);
+}
+
+static void _APELogDriverEvent(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  uint32_t os  = (arg >> 16) & 0xFF;
+  const char *osName = _APELogName(_driverOSNames, ARRAYLEN(_driverOSNames), os);
+  const char *event  = _APELogName(_driverEventNames, ARRAYLEN(_driverEventNames), (arg >> 8) & 0xFF);
+
+  LogBufPrintf(b, "drv: p%u ", arg & 0xFF);
+  if (osName)
+    LogBufPuts(b, osName);
+  else
+    LogBufPrintf(b, (os > 0xF0) ? "0x%02X" : "NDIS 0x%02X", os);
+
+  if (event)
+    LogBufPrintf(b, " %s", event);
+  else
+    LogBufPrintf(b, " 0x%02X", (arg >> 8) & 0xFF);
+}
+
+static void _APELogMCTP(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  const char *cmd = _APELogName(_mctpCmdNames, ARRAYLEN(_mctpCmdNames), (arg >> 8) & 0xFF);
+  LogBufPrintf(b, "mctpCtrl:Rq%u D%u %u %02X_%s",
+    (arg >> 7) & 1, (arg >> 6) & 1, arg & 0x1F, (arg >> 8) & 0xFF, cmd ? cmd : "???");
+
+  if (!(arg & 0x80)) {
+    const char *cc = _APELogName(_mctpCompletionNames, ARRAYLEN(_mctpCompletionNames), (arg >> 16) & 0xFF);
+    if (cc)
+      LogBufPrintf(b, " %s", cc);
+    else
+      LogBufPrintf(b, " 0x%02X", (arg >> 16) & 0xFF);
+  }
+}
+
+static void _APELogRecord(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  uint32_t arg = e[0][0] >> 8;
+  uint32_t args[0xF] = {}, nargs = 0;
+  while (nargs < ((arg >> 20) & 0xF) && 1+nargs < avail
+      && (e[1+nargs][0] & 0xFF) == APE_DBGLOG_TYPE__FMT_ARG
+      && (e[1+nargs][0] >> 8) == nargs) {
+    args[nargs] = e[1+nargs][1];
+    ++nargs;
+  }
+
+  char buf[1024];
+  FormatLogRecord(buf, sizeof(buf), LOG_SOURCE_APE, arg & 0xFFFFF, args, nargs);
+  buf[strcspn(buf, "\n")] = '\0';
+  LogBufPuts(b, buf);
+  if (nargs < ((arg >> 20) & 0xF))
+    LogBufPrintf(b, "  (%u arguments missing)", ((arg >> 20) & 0xF) - nargs);
+}
+
+static void _APELogRecordArg(log_buf *b, const ape_log_type *t, const uint32_t (*e)[2], size_t avail) {
+  LogBufPrintf(b, "(argument %u)", e[0][0] >> 8);
+}
+
+// Known entry types. Types 0xD8 (card temperature), 0xDC (GPIO) and 0xEE
+// (card temperature and thresholds: "card: <x>°C Tdead(g3):<y>,<z>
+// TfanOnAux(g4):..." with the temperature in bits 0-6 and thresholds in bits
+// 8-15 and 16-23) are also logged, but their encoding isn't fully understood.
+//
+//  type  kind          describe               port intNo names
+#define APE_LOG_TYPES(X) \
+  X(0x08, "h2b",        _APELogH2B,            0, 0x0D, NO_NAMES) \
+  X(0x0B, "rx",         _APELogRXPacket,       0, 0x0B, NO_NAMES) \
+  X(0x1B, "rx",         _APELogRXPacket,       1, 0x1B, NO_NAMES) \
+  X(0x33, "rx",         _APELogRXPacket,       2, 0x0B, NO_NAMES) \
+  X(0x43, "rx",         _APELogRXPacket,       3, 0x1B, NO_NAMES) \
+  X(0x11, "rmu",        _APELogRMUEgress,      0, 0x11, NO_NAMES) \
+  X(0x14, "status",     _APELogStatus,         0, 0x14, NO_NAMES) \
+  X(0x18, "power",      _APELogPower,          0, 0x18, NO_NAMES) \
+  X(0x19, "link",       _APELogLink,           0, 0x19, NO_NAMES) \
+  X(0x1A, "link",       _APELogLink,           1, 0x1A, NO_NAMES) \
+  X(0x41, "link",       _APELogLink,           2, 0x19, NO_NAMES) \
+  X(0x42, "link",       _APELogLink,           3, 0x1A, NO_NAMES) \
+  X(0xD9, "fault",      _APELogFault,          0, 0,    NO_NAMES) \
+  X(0xDA, "fault",      _APELogFault,          1, 0,    NO_NAMES) \
+  X(0xDB, "vpd",        _APELogVPD,            0, 0,    NO_NAMES) \
+  X(0xE0, "ncsi",       _APELogNCSI,           0, 0,    NAMES(_ncsiBrcmOemNames)) \
+  X(0xE1, "ncsi",       _APELogNCSI,           0, 0,    NAMES(_ncsiDellOemNames)) \
+  X(0xF0, "ncsi",       _APELogNCSI,           0, 0,    NAMES(_ncsiCmdNames)) \
+  X(0xF1, "aen",        _APELogAEN,            0, 0,    NO_NAMES) \
+  X(0xF2, "crash",      _APELogCrash,          0, 0,    NO_NAMES) \
+  X(0xF3, "driver",     _APELogDriverPresent,  0, 0,    NO_NAMES) \
+  X(0xF4, "fix",        _APELogFix,            0, 0,    NO_NAMES) \
+  X(0xF5, "ncsi-fail",  _APELogFailedResponse, 0, 0,    NO_NAMES) \
+  X(0xF6, "driver",     _APELogDriverEvent,    0, 0,    NO_NAMES) \
+  X(0xF7, "mctp",       _APELogMCTP,           0, 0,    NO_NAMES) \
+  X(APE_DBGLOG_TYPE__FMT,     "record",     _APELogRecord,    0, 0, NO_NAMES) \
+  X(APE_DBGLOG_TYPE__FMT_ARG, "record-arg", _APELogRecordArg, 0, 0, NO_NAMES)
+
+#define NO_NAMES     NULL, 0
+#define NAMES(Names) Names, ARRAYLEN(Names)
+#define X(Type, Kind, Describe, Port, IntNo, Names) \
+  [Type] = {Kind, Describe, Port, IntNo, Names},
+
+static const ape_log_type _apeLogTypes[256] = {
+  APE_LOG_TYPES(X)
+};
+
+#undef X
+#undef NAMES
+#undef NO_NAMES
+
+// Returns the kind of an entry type, e.g. "link", or NULL if it isn't known.
+static const char *APELogKind(uint8_t type) {
+  return _apeLogTypes[type].kind;
+}
+
+// Describes a debug log entry into b. e points to the entry and avail is the
+// number of entries from it onwards which are available. Nothing is written
+// if the type isn't known.
+static void APELogDescribe(log_buf *b, const uint32_t (*e)[2], size_t avail) {
+  const ape_log_type *t = &_apeLogTypes[e[0][0] & 0xFF];
+  if (t->describe)
+    t->describe(b, t, e, avail);
+}
+
+enum {
+  APE_LOG_TEXT,
+  APE_LOG_JSON,   // One JSON object per line.
+};
+
+// Formats a debug log entry, which was in the given slot of the ring, as a
+// line in the given style. If ts64 is non-NULL, it is the entry's timestamp
+// extended to 64 bits.
+static void APELogFormatEntry(log_buf *b, int style, uint32_t slot, const uint64_t *ts64,
+                              const uint32_t (*e)[2], size_t avail) {
+  uint32_t typeArg = e[0][0];
+  uint32_t ts      = e[0][1];
+  uint8_t  type    = typeArg & 0xFF;
+
+  if (style == APE_LOG_JSON) {
+    char descBuf[1100];
+    log_buf desc = {descBuf, 0, sizeof(descBuf)};
+    descBuf[0] = '\0';
+    APELogDescribe(&desc, e, avail);
+
+    LogBufPrintf(b, "{\"slot\":%u,\"ts\":%u,\"repeat\":%u,", slot, ts & 0x0FFFFFFF, ts>>28);
+    if (ts64)
+      LogBufPrintf(b, "\"ts64\":%" PRIu64 ",", *ts64);
+    LogBufPrintf(b, "\"type\":%u,\"arg\":%u,\"kind\":", type, typeArg >> 8);
+    if (APELogKind(type))
+      LogBufJSONString(b, APELogKind(type));
+    else
+      LogBufPuts(b, "null");
+    LogBufPuts(b, ",\"text\":");
+    LogBufJSONString(b, descBuf);
+    LogBufPuts(b, "}\n");
+    return;
+  }
+
+  char c[4] = "   ";
+  if (type >= 0x20 && type <= 0x7E) {
+    c[0] = c[2] = '\'';
+    c[1] = type;
+  }
+
+  if (ts64)
+    LogBufPrintf(b, "%12" PRIu64 "  ", *ts64);
+  LogBufPrintf(b, "%2u)  [%9u r%01X] type=0x%02X (%s)  arg=0x  %02X_%04X",
+    slot,
+    ts & 0x0FFFFFFF, ts>>28,
+    type, c,
+    (typeArg>>24)&0xFF, (typeArg>>8) & 0xFFFF);
+
+  // The description follows directly, or nothing at all if there isn't one.
+  size_t len = b->len;
+  LogBufPuts(b, "  ");
+  APELogDescribe(b, e, avail);
+  if (b->len == len+2) {
+    b->len = len;
+    if (len < b->cap)
+      b->data[len] = '\0';
+  }
+  LogBufPuts(b, "\n");
+}
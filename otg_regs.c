@@ -0,0 +1,156 @@
+/* Register Decoding
+ * -----------------
+ * Names, bitfields and enumerated values of registers, and the memory map, as
+ * documented in regs.yaml. The tables are generated from regs.yaml at build
+ * time by regs2c into otg_regs_table.c, which is included below.
+ *
+ * Registers are keyed by their address in the RX CPU's view of memory (so
+ * device registers are at REGMEM_BASE, APE registers at REGMEM_BASE+APE_OFFSET
+ * and GENCOM at GENCOM_BASE), the same addresses used by otgdbg get. They are
+ * sorted by address and looked up by binary search. Each register refers to a
+ * contiguous run of fields in g_regFields, sorted by low bit, and each field
+ * (and each register, for registers with values for the whole word) refers to
+ * a run of values in g_regValues sorted by value. Strings are held once in
+ * g_regStrings and referred to by offset.
+ */
+typedef struct {
+  uint32_t addr;
+  uint16_t name, sym;    // Offsets into g_regStrings.
+  uint16_t firstField;
+  uint8_t  numFields;
+  uint16_t firstValue;   // Values of the whole register, if any.
+  uint8_t  numValues;
+} reg_def;
+
+typedef struct {
+  uint8_t  lo, hi;       // Bit range, inclusive.
+  uint16_t name;
+  uint16_t firstValue;
+  uint8_t  numValues;
+} reg_field;
+
+typedef struct {
+  uint32_t value;
+  uint16_t name;
+} reg_value;
+
+// A region of the RX CPU memory map. Regions are sorted and do not overlap,
+// but need not be contiguous.
+typedef struct {
+  uint32_t start, end;   // Inclusive.
+  uint16_t name;
+  bool     mapped;       // False for regions marked "Unmapped".
+} reg_region;
+
+#include "otg_regs_table.c"
+
+static inline const char *RegString(uint16_t off) {
+  return g_regStrings + off;
+}
+
+// Looks up the register at addr. Returns NULL if it isn't documented.
+static const reg_def *RegLookup(uint32_t addr) {
+  size_t lo = 0, hi = ARRAYLEN(g_regDefs);
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (g_regDefs[mid].addr < addr)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return (lo < ARRAYLEN(g_regDefs) && g_regDefs[lo].addr == addr) ? &g_regDefs[lo] : NULL;
+}
+
+// Looks up the memory map region containing addr. Returns NULL if addr isn't
+// in any documented region.
+static const reg_region *RegRegionLookup(uint32_t addr) {
+  size_t lo = 0, hi = ARRAYLEN(g_regRegions);
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (g_regRegions[mid].end < addr)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return (lo < ARRAYLEN(g_regRegions) && g_regRegions[lo].start <= addr) ? &g_regRegions[lo] : NULL;
+}
+
+// Returns the name of v among numValues values starting at firstValue, or NULL.
+static const char *_RegValueName(uint16_t firstValue, uint8_t numValues, uint32_t v) {
+  const reg_value *vals = &g_regValues[firstValue];
+  size_t lo = 0, hi = numValues;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (vals[mid].value < v)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return (lo < numValues && vals[lo].value == v) ? RegString(vals[lo].name) : NULL;
+}
+
+static inline uint32_t _RegFieldMask(const reg_field *f) {
+  return (0xFFFFFFFFU >> (31 - f->hi)) & (0xFFFFFFFFU << f->lo);
+}
+
+static void _RegBits(char *buf, size_t bufLen, const reg_field *f) {
+  if (f->lo == f->hi)
+    snprintf(buf, bufLen, "%u", f->lo);
+  else
+    snprintf(buf, bufLen, "%u-%u", f->lo, f->hi);
+}
+
+// Describes the fields of a register. If all is false, only fields which are
+// nonzero in value are shown; this is the compact form used when dumping many
+// registers. Bits set in value which aren't covered by any field are shown
+// regardless.
+static void RegDecode(log_buf *b, const reg_def *r, uint32_t value, bool all) {
+  const char *wordName = r->numValues ? _RegValueName(r->firstValue, r->numValues, value) : NULL;
+  if (wordName)
+    LogBufPrintf(b, "    = %s\n", wordName);
+
+  uint32_t covered = 0;
+  for (const reg_field *f = &g_regFields[r->firstField]; f < &g_regFields[r->firstField + r->numFields]; ++f) {
+    uint32_t mask = _RegFieldMask(f);
+    uint32_t fv = (value & mask) >> f->lo;
+    covered |= mask;
+    if (!fv && !all)
+      continue;
+
+    char bits[8];
+    _RegBits(bits, sizeof(bits), f);
+    const char *name = *RegString(f->name) ? RegString(f->name) : "(unnamed)";
+    if (f->lo == f->hi && !f->numValues) {
+      LogBufPrintf(b, "    %-5s  %s%s\n", bits, name, fv ? "" : " (clear)");
+      continue;
+    }
+
+    const char *valueName = _RegValueName(f->firstValue, f->numValues, fv);
+    LogBufPrintf(b, "    %-5s  %s = 0x%X", bits, name, fv);
+    if (valueName)
+      LogBufPrintf(b, " (%s)", valueName);
+    LogBufPuts(b, "\n");
+  }
+
+  if (r->numFields && (value & ~covered))
+    LogBufPrintf(b, "    ?      Unknown bits 0x%04X_%04X\n", (value & ~covered)>>16, (value & ~covered)&0xFFFF);
+}
+
+// Describes the fields of a register and their documented values, without
+// reference to any particular value of the register.
+static void RegDescribe(log_buf *b, const reg_def *r) {
+  for (size_t i=0; i<r->numValues; ++i) {
+    const reg_value *v = &g_regValues[r->firstValue + i];
+    LogBufPrintf(b, "    = 0x%04X_%04X  %s\n", v->value>>16, v->value&0xFFFF, RegString(v->name));
+  }
+
+  for (const reg_field *f = &g_regFields[r->firstField]; f < &g_regFields[r->firstField + r->numFields]; ++f) {
+    char bits[8];
+    _RegBits(bits, sizeof(bits), f);
+    LogBufPrintf(b, "    %-5s  %s\n", bits, *RegString(f->name) ? RegString(f->name) : "(unnamed)");
+    for (size_t i=0; i<f->numValues; ++i) {
+      const reg_value *v = &g_regValues[f->firstValue + i];
+      LogBufPrintf(b, "             0x%X  %s\n", v->value, RegString(v->name));
+    }
+  }
+}
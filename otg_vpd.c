@@ -0,0 +1,293 @@
+/* VPD Parsing
+ * -----------
+ * PCI VPD data is a sequence of resources, each introduced by a small or
+ * large resource tag. The read-only (0x10) and read-write (0x11) resources
+ * contain a sequence of keywords, each being a two-character name, a one-byte
+ * length and that many bytes of data. The read-only resource ends with the RV
+ * keyword, whose first byte is chosen such that the sum of all bytes from the
+ * start of the VPD data up to and including it is zero; any further bytes of
+ * RV are reserved space. Likewise, the read-write resource ends with RW, whose
+ * data is free space.
+ *
+ * VPDParse walks the data once and records every keyword in a fixed-size
+ * index held in the caller-provided vpd_index, so that no heap allocation is
+ * needed and subsequent lookups do not need to rescan the data. Keywords are
+ * additionally placed in a small open-addressed hash table keyed on the
+ * keyword name so that lookup is O(1).
+ *
+ * The index refers to the data by offset and does not copy it, so the data
+ * must outlive the index.
+ */
+#define VPD_MAX_ENTRIES 128
+#define VPD_HASH_SIZE   256 // Power of two, at least twice VPD_MAX_ENTRIES.
+
+enum {
+  VPD_TYPE_IDENTIFIER_STRING = 0x02,
+  VPD_TYPE_END               = 0x0F,
+  VPD_TYPE_READ_ONLY         = 0x10,
+  VPD_TYPE_READ_WRITE        = 0x11,
+};
+
+enum {
+  VPD_KW_PART_NUMBER         = 0x504E, // 'PN'
+  VPD_KW_ENGINEERING_CHANGES = 0x4543, // 'EC'
+  VPD_KW_SERIAL_NUMBER       = 0x534E, // 'SN'
+  VPD_KW_MANUFACTURE_ID      = 0x4D4E, // 'MN'
+  VPD_KW_RV                  = 0x5256, // 'RV'
+  VPD_KW_ASSET_TAG           = 0x5941, // 'YA'
+  VPD_KW_READ_WRITE_AREA     = 0x5257, // 'RW'
+  VPD_KW_V0                  = 0x5630, // 'V0' ] Unknown Vendor-Specific
+  VPD_KW_V1                  = 0x5631, // 'V1' ]
+  VPD_KW_V2                  = 0x5632, // 'V2' ]
+  VPD_KW_V3                  = 0x5633, // 'V3' ]
+  VPD_KW_V4                  = 0x5634, // 'V4' ]
+  VPD_KW_V5                  = 0x5635, // 'V5' ]
+  VPD_KW_V6                  = 0x5636, // 'V6' ]
+};
+
+// Errors returned by VPDParse and VPDSet.
+enum {
+  VPD_ERR_NONE = 0,
+  VPD_ERR_TRUNCATED,     // A resource or keyword runs past the end of the data.
+  VPD_ERR_NO_END,        // No end tag was found.
+  VPD_ERR_TOO_MANY,      // More than VPD_MAX_ENTRIES keywords.
+  VPD_ERR_NOT_FOUND,     // VPDSet: no such keyword.
+  VPD_ERR_NO_SPACE,      // VPDSet: not enough reserved space to grow the value.
+  VPD_ERR_RESERVED,      // VPDSet: RV cannot be set directly.
+};
+
+typedef struct {
+  uint16_t kw;
+  uint8_t  section;      // VPD_TYPE_READ_ONLY or VPD_TYPE_READ_WRITE
+  uint8_t  len;          // Length of the value in bytes.
+  uint32_t offset;       // Offset of the value from the start of the VPD data.
+} vpd_entry;
+
+typedef struct {
+  uint8_t  *data;
+  size_t   dataLen;
+
+  uint32_t idOffset;     // Identifier string, if idLen is nonzero.
+  uint16_t idLen;
+  uint32_t roOffset;     // Offset of the read-only resource tag, if roLen is nonzero.
+  uint16_t roLen;        // Length of the read-only resource body.
+  uint32_t rwOffset;     // As above, for the read-write resource.
+  uint16_t rwLen;
+  uint32_t endOffset;    // Offset just past the end tag.
+  int      rvIdx;        // Index of the RV entry, or -1.
+  int      err;          // Result of the last VPDParse.
+
+  size_t    numEntries;
+  vpd_entry entries[VPD_MAX_ENTRIES];
+  uint8_t   hash[VPD_HASH_SIZE]; // Entry index plus one; zero means empty.
+} vpd_index;
+
+static const char *VPDErrorString(int err) {
+  switch (err) {
+    case VPD_ERR_NONE:      return "no error";
+    case VPD_ERR_TRUNCATED: return "resource or keyword truncated";
+    case VPD_ERR_NO_END:    return "no end tag";
+    case VPD_ERR_TOO_MANY:  return "too many keywords";
+    case VPD_ERR_NOT_FOUND: return "keyword not present";
+    case VPD_ERR_NO_SPACE:  return "not enough reserved space";
+    case VPD_ERR_RESERVED:  return "keyword cannot be set directly";
+    default:                return "unknown error";
+  }
+}
+
+static inline size_t _VPDHash(uint16_t kw) {
+  return (kw * 0x9E37U >> 8) & (VPD_HASH_SIZE-1);
+}
+
+// Returns a pointer to the hash slot for kw: either the slot holding it, or
+// the empty slot where it would go.
+static uint8_t *_VPDHashSlot(const vpd_index *idx, uint16_t kw) {
+  size_t h = _VPDHash(kw);
+  while (idx->hash[h] && idx->entries[idx->hash[h]-1].kw != kw)
+    h = (h+1) & (VPD_HASH_SIZE-1);
+  return (uint8_t*)&idx->hash[h];
+}
+
+static int _VPDParseKeywords(vpd_index *idx, uint8_t section, uint32_t offset, uint16_t len) {
+  const uint8_t *p = idx->data + offset, *end = p + len;
+  while (p < end) {
+    if (end - p < 3 || end - p - 3 < p[2])
+      return VPD_ERR_TRUNCATED;
+    if (idx->numEntries >= VPD_MAX_ENTRIES)
+      return VPD_ERR_TOO_MANY;
+
+    vpd_entry *e = &idx->entries[idx->numEntries];
+    e->kw      = (p[0]<<8) | p[1];
+    e->section = section;
+    e->len     = p[2];
+    e->offset  = (p+3) - idx->data;
+
+    // Where a keyword appears more than once, the first occurrence wins.
+    uint8_t *slot = _VPDHashSlot(idx, e->kw);
+    if (!*slot)
+      *slot = ++idx->numEntries;
+    else
+      ++idx->numEntries;
+
+    if (section == VPD_TYPE_READ_ONLY && e->kw == VPD_KW_RV && idx->rvIdx < 0)
+      idx->rvIdx = e - idx->entries;
+
+    p += 3 + p[2];
+  }
+  return VPD_ERR_NONE;
+}
+
+static int _VPDParse(vpd_index *idx, uint8_t *data, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    uint8_t type;
+    size_t resLen, body;
+    if (data[i] & 0x80) {
+      // Large tag
+      if (len - i < 3)
+        return VPD_ERR_TRUNCATED;
+      type   = data[i] & 0x7F;
+      resLen = data[i+1] | (data[i+2]<<8);
+      body   = i+3;
+    } else {
+      // Small tag
+      type   = (data[i]>>3) & 0x0F;
+      resLen = data[i] & 0x07;
+      body   = i+1;
+    }
+
+    if (resLen > len - body)
+      return VPD_ERR_TRUNCATED;
+
+    int err = VPD_ERR_NONE;
+    switch (type) {
+      case VPD_TYPE_IDENTIFIER_STRING:
+        idx->idOffset = body;
+        idx->idLen    = resLen;
+        break;
+      case VPD_TYPE_READ_ONLY:
+        idx->roOffset = i;
+        idx->roLen    = resLen;
+        err = _VPDParseKeywords(idx, type, body, resLen);
+        break;
+      case VPD_TYPE_READ_WRITE:
+        idx->rwOffset = i;
+        idx->rwLen    = resLen;
+        err = _VPDParseKeywords(idx, type, body, resLen);
+        break;
+      case VPD_TYPE_END:
+        idx->endOffset = body + resLen;
+        return VPD_ERR_NONE;
+      default:
+        break;
+    }
+    if (err)
+      return err;
+
+    i = body + resLen;
+  }
+
+  return VPD_ERR_NO_END;
+}
+
+// Parses len bytes of VPD data into idx. On error, idx describes whatever was
+// successfully parsed before the error and can still be used for lookup, but
+// not for VPDSet.
+static int VPDParse(vpd_index *idx, uint8_t *data, size_t len) {
+  memset(idx, 0, sizeof(*idx));
+  idx->data    = data;
+  idx->dataLen = len;
+  idx->rvIdx   = -1;
+  idx->err     = _VPDParse(idx, data, len);
+  return idx->err;
+}
+
+// Looks up a keyword. Returns NULL if it is not present.
+static const vpd_entry *VPDFind(const vpd_index *idx, uint16_t kw) {
+  uint8_t e = *_VPDHashSlot(idx, kw);
+  return e ? &idx->entries[e-1] : NULL;
+}
+
+static inline const uint8_t *VPDValue(const vpd_index *idx, const vpd_entry *e) {
+  return idx->data + e->offset;
+}
+
+// Returns the RV checksum byte which would make the read-only area sum to
+// zero. Only meaningful if idx->rvIdx >= 0.
+static uint8_t VPDComputeRV(const vpd_index *idx) {
+  const vpd_entry *rv = &idx->entries[idx->rvIdx];
+  uint8_t sum = 0;
+  for (size_t i=0; i<rv->offset; ++i)
+    sum += idx->data[i];
+  return -sum;
+}
+
+// Returns true if there is no RV keyword, or if the checksum it holds is
+// correct.
+static bool VPDCheckRV(const vpd_index *idx) {
+  if (idx->rvIdx < 0 || !idx->entries[idx->rvIdx].len)
+    return true;
+  return idx->data[idx->entries[idx->rvIdx].offset] == VPDComputeRV(idx);
+}
+
+static void VPDUpdateRV(vpd_index *idx) {
+  if (idx->rvIdx < 0 || !idx->entries[idx->rvIdx].len)
+    return;
+  idx->data[idx->entries[idx->rvIdx].offset] = VPDComputeRV(idx);
+}
+
+// Changes the value of an existing keyword in place. If the length changes,
+// the following keywords in the same resource are moved, with the difference
+// taken from or given to the trailing RV (read-only) or RW (read-write)
+// keyword, so the resource and total length stay the same. The RV checksum is
+// recomputed. The data is not modified if an error is returned.
+static int VPDSet(vpd_index *idx, uint16_t kw, const void *val, size_t valLen) {
+  if (idx->err)
+    return idx->err;
+  if (kw == VPD_KW_RV)
+    return VPD_ERR_RESERVED;
+
+  const vpd_entry *e = VPDFind(idx, kw);
+  if (!e)
+    return VPD_ERR_NOT_FOUND;
+  if (valLen > 0xFF)
+    return VPD_ERR_NO_SPACE;
+
+  if (valLen != e->len) {
+    uint16_t slackKW = (e->section == VPD_TYPE_READ_ONLY) ? VPD_KW_RV : VPD_KW_READ_WRITE_AREA;
+    // Keywords within a resource are packed back to back, so stop at the
+    // first gap: that is the start of another resource, possibly of the same
+    // type, whose length would not be adjusted.
+    vpd_entry *slack = NULL;
+    for (size_t i=e-idx->entries+1; i<idx->numEntries && idx->entries[i].section == e->section
+        && idx->entries[i].offset == idx->entries[i-1].offset + idx->entries[i-1].len + 3; ++i)
+      if (idx->entries[i].kw == slackKW)
+        slack = &idx->entries[i];
+
+    // RV must retain its checksum byte.
+    size_t minSlack = (slackKW == VPD_KW_RV) ? 1 : 0;
+    if (!slack || slack->len + (size_t)e->len < valLen + minSlack)
+      return VPD_ERR_NO_SPACE;
+
+    // Move everything between the end of this value and the start of the
+    // slack keyword's value, then fix up the two length bytes.
+    uint32_t from = e->offset + e->len;
+    uint32_t to   = e->offset + valLen;
+    memmove(idx->data + to, idx->data + from, slack->offset - from);
+    idx->data[e->offset - 1] = valLen;
+    idx->data[slack->offset - 1 + to - from] = slack->len + e->len - valLen;
+
+    // The slack keyword's value is reserved space (and the RV checksum, which
+    // is recomputed below), so clear it rather than leave stale bytes.
+    memset(idx->data + slack->offset + to - from, 0, slack->len + e->len - valLen);
+  }
+
+  memcpy(idx->data + e->offset, val, valLen);
+
+  // Offsets have changed, so reindex. This cannot fail since the structure of
+  // the data was valid before and has been preserved.
+  int err = VPDParse(idx, idx->data, idx->dataLen);
+  assert(!err);
+  VPDUpdateRV(idx);
+  return VPD_ERR_NONE;
+}
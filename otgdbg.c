@@ -4,16 +4,24 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <dirent.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <poll.h>
 #include <sched.h>
 #include <signal.h>
+#include <elf.h>
 #include "otg.h"
 #include "otg_common.c"
+#include "otg_log.c"
+#include "otg_regs.c"
 
 #define ARRAYLEN(X) (sizeof(X)/sizeof((X)[0]))
 
@@ -60,7 +68,8 @@ int MMIOOpen(uintptr_t phys, size_t len, mmio_t **mmio) {
   m->phys = phys;
   m->len = len;
   m->virt = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, phys);
-  if (!m->virt) {
+  if (m->virt == MAP_FAILED) {
+    m->virt = NULL;
     fprintf(stderr, "error: couldn't mmap %p (length 0x%08" PRIuPTR ")\n", (void*)phys, len);
     goto error;
   }
@@ -349,6 +358,126 @@ device_info_t g_devInfo;
 mmio_t *g_mmio12 = NULL;
 mmio_t *g_mmio34 = NULL;
 
+/* Multiple Devices
+ * ----------------
+ * Most commands work on the single device given on the command line. Those
+ * which work on every supported device at once open them all with
+ * DeviceOpenAll, then make one current with DeviceSelect before calling the
+ * usual register access functions.
+ */
+typedef struct {
+  device_info_t info;
+  char          name[16]; // Bus address, e.g. "0000:03:00.1".
+  mmio_t       *mmio12, *mmio34;
+} open_device_t;
+
+static int _CompareOpenDevices(const void *a, const void *b) {
+  const open_device_t *x = a, *y = b;
+  return (x->info.busAddr > y->info.busAddr) - (x->info.busAddr < y->info.busAddr);
+}
+
+static void DeviceCloseAll(open_device_t *devs, size_t numDevs) {
+  for (size_t i=0; i<numDevs; ++i) {
+    MMIOClose(devs[i].mmio12);
+    MMIOClose(devs[i].mmio34);
+  }
+  free(devs);
+}
+
+// Reads a hexadecimal ID, e.g. "vendor", from a PCI device's sysfs
+// directory. These are cached by the kernel, so reading them never touches
+// the device.
+static int _ReadSysfsPCIID(const char *busAddrStr, const char *attr, uint32_t *v) {
+  char path[256], buf[16] = {};
+  snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/%s", busAddrStr, attr);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  ssize_t rd = read(fd, buf, sizeof(buf)-1);
+  close(fd);
+  if (rd <= 0)
+    return -1;
+
+  char *end;
+  *v = strtoul(buf, &end, 16);
+  return end == buf ? -1 : 0;
+}
+
+// Finds and opens every supported device, in bus address order. Devices are
+// picked by their sysfs IDs, so that unrelated devices are never opened, and
+// a supported device which can't be opened is skipped with a warning. Returns
+// the number of devices, or -1 on error.
+static int DeviceOpenAll(open_device_t **devsOut) {
+  DIR *dir = opendir("/sys/bus/pci/devices");
+  if (!dir) {
+    fprintf(stderr, "error: couldn't list PCI devices\n");
+    return -1;
+  }
+
+  open_device_t *devs = NULL;
+  size_t numDevs = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir))) {
+    if (ent->d_name[0] == '.')
+      continue;
+
+    uint32_t vendorID, deviceID;
+    if (_ReadSysfsPCIID(ent->d_name, "vendor", &vendorID) < 0
+     || _ReadSysfsPCIID(ent->d_name, "device", &deviceID) < 0)
+      continue;
+
+    const supported_device_t *sup;
+    for (sup=_supportTable; sup->vendorID; ++sup)
+      if (sup->vendorID == vendorID && sup->deviceID == deviceID)
+        break;
+    if (sup->type != DEVTYPE_BCM5719)
+      continue;
+
+    open_device_t d = {};
+    if (DeviceResolveByString(ent->d_name, &d.info) < 0 || DeviceLoadInfo(&d.info) < 0) {
+      fprintf(stderr, "warning: %s: couldn't load device info, skipping\n", ent->d_name);
+      continue;
+    }
+
+    d.info.type = DEVTYPE_BCM5719;
+    PCIBusAddrToString(d.info.busAddr, d.name, sizeof(d.name));
+    if (MMIOOpen(d.info.resources[0].physStart, d.info.resources[0].physEnd-d.info.resources[0].physStart+1, &d.mmio12) < 0) {
+      fprintf(stderr, "warning: %s: couldn't map BAR 1/2, skipping\n", d.name);
+      continue;
+    }
+    if (MMIOOpen(d.info.resources[2].physStart, d.info.resources[2].physEnd-d.info.resources[2].physStart+1, &d.mmio34) < 0) {
+      fprintf(stderr, "warning: %s: couldn't map BAR 3/4, skipping\n", d.name);
+      MMIOClose(d.mmio12);
+      continue;
+    }
+
+    open_device_t *newDevs = realloc(devs, (numDevs+1)*sizeof(open_device_t));
+    if (!newDevs) {
+      MMIOClose(d.mmio12);
+      MMIOClose(d.mmio34);
+      goto error;
+    }
+    devs = newDevs;
+    devs[numDevs++] = d;
+  }
+
+  closedir(dir);
+  qsort(devs, numDevs, sizeof(open_device_t), _CompareOpenDevices);
+  *devsOut = devs;
+  return numDevs;
+
+error:
+  closedir(dir);
+  DeviceCloseAll(devs, numDevs);
+  return -1;
+}
+
+static void DeviceSelect(const open_device_t *d) {
+  g_bar12 = d->mmio12->virt;
+  g_bar34 = d->mmio34->virt;
+}
+
 static void PrintCommand(int pargc, int argc, char **argv) {
   argv -= pargc;
   while (pargc--)
@@ -395,7 +524,10 @@ static int _CmdInfo(int pargc, int argc, char **argv) {
 static int _UsageGet(int pargc, int argc, char **argv) {
   fprintf(stderr, "usage: ");
   PrintCommand(pargc, argc, argv);
-  fprintf(stderr, "<address>[+num-words] [<address>[+num-words]...]\n");
+  if (!strcmp(argv[0], "dump"))
+    fprintf(stderr, "<address>[+num-words] [<address>[+num-words]...]\n");
+  else
+    fprintf(stderr, "[-d] <address>[+num-words] [<address>[+num-words]...]\n");
   fprintf(stderr,
     "  Retrieves a 32-bit word from device memory at the specified\n"
     "  <address>. The <address> is specified based on the RX CPU's\n"
@@ -411,7 +543,9 @@ static int _UsageGet(int pargc, int argc, char **argv) {
     "  The successive words are output in binary, as little-endian values.\n");
   else
     fprintf(stderr,
-    "  Each word is output as a hexadecimal value.\n");
+    "  Each word is output as a hexadecimal value. With -d, words which are\n"
+    "  documented registers are followed by the register's name and its\n"
+    "  nonzero fields (see the decode command).\n");
   fprintf(stderr,
     "\n"
     "  <address> also supports some optional prefixes before the numeric part: \n"
@@ -509,12 +643,63 @@ static int _ResolveAddress(const char *addr, uint32_t *ad, uint32_t *numWords, c
   return 0;
 }
 
+static void _PrintDecodedWord(uint32_t ad, uint32_t v) {
+  const reg_def *r = RegLookup(ad);
+  if (!r || !*RegString(r->name)) {
+    printf("[0x%04X_%04X] = 0x%04X_%04X\n", ad>>16, ad&0xFFFF, v>>16, v&0xFFFF);
+    return;
+  }
+
+  char buf[4096];
+  log_buf b = {buf, 0, sizeof(buf)};
+  LogBufPrintf(&b, "[0x%04X_%04X] = 0x%04X_%04X  %s\n", ad>>16, ad&0xFFFF, v>>16, v&0xFFFF, RegString(r->sym));
+  RegDecode(&b, r, v, false);
+  fwrite(buf, 1, LogBufLineLen(&b), stdout);
+}
+
 static int _CmdGetEx(int pargc, int argc, char **argv, bool dump) {
-  if (argc < 2)
+  char **addrArgv = argv+1;
+  bool decode = false;
+  if (!dump && argc > 1 && !strcmp(argv[1], "-d")) {
+    decode = true;
+    ++addrArgv;
+  }
+
+  if (!*addrArgv)
     return _UsageGet(pargc, argc, argv);
 
   int ec;
-  char **curArgv = argv+1;
+
+  // Single shell words are queued on the shell's command ring all at once, so
+  // that they don't each wait for a round trip.
+  ape_shell_op *ops = NULL;
+  size_t numOps = 0, curOp = 0;
+  for (char **a = addrArgv; *a; ++a) {
+    uint32_t ad, numWords;
+    int accessMode;
+    if (_ResolveAddress(*a, &ad, &numWords, NULL, &accessMode) < 0) {
+      free(ops);
+      return _UsageGet(pargc, argc, argv);
+    }
+
+    if (accessMode != ACCESS_MODE_APE_SHELL || numWords != 1)
+      continue;
+
+    ape_shell_op *newOps = realloc(ops, (numOps+1)*sizeof(ape_shell_op));
+    if (!newOps) {
+      free(ops);
+      fprintf(stderr, "error: out of memory\n");
+      return -1;
+    }
+
+    ops = newOps;
+    ops[numOps++] = (ape_shell_op) {.type = REG_APE__APEDBG_CMD__TYPE__MEM_GET, .arg0 = ad};
+  }
+
+  if (numOps < 2 || RunAPEShellOps(ops, numOps) < 0)
+    numOps = 0;
+
+  char **curArgv = addrArgv;
   for (; *curArgv; ++curArgv) {
     uint32_t ad;
     uint32_t numWords;
@@ -523,10 +708,52 @@ static int _CmdGetEx(int pargc, int argc, char **argv, bool dump) {
     if (ec < 0)
       return _UsageGet(pargc, argc, argv);
 
+    uint32_t ringValue = 0;
+    bool haveRingValue = false;
+    if (accessMode == ACCESS_MODE_APE_SHELL && numWords == 1 && curOp < numOps) {
+      ape_shell_op *op = &ops[curOp++];
+      if (op->status)
+        _WarnAboutAPEState("exception caught");
+      ringValue = op->status ? 0xFFFFFFFF : op->arg1;
+      haveRingValue = true;
+    }
+
+    // Fetch shell reads in bulk up front. A word which faults reads as
+    // 0xFFFFFFFF, as with GetAPEMemShell, and the read resumes after it.
+    uint32_t *shellBuf = NULL;
+    if (accessMode == ACCESS_MODE_APE_SHELL && numWords > 1) {
+      shellBuf = malloc(numWords*4);
+      if (!shellBuf) {
+        fprintf(stderr, "error: out of memory\n");
+        return -1;
+      }
+
+      for (size_t i=0; i<numWords;) {
+        ssize_t n = GetAPEMemBlockShell(ad + i*4, shellBuf + i, numWords - i);
+        if (n < 0) {
+          if (n == -2) {
+            free(shellBuf);
+            shellBuf = NULL;
+            break;
+          }
+          n = 0;
+        }
+
+        i += n;
+        if (i < numWords)
+          shellBuf[i++] = 0xFFFFFFFF;
+      }
+    }
+
+    uint32_t startAd = ad;
     uint32_t endAt = ad + numWords*4;
     for (; ad < endAt; ad += 4) {
       uint32_t v;
-      if (accessMode == ACCESS_MODE_IP)
+      if (haveRingValue)
+        v = ringValue;
+      else if (shellBuf)
+        v = shellBuf[(ad - startAd)/4];
+      else if (accessMode == ACCESS_MODE_IP)
         v = GetRXWordViaIP(ad);
       else if (accessMode == ACCESS_MODE_FORCED_LOAD)
         v = GetRXWordViaForcedLoad(ad);
@@ -545,13 +772,21 @@ static int _CmdGetEx(int pargc, int argc, char **argv, bool dump) {
 
       if (dump) {
         ssize_t wr = fwrite(&v, sizeof(v), 1, stdout);
-        if (wr < 1)
+        if (wr < 1) {
+          free(shellBuf);
+          free(ops);
           return -1;
-      } else
+        }
+      } else if (decode)
+        _PrintDecodedWord(ad, v);
+      else
         printf("[0x%04X_%04X] = 0x%04X_%04X\n", ad>>16, ad&0xFFFF, v>>16, v&0xFFFF);
     }
+
+    free(shellBuf);
   }
 
+  free(ops);
   return 0;
 }
 
@@ -563,6 +798,66 @@ static int _CmdDump(int pargc, int argc, char **argv) {
   return _CmdGetEx(pargc, argc, argv, true);
 }
 
+static int _UsageDecode(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "<address> [value]\n");
+  fprintf(stderr,
+    "  Shows the name and fields of the register at <address>, as documented\n"
+    "  in regs.yaml. <address> is as for get, including the g/, r/ and a/\n"
+    "  prefixes. If <value> is specified, its fields are decoded; otherwise\n"
+    "  the register's fields and their documented values are listed.\n"
+    "  An address which isn't a register is described by the region of the\n"
+    "  memory map which contains it. The device is not accessed.\n"
+    );
+  return -2;
+}
+
+static int _CmdDecode(int pargc, int argc, char **argv) {
+  if (argc < 2 || argc > 3)
+    return _UsageDecode(pargc, argc, argv);
+
+  uint32_t ad, value = 0;
+  if (_ResolveAddress(argv[1], &ad, NULL, NULL, NULL) < 0)
+    return _UsageDecode(pargc, argc, argv);
+
+  if (argc > 2) {
+    char *tail = NULL;
+    value = strtoul(argv[2], &tail, 0);
+    if (!tail || tail == argv[2] || *tail)
+      return _UsageDecode(pargc, argc, argv);
+  }
+
+  const reg_def *r = RegLookup(ad);
+  if (!r) {
+    const reg_region *rr = RegRegionLookup(ad);
+    if (!rr) {
+      fprintf(stderr, "error: no register or memory region is documented at 0x%04X_%04X\n", ad>>16, ad&0xFFFF);
+      return 1;
+    }
+
+    printf("[0x%04X_%04X]  %s (0x%04X_%04X-0x%04X_%04X)\n", ad>>16, ad&0xFFFF, RegString(rr->name),
+      rr->start>>16, rr->start&0xFFFF, rr->end>>16, rr->end&0xFFFF);
+    return 0;
+  }
+
+  char buf[8192];
+  log_buf b = {buf, 0, sizeof(buf)};
+  if (argc > 2)
+    LogBufPrintf(&b, "[0x%04X_%04X] = 0x%04X_%04X", ad>>16, ad&0xFFFF, value>>16, value&0xFFFF);
+  else
+    LogBufPrintf(&b, "[0x%04X_%04X]", ad>>16, ad&0xFFFF);
+  LogBufPrintf(&b, "  %s  %s\n", RegString(r->sym), RegString(r->name));
+
+  if (argc > 2)
+    RegDecode(&b, r, value, true);
+  else
+    RegDescribe(&b, r);
+
+  fwrite(buf, 1, LogBufLineLen(&b), stdout);
+  return 0;
+}
+
 static int _UsageSet(int pargc, int argc, char **argv) {
   fprintf(stderr, "usage: ");
   PrintCommand(pargc, argc, argv);
@@ -586,6 +881,25 @@ static int _UsageSet(int pargc, int argc, char **argv) {
   return -2;
 }
 
+// Runs queued shell stores through the command ring.
+static int _FlushSetOps(ape_shell_op *ops, size_t *numOps) {
+  if (!*numOps)
+    return 0;
+
+  int ec = RunAPEShellOps(ops, *numOps);
+  if (ec < 0) {
+    fprintf(stderr, "error: command ring failed\n");
+    return -1;
+  }
+
+  for (size_t i=0; i<*numOps; ++i)
+    if (ops[i].status)
+      fprintf(stderr, "warning: store to 0x%08X faulted\n", ops[i].arg0);
+
+  *numOps = 0;
+  return 0;
+}
+
 static int _CmdSet(int pargc, int argc, char **argv) {
   if (argc < 2)
     return _UsageSet(pargc, argc, argv);
@@ -602,6 +916,9 @@ static int _CmdSet(int pargc, int argc, char **argv) {
   uint32_t ad;
   const char *tail = NULL;
   int accessMode;
+  ape_shell_op ops[256];
+  size_t numOps = 0;
+  int useRing = -1;
   for (; *curArgv; ++curArgv) {
     ec = _ResolveAddress(*curArgv, &ad, NULL, &tail, &accessMode);
     if (ec < 0) {
@@ -630,6 +947,22 @@ static int _CmdSet(int pargc, int argc, char **argv) {
     if (!tail || tail == vbuf || *tail)
       return _UsageSet(pargc, argc, argv);
 
+    // Plain shell stores are queued and sent through the command ring
+    // together. Anything else waits for queued stores first, so stores still
+    // happen in order.
+    if (accessMode == ACCESS_MODE_APE_SHELL && opc == OPC_SET) {
+      if (useRing < 0)
+        useRing = APEShellHasRing();
+      if (useRing) {
+        if (numOps == ARRAYLEN(ops) && _FlushSetOps(ops, &numOps) < 0)
+          return 1;
+        ops[numOps++] = (ape_shell_op) {.type = REG_APE__APEDBG_CMD__TYPE__MEM_SET, .arg0 = ad, .arg1 = v};
+        continue;
+      }
+    }
+
+    if (_FlushSetOps(ops, &numOps) < 0)
+      return 1;
 
     uint32_t (*getFunc)(uint32_t addr);
     void (*setFunc)(uint32_t addr, uint32_t value);
@@ -675,6 +1008,9 @@ static int _CmdSet(int pargc, int argc, char **argv) {
     }
   }
 
+  if (_FlushSetOps(ops, &numOps) < 0)
+    return 1;
+
   return 0;
 }
 
@@ -1165,6 +1501,18 @@ static int _UsageBootmem(int pargc, int argc, char **argv) {
   return -2;
 }
 
+// Sets up the log ring, unless it already is (e.g. by bootmem -w), so that
+// firmware which supports it logs without waiting for the host.
+static void _InitLogRing(void) {
+  if (GetGencom32(GEN_DBG_LOG_RING_CTRL) == GEN_DBG_LOG_RING_CTRL__MAGIC)
+    return;
+
+  SetGencom32(GEN_DBG_LOG_HEAD,  0);
+  SetGencom32(GEN_DBG_LOG_TAIL,  0);
+  SetGencom32(GEN_DBG_LOG_DROPS, 0);
+  SetGencom32(GEN_DBG_LOG_RING_CTRL, GEN_DBG_LOG_RING_CTRL__MAGIC);
+}
+
 static int _CmdBootmem(int pargc, int argc, char **argv) {
   if (argc < 2)
     return _UsageBootmem(pargc, argc, argv);
@@ -1243,8 +1591,11 @@ static int _CmdBootmem(int pargc, int argc, char **argv) {
   SetGencom32(0x354, s1ImageSizeInWords);
   SetGencom32(0x358, s1ImageOffset);
   SetGencom32(0x35C, s2ImageSize);
-  SetGencom32(0x364, 0);
-  SetGencom32(0x368, attachLog ? 0xDECAFBAD : 0);
+  SetGencom32(GEN_DBG_LOG_STATUS, 0);
+  SetGencom32(GEN_DBG_LOG_RING_CTRL, 0);
+  if (attachLog)
+    _InitLogRing();
+  SetGencom32(GEN_DBG_LOG_ENABLE, attachLog ? GEN_DBG_LOG_ENABLE__MAGIC : 0);
 
   SetReg(REG_RX_RISC_PROGRAM_COUNTER, s1ImageBase);
   MaskReg(REG_RX_RISC_MODE, REG_RX_RISC_MODE__HALT);
@@ -1314,66 +1665,137 @@ static int _CmdBootAPELoader(int pargc, int argc, char **argv) {
   return 0;
 }
 
+static bool _APEShellRunning(void *arg) {
+  return GetReg(REG_APE__APEDBG_STATE) == REG_APE__APEDBG_STATE__RUNNING;
+}
+
 static int _WaitForAPEShell(void) {
-  uint32_t timeout = 50000;
-  while (GetReg(REG_APE__APEDBG_STATE) != REG_APE__APEDBG_STATE__RUNNING) {
-    if (!timeout--) {
-      _WarnAboutAPEState("timed out waiting for apedbg to be ready");
-      return -1;
-    }
+  if (WaitFor(WAIT_SITE_SHELL_READY, _APEShellRunning, NULL, 2000000000)) {
+    _WarnAboutAPEState("timed out waiting for apedbg to be ready");
+    return -1;
+  }
+
+  return 0;
+}
 
-    usleep(10);
+// Clears any watchpoints set through the running shell. Their handler is
+// shell code, which must not be left installed when the shell or the image
+// around it is replaced. Shells which can't set watchpoints are fine.
+static int _ClearAPEWatches(void) {
+  if (ClearAPEWatchShell(REG_APE__APEDBG_WATCH_ALL) == -1) {
+    fprintf(stderr, "error: couldn't clear APE watchpoints\n");
+    return -1;
   }
 
   return 0;
 }
 
-static ssize_t _ChainAPE_Write(uint8_t ch, void *arg) {
-  static uint8_t buf[4];
+// Writes words to APE memory via the shell, in bulk if the shell supports it.
+static int _SetAPEMemShellWords(uint32_t addr, const uint32_t *words, size_t numWords) {
+  ssize_t n = SetAPEMemBlockShell(addr, words, numWords);
+  if (n == -2) {
+    for (size_t i=0; i<numWords; ++i)
+      SetAPEMemShell(addr + i*4, words[i]);
+    return 0;
+  }
 
-  uint32_t *cursor = (uint32_t*)arg;
-  uint32_t addr = *cursor;
-  buf[addr % 4] = ch;
-  ++addr;
-  if (!(addr % 4))
-    SetAPEMemShell(addr-4, *(uint32_t*)buf);
+  if (n != numWords) {
+    fprintf(stderr, "error: failed to write APE memory at 0x%08X\n", addr + (uint32_t)(n > 0 ? n : 0)*4);
+    return -1;
+  }
 
-  *cursor = addr;
-  return 1;
+  return 0;
 }
 
-static int _ChainAPE(const char *fn) {
-  int ec;
+static uint32_t _CRC32Zeroes(size_t len) {
+  static const uint8_t zeroes[4096];
+  uint32_t crc = 0;
+  for (size_t n; len; len -= n) {
+    n = len < sizeof(zeroes) ? len : sizeof(zeroes);
+    crc = CRC32(zeroes, n, crc);
+  }
+  return crc;
+}
 
-  // Wait for APE shell to come up.
-  ec = _WaitForAPEShell();
-  if (ec < 0)
+static int _ZeroAPEMemShell(uint32_t addr, uint32_t len) {
+  ssize_t n = FillAPEMemShell(addr, 0, len/4);
+  if (n == -2) {
+    // Shell can't fill, so write zeroes instead.
+    uint32_t *zeroes = calloc(len/4, 4);
+    if (!zeroes) {
+      fprintf(stderr, "error: out of memory\n");
+      return -1;
+    }
+
+    int ec = _SetAPEMemShellWords(addr, zeroes, len/4);
+    free(zeroes);
     return ec;
+  }
+
+  if (n != len/4) {
+    fprintf(stderr, "error: failed to zero APE memory at 0x%08X\n", addr + (uint32_t)(n > 0 ? n : 0)*4);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Has the shell jump to the entrypoint of a loaded image.
+static int _CallAPE(uint32_t entrypoint) {
+  if (_WaitAPEShellCmd())
+    return -1;
+
+  SetReg(REG_APE__APEDBG_ARG0, entrypoint);
+  SetReg(REG_APE__APEDBG_CMD,
+    REG_APE__APEDBG_CMD__MAGIC
+   |REG_APE__APEDBG_CMD__TYPE__CALL_0);
 
-  // Open image file.
+  return 0;
+}
+
+static void *_MapAPEImage(const char *fn, struct stat *st) {
   int fd = open(fn, O_RDONLY|O_SYNC);
   if (fd < 0) {
     fprintf(stderr, "error: couldn't open file: %s\n", fn);
-    return -1;
+    return NULL;
   }
 
-  struct stat st;
-  if (fstat(fd, &st) < 0) {
+  if (fstat(fd, st) < 0) {
     fprintf(stderr, "error: couldn't stat file\n");
-    return -1;
+    return NULL;
   }
 
-  if (st.st_size < sizeof(ape_header)) {
+  if (st->st_size < sizeof(ape_header)) {
     fprintf(stderr, "error: undersized image\n");
-    return -1;
+    return NULL;
   }
 
-  void *virt = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (!virt) {
-    fprintf(stderr, "error: couldn't mmap file\n!");
-    return -1;
+  void *virt = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (virt == MAP_FAILED) {
+    fprintf(stderr, "error: couldn't mmap file\n");
+    return NULL;
   }
 
+  return virt;
+}
+
+static int _ChainAPE(const char *fn) {
+  int ec;
+
+  // Wait for APE shell to come up.
+  ec = _WaitForAPEShell();
+  if (ec < 0)
+    return ec;
+
+  ec = _ClearAPEWatches();
+  if (ec < 0)
+    return ec;
+
+  struct stat st;
+  void *virt = _MapAPEImage(fn, &st);
+  if (!virt)
+    return -1;
+
   ape_header *hdr     = virt;
   uint32_t entrypoint = le32toh(hdr->entrypoint)|1;
   for (size_t i=0; i<hdr->numSections; ++i) {
@@ -1390,33 +1812,75 @@ static int _ChainAPE(const char *fn) {
       return -1;
     }
 
-    if (isZero)
-      for (size_t j=0; j<uncompressedSize; j += 4)
-        SetAPEMemShell(loadAddr + j, 0);
-    else if (offsetFlags & APE_SECTION_FLAG_COMPRESSED) {
-      size_t bytesRead = 0, bytesWritten = 0;
-      uint32_t cursor = loadAddr;
-      Decompress((uint8_t*)virt + offset, compressedSize, uncompressedSize, _ChainAPE_Write, &cursor, &bytesRead, &bytesWritten);
+    uint32_t loadLen = (uncompressedSize + 3) & ~3U;
+    uint32_t crcEx;
+    if (isZero) {
+      if (_ZeroAPEMemShell(loadAddr, loadLen) < 0)
+        return -1;
+
+      crcEx = _CRC32Zeroes(loadLen);
+    } else if (offsetFlags & APE_SECTION_FLAG_COMPRESSED) {
+      if (offset > st.st_size || compressedSize > st.st_size - offset) {
+        fprintf(stderr, "error: section exceeds file length\n");
+        return -1;
+      }
 
+      // Decompress locally as well, both to check the stream before sending
+      // it and to know what CRC the APE should report.
+      uint8_t *buf = malloc(uncompressedSize);
+      if (!buf) {
+        fprintf(stderr, "error: out of memory\n");
+        return -1;
+      }
+
+      size_t bytesWritten = DecompressBuf((uint8_t*)virt + offset, compressedSize, buf, uncompressedSize);
       if (bytesWritten != uncompressedSize) {
-        fprintf(stderr, "error: decompression failure, underwrite: %lu %u\n", bytesWritten, uncompressedSize);
+        fprintf(stderr, "error: decompression failure, underwrite: %zu %u\n", bytesWritten, uncompressedSize);
+        free(buf);
+        return -1;
+      }
+
+      uint32_t crc = 0;
+      crcEx = CRC32(buf, uncompressedSize, 0);
+      ssize_t wr = DecompressToAPEMemShell(loadAddr, (uint8_t*)virt + offset, compressedSize, uncompressedSize, &crc);
+      if (wr == -2) {
+        // Shell can't decompress, so send the decompressed data a word at a
+        // time instead.
+        if (_SetAPEMemShellWords(loadAddr, (uint32_t*)buf, uncompressedSize/4) < 0) {
+          free(buf);
+          return -1;
+        }
+      } else if (wr != uncompressedSize || crc != crcEx) {
+        fprintf(stderr, "error: on-device decompression failure: wrote %zd/%u bytes, CRC 0x%08X, expected 0x%08X\n",
+          wr, uncompressedSize, crc, crcEx);
+        free(buf);
         return -1;
       }
+
+      free(buf);
     } else {
-      for (size_t j=0; j<uncompressedSize; j += 4)
-        SetAPEMemShell(loadAddr + j, *(uint32_t*)((uint8_t*)virt + offset + j));
-    }
-  }
+      if (offset > st.st_size || uncompressedSize > st.st_size - offset) {
+        fprintf(stderr, "error: section exceeds file length\n");
+        return -1;
+      }
 
-  if (_WaitAPEShellCmd())
-    return -1;
+      if (_SetAPEMemShellWords(loadAddr, (uint32_t*)((uint8_t*)virt + offset), uncompressedSize/4) < 0)
+        return -1;
 
-  SetReg(REG_APE__APEDBG_ARG0, entrypoint);
-  SetReg(REG_APE__APEDBG_CMD,
-    REG_APE__APEDBG_CMD__MAGIC
-   |REG_APE__APEDBG_CMD__TYPE__CALL_0);
+      crcEx = CRC32((uint8_t*)virt + offset, uncompressedSize, 0);
+    }
 
-  return 0;
+    // Check what is now in APE memory with one CRC computed on the APE,
+    // rather than reading it all back. Older shells can't do this.
+    uint32_t crc;
+    ec = CRC32APEMemShell(loadAddr, loadLen, &crc);
+    if (ec == -1 || (!ec && crc != crcEx)) {
+      fprintf(stderr, "error: section %zu failed verification: CRC 0x%08X, expected 0x%08X\n", i, crc, crcEx);
+      return -1;
+    }
+  }
+
+  return _CallAPE(entrypoint);
 }
 
 static int _UsageChainAPE(int pargc, int argc, char **argv) {
@@ -1457,43 +1921,237 @@ static int _CmdBootAPE(int pargc, int argc, char **argv) {
   return 0;
 }
 
-static int _UsageBootAPEShell(int pargc, int argc, char **argv) {
-  fprintf(stderr, "usage: <ape_shell.bin>");
-  PrintCommand(pargc, argc, argv);
-  fprintf(stderr, "\n");
-  return -2;
-}
-
-
-static int _CmdBootAPEShell(int pargc, int argc, char **argv) {
-  if (argc < 2)
-    return _UsageBootAPE(pargc, argc, argv);
+// Granularity at which reloadape compares resident and new section contents.
+#define RELOAD_CHUNK_LEN 1024
 
-  int fd = open(argv[1], O_RDONLY|O_SYNC);
-  if (fd < 0) {
-    fprintf(stderr, "error: couldn't open file\n");
+// Computes the CRC32 of each RELOAD_CHUNK_LEN chunk of len bytes of APE memory
+// at addr, pipelined through the command ring where there is one.
+static int _CRC32APEMemChunks(uint32_t addr, uint32_t len, uint32_t *crcs) {
+  size_t numChunks = (len + RELOAD_CHUNK_LEN-1) / RELOAD_CHUNK_LEN;
+  ape_shell_op *ops = calloc(numChunks, sizeof(ape_shell_op));
+  if (!ops) {
+    fprintf(stderr, "error: out of memory\n");
     return -1;
   }
 
-  struct stat st;
-  if (fstat(fd, &st) < 0) {
-    fprintf(stderr, "error: couldn't stat file\n");
-    return -1;
+  for (size_t i=0; i<numChunks; ++i) {
+    uint32_t off = i*RELOAD_CHUNK_LEN;
+    ops[i].type = REG_APE__APEDBG_CMD__TYPE__CRC32;
+    ops[i].arg0 = addr + off;
+    ops[i].arg1 = (len - off < RELOAD_CHUNK_LEN) ? len - off : RELOAD_CHUNK_LEN;
   }
 
-  if (st.st_size > 0x8000) {
-    fprintf(stderr, "error: oversized shellcode\n");
-    return -1;
-  }
+  int ec = RunAPEShellOps(ops, numChunks);
+  if (ec == -2) {
+    ec = 0;
+    for (size_t i=0; i<numChunks && !ec; ++i)
+      ec = CRC32APEMemShell(ops[i].arg0, ops[i].arg1, &crcs[i]);
+  } else if (!ec) {
+    for (size_t i=0; i<numChunks; ++i) {
+      if (ops[i].status) {
+        fprintf(stderr, "error: couldn't read APE memory at 0x%08X\n", ops[i].arg0);
+        ec = -1;
+        break;
+      }
 
-  void *virt = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if (!virt) {
-    fprintf(stderr, "error: couldn't mmap file\n");
-    return -1;
+      crcs[i] = ops[i].arg1;
+    }
   }
 
-  if (GetReg(REG_APE__SEG_SIG) != APE_APE_MAGIC) {
-    fprintf(stderr, "error: APE is not running\n");
+  free(ops);
+  return ec;
+}
+
+// Uploads to APE memory only those chunks of a section which differ from
+// what is already there.
+static int _ReloadAPESection(uint32_t loadAddr, const uint8_t *data, uint32_t len, size_t *changedBytes) {
+  size_t numChunks = (len + RELOAD_CHUNK_LEN-1) / RELOAD_CHUNK_LEN;
+  uint32_t *crcs = calloc(numChunks ? numChunks : 1, sizeof(uint32_t));
+  if (!crcs) {
+    fprintf(stderr, "error: out of memory\n");
+    return -1;
+  }
+
+  int ec = _CRC32APEMemChunks(loadAddr, len, crcs);
+  if (ec == -2)
+    fprintf(stderr, "error: running shell cannot compute CRCs, use chainape instead\n");
+  if (ec < 0)
+    goto out;
+
+  for (size_t i=0; i<numChunks; ++i) {
+    uint32_t off = i*RELOAD_CHUNK_LEN;
+    uint32_t n   = (len - off < RELOAD_CHUNK_LEN) ? len - off : RELOAD_CHUNK_LEN;
+    if (CRC32(data + off, n, 0) == crcs[i])
+      continue;
+
+    ec = _SetAPEMemShellWords(loadAddr + off, (const uint32_t*)(data + off), n/4);
+    if (ec < 0)
+      goto out;
+
+    *changedBytes += n;
+  }
+
+out:
+  free(crcs);
+  return ec;
+}
+
+// Replaces the image resident in APE memory with a new one, uploading only
+// what has changed, then starts it. The shell must be running, e.g. after an
+// APE reset and bootapeshell, and must support CRC32.
+static int _ReloadAPE(const char *fn) {
+  int ec = _WaitForAPEShell();
+  if (ec < 0)
+    return ec;
+
+  ec = _ClearAPEWatches();
+  if (ec < 0)
+    return ec;
+
+  struct stat st;
+  void *virt = _MapAPEImage(fn, &st);
+  if (!virt)
+    return -1;
+
+  ape_header *hdr = virt;
+  size_t totalBytes = 0, changedBytes = 0;
+  for (size_t i=0; i<hdr->numSections; ++i) {
+    uint32_t loadAddr = le32toh(hdr->sections[i].loadAddr);
+    uint32_t offsetFlags = le32toh(hdr->sections[i].offsetFlags);
+    uint32_t offset = offsetFlags & 0xFFFFFF;
+    uint32_t uncompressedSize = le32toh(hdr->sections[i].uncompressedSize);
+    uint32_t compressedSize = le32toh(hdr->sections[i].compressedSize);
+    bool isZero = !!(offsetFlags & APE_SECTION_FLAG_ZERO_ON_FAST_BOOT);
+    uint32_t loadLen = (uncompressedSize + 3) & ~3U;
+
+    if (loadAddr % 4 || (!isZero && !!(uncompressedSize % 4))) {
+      fprintf(stderr, "error: load address must be aligned\n");
+      return -1;
+    }
+
+    if (isZero) {
+      // Always re-zero, since the old image will have dirtied it.
+      if (_ZeroAPEMemShell(loadAddr, loadLen) < 0)
+        return -1;
+      continue;
+    }
+
+    const uint8_t *data;
+    uint8_t *buf = NULL;
+    if (offsetFlags & APE_SECTION_FLAG_COMPRESSED) {
+      if (offset > st.st_size || compressedSize > st.st_size - offset) {
+        fprintf(stderr, "error: section exceeds file length\n");
+        return -1;
+      }
+
+      buf = malloc(uncompressedSize);
+      if (!buf) {
+        fprintf(stderr, "error: out of memory\n");
+        return -1;
+      }
+
+      size_t bytesWritten = DecompressBuf((uint8_t*)virt + offset, compressedSize, buf, uncompressedSize);
+      if (bytesWritten != uncompressedSize) {
+        fprintf(stderr, "error: decompression failure, underwrite: %zu %u\n", bytesWritten, uncompressedSize);
+        free(buf);
+        return -1;
+      }
+
+      data = buf;
+    } else {
+      if (offset > st.st_size || uncompressedSize > st.st_size - offset) {
+        fprintf(stderr, "error: section exceeds file length\n");
+        return -1;
+      }
+
+      data = (uint8_t*)virt + offset;
+    }
+
+    size_t changed = 0;
+    ec = _ReloadAPESection(loadAddr, data, uncompressedSize, &changed);
+    if (!ec) {
+      uint32_t crc, crcEx = CRC32(data, uncompressedSize, 0);
+      ec = CRC32APEMemShell(loadAddr, uncompressedSize, &crc);
+      if (!ec && crc != crcEx) {
+        fprintf(stderr, "error: section %zu failed verification: CRC 0x%08X, expected 0x%08X\n", i, crc, crcEx);
+        ec = -1;
+      }
+    }
+
+    free(buf);
+    if (ec < 0)
+      return -1;
+
+    fprintf(stderr, "section %zu: 0x%08X: uploaded %zu of %u bytes\n", i, loadAddr, changed, uncompressedSize);
+    totalBytes   += uncompressedSize;
+    changedBytes += changed;
+  }
+
+  fprintf(stderr, "uploaded %zu of %zu bytes\n", changedBytes, totalBytes);
+  return _CallAPE(le32toh(hdr->entrypoint)|1);
+}
+
+static int _UsageReloadAPE(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[<ape_shell_load.bin>] <ape_code.bin>\n");
+  return -2;
+}
+
+static int _CmdReloadAPE(int pargc, int argc, char **argv) {
+  int ec;
+
+  if (argc < 2 || argc > 3)
+    return _UsageReloadAPE(pargc, argc, argv);
+
+  // If given a shell loader, reset the APE into it first. APE memory outside
+  // the shell is retained, which is what makes the diff worthwhile.
+  if (argc == 3) {
+    ec = _BootAPELoader(argv[1]);
+    if (ec < 0)
+      return ec;
+  }
+
+  return _ReloadAPE(argv[argc-1]);
+}
+
+static int _UsageBootAPEShell(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: <ape_shell.bin>");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "\n");
+  return -2;
+}
+
+
+static int _CmdBootAPEShell(int pargc, int argc, char **argv) {
+  if (argc < 2)
+    return _UsageBootAPE(pargc, argc, argv);
+
+  int fd = open(argv[1], O_RDONLY|O_SYNC);
+  if (fd < 0) {
+    fprintf(stderr, "error: couldn't open file\n");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "error: couldn't stat file\n");
+    return -1;
+  }
+
+  if (st.st_size > 0x8000) {
+    fprintf(stderr, "error: oversized shellcode\n");
+    return -1;
+  }
+
+  void *virt = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (!virt) {
+    fprintf(stderr, "error: couldn't mmap file\n");
+    return -1;
+  }
+
+  if (GetReg(REG_APE__SEG_SIG) != APE_APE_MAGIC) {
+    fprintf(stderr, "error: APE is not running\n");
     return -1;
   }
 
@@ -1502,11 +2160,29 @@ static int _CmdBootAPEShell(int pargc, int argc, char **argv) {
     return -1;
   }
 
+  uint32_t scratchpadBase  = 0x00100000;
+  uint32_t *words = virt;
+  size_t numWords = (st.st_size+3)/4;
+
+  // The shellcode is about to be overwritten, so a shell's watchpoints must
+  // go first. That can't be done once it has exited, but rewriting it with
+  // the same code is harmless.
+  uint32_t state = GetReg(REG_APE__APEDBG_STATE);
+  if (state == REG_APE__APEDBG_STATE__RUNNING) {
+    if (_ClearAPEWatches() < 0)
+      return -1;
+  } else if (state == REG_APE__APEDBG_STATE__EXITED && GetReg(REG_APE__APEDBG_WATCH_ARMED)) {
+    for (size_t i=0; i<numWords; ++i) {
+      if (GetAPEEventScratchpadWord(i*4) != words[i]) {
+        fprintf(stderr, "error: the exited APE shell still has watchpoints set, reset the APE first\n");
+        return -1;
+      }
+    }
+  }
+
   fprintf(stderr, "setting apedbg cmd 1\n");
   SetReg(REG_APE__APEDBG_CMD, REG_APE__APEDBG_CMD__MAGIC|REG_APE__APEDBG_CMD__TYPE__RETURN);
 
-  uint32_t scratchpadBase  = 0x00100000;
-
   struct { uint32_t injectionVector, expectedCode; } knownVectors[] = {
     { 0x1033B2, 0x2000B5F0, }, // push {r4-r7,lr}; movs r0, #0
     { 0x1033E8, 0x41F0E92D, }, // push.w {r4-r8,lr}
@@ -1542,8 +2218,6 @@ static int _CmdBootAPEShell(int pargc, int argc, char **argv) {
   fprintf(stderr, "writing apedbg shellcode\n");
 
   // Write shellcode to some area we don't care about.
-  uint32_t *words = virt;
-  size_t numWords = (st.st_size+3)/4;
   uint32_t imageBase = scratchpadBase;
   for (size_t i=0; i<numWords; ++i)
     SetAPEEventScratchpadWord(imageBase + i*4 - scratchpadBase, words[i]);
@@ -1615,53 +2289,381 @@ static int _CmdBootAPEShell(int pargc, int argc, char **argv) {
   return 0;
 }
 
+// Splits the byte stream from the log ring into text, which is passed
+// through, and log records, which are formatted.
+typedef struct {
+  uint8_t  rec[4 + 4*0xF];
+  uint32_t recLen, recNeed;
+} log_stream;
+
+// The output side of tail. Prefixes lines with the host time at which they
+// arrived, counts what is written for rate statistics, and optionally writes
+// the raw byte stream to a capture file for tailreplay.
+//
+// A capture file is TAIL_CAPTURE_MAGIC followed by chunks, each being the
+// arrival time in ns since the start of the capture (8 bytes), the length
+// (4 bytes), both little endian, and then the bytes as read from the device.
+#define TAIL_CAPTURE_MAGIC "OTGTAIL1"
+
+typedef struct {
+  FILE       *out;
+  FILE       *capture;
+  bool        timestamps;
+  bool        atLineStart;
+  uint64_t    startNs, nowNs;
+  uint64_t    lines, bytes;
+  log_stream  stream;
+
+  // If set, lines are prefixed with this and only written out whole, so that
+  // several logs can share an output.
+  const char *prefix;
+  char        line[1024];
+  size_t      lineLen;
+
+  // If set, whole lines are passed to this instead of being written out.
+  // Requires prefix to be set.
+  void      (*lineHook)(void *arg, const char *line, size_t len, uint64_t nowNs);
+  void       *hookArg;
+} tail_out;
+
+static void _TailFlushLine(tail_out *t) {
+  if (t->lineHook) {
+    t->lineHook(t->hookArg, t->line, t->lineLen, t->nowNs);
+    t->lineLen = 0;
+    return;
+  }
+
+  fputs(t->prefix, t->out);
+  fwrite(t->line, 1, t->lineLen, t->out);
+  t->lineLen = 0;
+}
+
+static void _TailEmit(tail_out *t, const char *s, size_t len) {
+  if (!t->prefix) {
+    fwrite(s, 1, len, t->out);
+    return;
+  }
+
+  for (; len; --len, ++s) {
+    if (t->lineLen == sizeof(t->line))
+      _TailFlushLine(t);
+    t->line[t->lineLen++] = *s;
+  }
+}
+
+static void _TailPutc(tail_out *t, char c) {
+  if (t->atLineStart && t->timestamps) {
+    char buf[32];
+    uint64_t ns = t->nowNs - t->startNs;
+    _TailEmit(t, buf, snprintf(buf, sizeof(buf), "[%5" PRIu64 ".%06" PRIu64 "] ", ns/1000000000, (ns/1000)%1000000));
+  }
+
+  _TailEmit(t, &c, 1);
+  t->atLineStart = (c == '\n');
+  if (t->atLineStart) {
+    ++t->lines;
+    if (t->prefix)
+      _TailFlushLine(t);
+  }
+}
+
+static void _LogStreamByte(tail_out *t, uint8_t b) {
+  log_stream *s = &t->stream;
+  if (!s->recLen) {
+    if (b != GEN_DBG_LOG_RECORD) {
+      _TailPutc(t, b);
+      return;
+    }
+    s->recNeed = 2;
+  }
+
+  s->rec[s->recLen++] = b;
+  if (s->recLen == 2)
+    s->recNeed = 4 + 4*(b & 0xF);
+  if (s->recLen < s->recNeed)
+    return;
+
+  uint32_t args[0xF], nargs = s->rec[1] & 0xF;
+  for (uint32_t i=0; i<nargs; ++i)
+    args[i] = ((uint32_t)s->rec[4+4*i] << 24) | (s->rec[5+4*i] << 16) | (s->rec[6+4*i] << 8) | s->rec[7+4*i];
+
+  char buf[1024];
+  FormatLogRecord(buf, sizeof(buf), s->rec[1] >> 4, (s->rec[2] << 8) | s->rec[3], args, nargs);
+  for (const char *p = buf; *p; ++p)
+    _TailPutc(t, *p);
+  s->recLen = 0;
+}
+
+// Handles len bytes of the log stream which arrived at nowNs.
+static void _TailWrite(tail_out *t, const uint8_t *buf, size_t len, uint64_t nowNs) {
+  if (!len)
+    return;
+
+  if (t->capture) {
+    uint8_t hdr[12];
+    uint64_t ns = nowNs - t->startNs;
+    for (size_t i=0; i<8; ++i)
+      hdr[i] = ns >> (i*8);
+    for (size_t i=0; i<4; ++i)
+      hdr[8+i] = len >> (i*8);
+    fwrite(hdr, sizeof(hdr), 1, t->capture);
+    fwrite(buf, len, 1, t->capture);
+  }
+
+  t->nowNs  = nowNs;
+  t->bytes += len;
+  for (size_t i=0; i<len; ++i)
+    _LogStreamByte(t, buf[i]);
+}
+
+typedef struct {
+  bool        timestamps;
+  double      statsInterval;
+  const char *captureFn;
+} tail_opts;
+
+// Parses the options common to tail and tailreplay, then up to two .logfmt
+// files. Returns the index of the first remaining argument, or -1 on error.
+static int _ParseTailArgs(int argc, char **argv, tail_opts *opts) {
+  int i;
+  for (i=1; i<argc && argv[i][0] == '-'; ++i) {
+    if (!strcmp(argv[i], "-t"))
+      opts->timestamps = true;
+    else if (!strcmp(argv[i], "-s") && i+1 < argc)
+      opts->statsInterval = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "-w") && i+1 < argc)
+      opts->captureFn = argv[++i];
+    else
+      return -1;
+  }
+  return i;
+}
+
+static int _LoadTailLogFmts(int argc, char **argv) {
+  if (argc > 2)
+    return -1;
+  for (int i=0; i<argc; ++i)
+    if (LoadLogFmt(LOG_SOURCE_STAGE1 + i, argv[i]) < 0)
+      return -1;
+  return 0;
+}
+
+static int _OpenTailOut(tail_out *t, const tail_opts *opts, uint64_t startNs) {
+  // Output is flushed whenever the log goes quiet, so there is no need for
+  // it to be line buffered, which would mean a write per line in bursts.
+  static char buf[1<<16];
+  static bool buffered = false;
+  if (!buffered)
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+  buffered = true;
+
+  memset(t, 0, sizeof(*t));
+  t->out         = stdout;
+  t->timestamps  = opts->timestamps;
+  t->atLineStart = true;
+  t->startNs     = startNs;
+
+  if (opts->captureFn) {
+    t->capture = fopen(opts->captureFn, "wb");
+    if (!t->capture) {
+      fprintf(stderr, "error: couldn't open file: %s\n", opts->captureFn);
+      return -1;
+    }
+    fwrite(TAIL_CAPTURE_MAGIC, 8, 1, t->capture);
+  }
+
+  return 0;
+}
+
+static void _CloseTailOut(tail_out *t) {
+  fflush(t->out);
+  if (t->capture)
+    fclose(t->capture);
+}
+
+// Prints line and byte rates since the last call to stderr.
+static void _PrintTailStats(tail_out *t, uint64_t nowNs, uint64_t *lastNs, uint64_t *lastLines, uint64_t *lastBytes) {
+  double secs = (nowNs - *lastNs)/1e9;
+  if (secs <= 0)
+    return;
+
+  fflush(t->out);
+  fprintf(stderr, "[tail: %.0f lines/s, %.0f bytes/s, %" PRIu64 " lines, %" PRIu64 " bytes total]\n",
+    (t->lines - *lastLines)/secs, (t->bytes - *lastBytes)/secs, t->lines, t->bytes);
+  *lastNs    = nowNs;
+  *lastLines = t->lines;
+  *lastBytes = t->bytes;
+}
+
 static bool g_stopTail = false;
 
 static void _SigInt(int signo) {
   g_stopTail = true;
 }
 
+static bool _TailReady(void *arg) {
+  return g_stopTail || GetGencom32(GEN_DBG_LOG_STATUS)
+      || GetGencom32(GEN_DBG_LOG_HEAD) != *(const uint32_t*)arg;
+}
+
+// Writes out whatever is in the log ring and consumes it.
+static void _DrainLogRing(uint32_t *tail, uint32_t *drops, tail_out *t) {
+  uint32_t head = GetGencom32(GEN_DBG_LOG_HEAD);
+  uint64_t now  = _ClockNs(CLOCK_MONOTONIC);
+  if (head - *tail > GEN_DBG_LOG_RING_SIZE) {
+    fprintf(stderr, "[tail: log ring indices are inconsistent, resynchronizing]\n");
+    *tail = head;
+    t->stream.recLen = 0;
+  }
+
+  uint8_t buf[GEN_DBG_LOG_RING_SIZE];
+  size_t len = 0;
+  uint32_t x = 0;
+  for (uint32_t i = *tail; i != head; ++i) {
+    if (i == *tail || !(i & 3))
+      x = GetGencom32(GEN_DBG_LOG_RING + (i & (GEN_DBG_LOG_RING_SIZE-4)));
+    buf[len++] = (x >> ((3 - (i & 3))*8)) & 0xFF;
+  }
+
+  *tail = head;
+  SetGencom32(GEN_DBG_LOG_TAIL, head);
+  _TailWrite(t, buf, len, now);
+
+  uint32_t d = GetGencom32(GEN_DBG_LOG_DROPS);
+  if (d != *drops) {
+    fflush(t->out);
+    fprintf(stderr, "%s[tail: %u bytes dropped]\n", t->prefix ? t->prefix : "", d - *drops);
+    *drops = d;
+  }
+}
+
+// Drains the log ring, and takes any message handed over by firmware which
+// predates it, which does so 4 bytes at a time.
+static void _ServiceTail(uint32_t *tail, uint32_t *drops, tail_out *t) {
+  _DrainLogRing(tail, drops, t);
+  if (!GetGencom32(GEN_DBG_LOG_STATUS))
+    return;
+
+  uint32_t logData = SwapEndian32(GetGencom32(GEN_DBG_LOG_DATA));
+  uint8_t buf[4];
+  size_t len = 0;
+  for (size_t i=0; i<4; ++i)
+    if ((logData >> (i*8)) & 0xFF)
+      buf[len++] = (logData >> (i*8)) & 0xFF;
+
+  SetGencom32(GEN_DBG_LOG_STATUS, 0);
+  _TailWrite(t, buf, len, _ClockNs(CLOCK_MONOTONIC));
+}
+
+static int _UsageTail(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-t] [-s <seconds>] [-w <capture>] [<otg_stage1.logfmt> [<otg_stage2.logfmt>]]\n");
+  fprintf(stderr, "  -t            prefix lines with host time since start\n");
+  fprintf(stderr, "  -s <seconds>  print line and byte rates to stderr at this interval\n");
+  fprintf(stderr, "  -w <capture>  also write the raw log stream to a file, for tailreplay\n");
+  return -2;
+}
+
 static int _CmdTail(int pargc, int argc, char **argv) {
-  SetGencom32(0x368, 0xDECAFBAD);
+  // tail [-t] [-s <seconds>] [-w <capture>] [<otg_stage1.logfmt> [<otg_stage2.logfmt>]]
+  tail_opts opts = {};
+  int i = _ParseTailArgs(argc, argv, &opts);
+  if (i < 0 || _LoadTailLogFmts(argc-i, argv+i) < 0)
+    return _UsageTail(pargc, argc, argv);
+
+  uint64_t now = _ClockNs(CLOCK_MONOTONIC), statsNs = opts.statsInterval*1e9;
+  uint64_t lastNs = now, lastLines = 0, lastBytes = 0;
+  tail_out out;
+  if (_OpenTailOut(&out, &opts, now) < 0)
+    return 1;
+
+  _InitLogRing();
+  SetGencom32(GEN_DBG_LOG_ENABLE, GEN_DBG_LOG_ENABLE__MAGIC);
   signal(SIGHUP, _SigInt);
   signal(SIGINT, _SigInt);
   signal(SIGQUIT, _SigInt);
 
+  uint32_t tail = GetGencom32(GEN_DBG_LOG_TAIL), drops = 0;
   for (;;) {
-    uint32_t logData, logStatus, logByte;
-
-    for (;;) {
-      if (g_stopTail)
-        goto stop;
+    // Only flush once the log goes quiet, rather than after every drain.
+    if (!_TailReady(&tail))
+      fflush(out.out);
 
-      logStatus = GetGencom32(0x364);
-      if (logStatus)
-        break;
-      sched_yield();
-    }
+    now = _ClockNs(CLOCK_MONOTONIC);
+    if (statsNs && now - lastNs >= statsNs)
+      _PrintTailStats(&out, now, &lastNs, &lastLines, &lastBytes);
 
-    logData = SwapEndian32(GetGencom32(0x360));
-    logByte = logData & 0xFF;
-    if (logByte)
-      fputc(logByte, stdout);
-    logByte = (logData >> 8) & 0xFF;
-    if (logByte)
-      fputc(logByte, stdout);
-    logByte = (logData >> 16) & 0xFF;
-    if (logByte)
-      fputc(logByte, stdout);
-    logByte = (logData >> 24) & 0xFF;
-    if (logByte)
-      fputc(logByte, stdout);
+    if (WaitFor(WAIT_SITE_TAIL, _TailReady, &tail, statsNs ? lastNs + statsNs - now : WAIT_FOREVER))
+      continue;
+    if (g_stopTail)
+      goto stop;
 
-    SetGencom32(0x364, 0);
+    _ServiceTail(&tail, &drops, &out);
   }
 
 stop:
-  SetGencom32(0x368, 0);
+  SetGencom32(GEN_DBG_LOG_ENABLE, 0);
+  SetGencom32(GEN_DBG_LOG_RING_CTRL, 0);
+  _CloseTailOut(&out);
   return 1;
 }
 
+static int _UsageTailReplay(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-t] <capture> [<otg_stage1.logfmt> [<otg_stage2.logfmt>]]\n");
+  return -2;
+}
+
+static int _CmdTailReplay(int pargc, int argc, char **argv) {
+  // tailreplay [-t] <capture> [<otg_stage1.logfmt> [<otg_stage2.logfmt>]]
+  tail_opts opts = {};
+  int i = _ParseTailArgs(argc, argv, &opts);
+  if (i < 0 || i >= argc || opts.captureFn || opts.statsInterval
+      || _LoadTailLogFmts(argc-i-1, argv+i+1) < 0)
+    return _UsageTailReplay(pargc, argc, argv);
+
+  FILE *f = fopen(argv[i], "rb");
+  if (!f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", argv[i]);
+    return 1;
+  }
+
+  char magic[8];
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, TAIL_CAPTURE_MAGIC, 8)) {
+    fprintf(stderr, "error: not a tail capture: %s\n", argv[i]);
+    fclose(f);
+    return 1;
+  }
+
+  tail_out out;
+  _OpenTailOut(&out, &opts, 0);
+
+  int ec = 0;
+  uint8_t hdr[12], buf[0x10000];
+  while (fread(hdr, sizeof(hdr), 1, f) == 1) {
+    uint64_t ns = 0;
+    uint32_t len = 0;
+    for (size_t j=0; j<8; ++j)
+      ns |= (uint64_t)hdr[j] << (j*8);
+    for (size_t j=0; j<4; ++j)
+      len |= (uint32_t)hdr[8+j] << (j*8);
+
+    if (len > sizeof(buf) || fread(buf, len, 1, f) != 1) {
+      fprintf(stderr, "error: truncated capture\n");
+      ec = 1;
+      break;
+    }
+
+    _TailWrite(&out, buf, len, ns);
+  }
+
+  _CloseTailOut(&out);
+  fclose(f);
+  return ec;
+}
+
 #define SPLIT(X) ((X) >> 16), ((X) & 0xFFFF)
 #define HEX32 "0x%04X_%04X"
 
@@ -1797,411 +2799,1599 @@ static int _CmdAPEInfo(int pargc, int argc, char **argv) {
   return 0;
 }
 
-static int _CmdAPELog(int pargc, int argc, char **argv) {
-  uint32_t idx = GetReg(REG_APE__NCSI_DBGLOG_INDEX)+1;
+// Prints a debug log entry, which was in the given slot of the ring; see
+// APELogFormatEntry.
+static void _PrintAPELogEntry(FILE *f, int style, uint32_t slot, const uint64_t *ts64,
+                              const uint32_t (*e)[2], size_t avail) {
+  char buf[2048];
+  log_buf b = {buf, 0, sizeof(buf)};
+  APELogFormatEntry(&b, style, slot, ts64, e, avail);
+  fwrite(buf, 1, LogBufLineLen(&b), f);
+}
 
-  for (size_t i=0; i<APE_DBGLOG_NUM_ENTRIES; ++i) {
-    uint32_t typeArg = GetReg(APE_DBGLOG_BASE + 8*((idx+1 + i) % APE_DBGLOG_NUM_ENTRIES) + 0);
-    uint32_t ts      = GetReg(APE_DBGLOG_BASE + 8*((idx+1 + i) % APE_DBGLOG_NUM_ENTRIES) + 4);
-
-    uint8_t type     = typeArg & 0xFF;
-    uint32_t arg     = typeArg >> 8;
-    char buf[4] = "   ";
-    if (type >= 0x20 && type <= 0x7E) {
-      buf[0] = buf[2] = '\'';
-      buf[1] = type;
-    }
-
-    printf("%2zu)  [%9u r%01X] type=0x%02X (%s)  arg=0x  %02X_%04X",
-      (idx+1 + i) % APE_DBGLOG_NUM_ENTRIES,
-      ts & 0x0FFFFFFF, ts>>28,
-      typeArg & 0xFF, buf,
-      (typeArg>>24)&0xFF, (typeArg>>8) & 0xFFFF);
-
-    switch (type) {
-      case 0x14:
-        printf("  INT 0x14 General Status Change:");
-        if (arg & 0x000001) printf(" PCIereset");
-        if (arg & 0x000002) printf(" P0_GRCrst");
-        if (arg & 0x000004) printf(" P0_DsChg");
-        if (arg & 0x000080) printf(" P1_GRCrst");
-        if (arg & 0x000100) printf(" P1_DsChg");
-        if (arg & 0x002000) printf(" P2_GRCrst");
-        if (arg & 0x004000) printf(" P2_DsChg");
-        if (arg & 0x100000) printf(" P3_GRCrst");
-        if (arg & 0x080000) printf(" P3_DsChg");
-        break;
+// Raw captures of the debug log, for apelogdecode, are this magic followed by
+// entries, oldest first, each as its two words in little endian.
+#define APE_LOG_CAPTURE_MAGIC "OTGAPEL1"
 
-      case 0x18:
-        // Note: The bit tested here is actually from bit 19 of
-        // REG_MISCELLANEOUS_CONFIGURATION. Which is listed as "PME_EN_State".
-        // Does this bit mean Vmain?
-        printf("  INT 0x18: enter %s", (arg & 0x080000) ? "Vmain" : "Vaux");
-        break;
+static void _WriteAPELogCapture(FILE *f, const uint32_t (*e)[2], size_t n) {
+  for (size_t i=0; i<n; ++i) {
+    uint8_t b[8];
+    for (size_t j=0; j<8; ++j)
+      b[j] = e[i][j/4] >> (8*(j%4));
+    fwrite(b, 1, sizeof(b), f);
+  }
+}
 
-      // LINK STATUS CHANGE
-      // ------------------
-      case 0x19: // Port 0, Interrupt 0x19 -- Link Status Change (Even Ports)
-      case 0x1A: // Port 1, Interrupt 0x1A -- Link Status Change (Odd Ports)
-      case 0x41: // Port 2, Interrupt 0x19 -- Link Status Change (Even Ports)
-      case 0x42: // Port 3, Interrupt 0x1A -- Link Status Change (Odd Ports)
-      {
-        static const char *const _str[] = {"1000mb", "100mb", "10mb", "nolnk"};
-        uint8_t intNo, portNo;
-        switch (type) {
-          case 0x19:
-            portNo = 0;
-            intNo = 0x19;
-            break;
-          case 0x1A:
-            portNo = 1;
-            intNo = 0x1A;
-            break;
-          case 0x41:
-            portNo = 2;
-            intNo = 0x19;
-            break;
-          case 0x42:
-            portNo = 3;
-            intNo = 0x1A;
-            break;
-        }
+// State for following the debug log as it is written; see _FollowAPELog.
+typedef struct {
+  uint32_t lastIdx;       // Slot of the last entry read.
+  uint32_t lastEntry[2];  // Its contents, to tell if the ring has lapped us.
+  uint32_t lastTs;        // The last timestamp seen, and the bits above its 28.
+  uint64_t tsHigh;
+  uint64_t lost;          // Entries known to have been overwritten unread.
+  int      style;         // APE_LOG_TEXT or APE_LOG_JSON.
+  FILE    *capture;       // If non-NULL, entries read are also captured here.
+
+  // If set, entries are passed to this instead of being written out; see
+  // APELogDescribe for e and avail.
+  void   (*entryHook)(void *arg, const uint32_t (*e)[2], size_t avail, uint64_t ts64, uint64_t nowNs);
+  void    *hookArg;
+} ape_log_follower;
+
+static void _InitAPELogFollower(ape_log_follower *fl) {
+  memset(fl, 0, sizeof(*fl));
+  fl->lastIdx      = GetReg(REG_APE__NCSI_DBGLOG_INDEX) % APE_DBGLOG_NUM_ENTRIES;
+  fl->lastEntry[0] = GetReg(APE_DBGLOG_BASE + 8*fl->lastIdx + 0);
+  fl->lastEntry[1] = GetReg(APE_DBGLOG_BASE + 8*fl->lastIdx + 4);
+  fl->lastTs       = fl->lastEntry[1] & 0x0FFFFFFF;
+}
 
-        printf("  INT 0x%02X Link Status Change: port%u D%u ps=%u ms=%u lnk=%s %s",
-          intNo, portNo,
-          (arg >>  8) & 0x3,
-          (arg >>  4) & 0x7,
-          (arg      ) & 0xF,
-          _str[(arg >> 19) & 0x3],
-          (arg & 0x02000) ? "Vmain" : "Vaux"
-          );
-      } break;
-
-      // RX PACKET
-      // ---------
-      case 0x0B: // Port 0, Interrupt 0x0B -- RX Packet (Even Ports)
-      case 0x1B: // Port 1, Interrupt 0x1B -- RX Packet (Odd Ports)
-      case 0x33: // Port 2, Interrupt 0x0B -- RX Packet (Even Ports)
-      case 0x43: // Port 3, Interrupt 0x1B -- RX Packet (Odd Ports)
-      {
-        uint8_t intNo, portNo;
-        switch (type) {
-          case 0x0B:
-            portNo = 0;
-            intNo = 0x0B;
-            break;
-          case 0x1B:
-            portNo = 1;
-            intNo = 0x1B;
-            break;
-          case 0x33:
-            portNo = 2;
-            intNo = 0x0B;
-            break;
-          case 0x43:
-            portNo = 3;
-            intNo = 0x1B;
-            break;
+static bool _APELogMoved(const ape_log_follower *fl) {
+  return GetReg(REG_APE__NCSI_DBGLOG_INDEX) % APE_DBGLOG_NUM_ENTRIES != fl->lastIdx;
+}
+
+// Extends a 28-bit entry timestamp to 64 bits, assuming it has wrapped at most
+// once since the last one seen.
+static uint64_t _APELogTs64(ape_log_follower *fl, uint32_t ts) {
+  ts &= 0x0FFFFFFF;
+  if (ts < fl->lastTs)
+    fl->tsHigh += 1U<<28;
+  fl->lastTs = ts;
+  return fl->tsHigh | ts;
+}
+
+// Prints, through t, any debug log entries written since the last call, each
+// prefixed with its timestamp extended to 64 bits. A log record whose
+// arguments haven't all been written yet is left for the next call.
+//
+// The index only says where the ring is modulo its size, so if the slot last
+// read has been overwritten, the ring has lapped us; at least the number of
+// entries which appear new have been lost. Each loss is reported on stderr.
+static void _FollowAPELog(ape_log_follower *fl, tail_out *t) {
+  uint32_t idx = GetReg(REG_APE__NCSI_DBGLOG_INDEX) % APE_DBGLOG_NUM_ENTRIES;
+  uint32_t n   = (idx - fl->lastIdx) % APE_DBGLOG_NUM_ENTRIES;
+
+  // Read all of the ring from the entry after the last one read, as it may
+  // all be new. The repeat count in the top of the timestamp of the last
+  // entry may change without a new entry being written.
+  uint32_t entries[APE_DBGLOG_NUM_ENTRIES][2];
+  for (uint32_t i=0; i<APE_DBGLOG_NUM_ENTRIES; ++i) {
+    uint32_t slot = (fl->lastIdx+1 + i) % APE_DBGLOG_NUM_ENTRIES;
+    entries[i][0] = GetReg(APE_DBGLOG_BASE + 8*slot + 0);
+    entries[i][1] = GetReg(APE_DBGLOG_BASE + 8*slot + 4);
+  }
+
+  uint32_t *last = entries[APE_DBGLOG_NUM_ENTRIES-1];
+  if (last[0] != fl->lastEntry[0] || (last[1] & 0x0FFFFFFF) != (fl->lastEntry[1] & 0x0FFFFFFF)) {
+    fflush(t->out);
+    fprintf(stderr, "%s[apelog: ring overrun, at least %u entries lost]\n",
+      t->prefix ? t->prefix : "", n);
+    fl->lost += n;
+
+    // Everything in the ring is new, with the oldest entry after idx.
+    uint32_t lapped[APE_DBGLOG_NUM_ENTRIES][2];
+    for (uint32_t i=0; i<APE_DBGLOG_NUM_ENTRIES; ++i) {
+      lapped[i][0] = entries[(n + i) % APE_DBGLOG_NUM_ENTRIES][0];
+      lapped[i][1] = entries[(n + i) % APE_DBGLOG_NUM_ENTRIES][1];
+    }
+    memcpy(entries, lapped, sizeof(entries));
+    fl->lastIdx = idx;
+    n = APE_DBGLOG_NUM_ENTRIES;
+  } else if (last[1] != fl->lastEntry[1]) {
+    char buf[64];
+    if (!fl->entryHook)
+      _TailWrite(t, (const uint8_t*)buf,
+        snprintf(buf, sizeof(buf),
+          (fl->style == APE_LOG_JSON) ? "{\"slot\":%u,\"repeat\":%u,\"repeated\":true}\n"
+                                      : "%2u)  repeated (r%01X)\n",
+          fl->lastIdx, last[1]>>28),
+        _ClockNs(CLOCK_MONOTONIC));
+    fl->lastEntry[1] = last[1];
+  }
+
+  uint64_t now = _ClockNs(CLOCK_MONOTONIC);
+  for (uint32_t i=0; i<n; ++i) {
+    if ((entries[i][0] & 0xFF) == APE_DBGLOG_TYPE__FMT && ((entries[i][0] >> 28) & 0xF) > n-1-i)
+      break;
+
+    // A log record's arguments are carried in place of timestamps.
+    uint64_t ts64 = ((entries[i][0] & 0xFF) == APE_DBGLOG_TYPE__FMT_ARG)
+      ? fl->tsHigh | fl->lastTs : _APELogTs64(fl, entries[i][1]);
+
+    if (fl->entryHook)
+      fl->entryHook(fl->hookArg, &entries[i], n-i, ts64, now);
+    else {
+      char buf[2048];
+      log_buf b = {buf, 0, sizeof(buf)};
+      APELogFormatEntry(&b, fl->style, (fl->lastIdx+1) % APE_DBGLOG_NUM_ENTRIES, &ts64, &entries[i], n-i);
+      _TailWrite(t, (const uint8_t*)buf, LogBufLineLen(&b), now);
+    }
+    if (fl->capture)
+      _WriteAPELogCapture(fl->capture, &entries[i], 1);
+    fl->lastIdx = (fl->lastIdx+1) % APE_DBGLOG_NUM_ENTRIES;
+    fl->lastEntry[0] = entries[i][0];
+    fl->lastEntry[1] = entries[i][1];
+  }
+}
+
+static bool _APELogReady(void *arg) {
+  return g_stopTail || _APELogMoved(arg);
+}
+
+static int _UsageAPELog(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-f] [-j] [-w <capture>] [<ape_code.logfmt>]\n");
+  fprintf(stderr, "  -f  after showing the ring, show entries as they are written\n");
+  fprintf(stderr, "  -j  output JSON, one object per entry\n");
+  fprintf(stderr, "  -w  also write the raw entries to a file, for apelogdecode\n");
+  return -2;
+}
+
+static int _CmdAPELog(int pargc, int argc, char **argv) {
+  // apelog [-f] [-j] [-w <capture>] [<ape_code.logfmt>]
+  bool follow = false;
+  int style = APE_LOG_TEXT;
+  const char *captureFn = NULL;
+  int i;
+  for (i=1; i<argc && argv[i][0] == '-'; ++i) {
+    if (!strcmp(argv[i], "-f"))
+      follow = true;
+    else if (!strcmp(argv[i], "-j"))
+      style = APE_LOG_JSON;
+    else if (!strcmp(argv[i], "-w") && i+1 < argc)
+      captureFn = argv[++i];
+    else
+      return _UsageAPELog(pargc, argc, argv);
+  }
+  if (argc - i > 1)
+    return _UsageAPELog(pargc, argc, argv);
+  if (argc - i == 1 && LoadLogFmt(LOG_SOURCE_APE, argv[i]) < 0)
+    return 1;
+
+  FILE *capture = NULL;
+  if (captureFn) {
+    capture = fopen(captureFn, "wb");
+    if (!capture) {
+      fprintf(stderr, "error: couldn't open file: %s\n", captureFn);
+      return 1;
+    }
+    fwrite(APE_LOG_CAPTURE_MAGIC, 1, strlen(APE_LOG_CAPTURE_MAGIC), capture);
+  }
+
+  tail_opts opts = {};
+  tail_out out;
+  if (follow)
+    _OpenTailOut(&out, &opts, _ClockNs(CLOCK_MONOTONIC));
+
+  // INDEX is the newest entry, so the oldest is the one after it.
+  uint32_t idx = GetReg(REG_APE__NCSI_DBGLOG_INDEX);
+
+  // Take the whole ring first, since a log record's arguments follow it.
+  uint32_t entries[APE_DBGLOG_NUM_ENTRIES][2];
+  for (size_t i=0; i<APE_DBGLOG_NUM_ENTRIES; ++i) {
+    entries[i][0] = GetReg(APE_DBGLOG_BASE + 8*((idx+1 + i) % APE_DBGLOG_NUM_ENTRIES) + 0);
+    entries[i][1] = GetReg(APE_DBGLOG_BASE + 8*((idx+1 + i) % APE_DBGLOG_NUM_ENTRIES) + 4);
+  }
+
+  for (size_t i=0; i<APE_DBGLOG_NUM_ENTRIES; ++i)
+    _PrintAPELogEntry(stdout, style, (idx+1 + i) % APE_DBGLOG_NUM_ENTRIES, NULL,
+      &entries[i], APE_DBGLOG_NUM_ENTRIES - i);
+
+  if (capture)
+    _WriteAPELogCapture(capture, entries, APE_DBGLOG_NUM_ENTRIES);
+
+  if (follow) {
+    ape_log_follower fl;
+    _InitAPELogFollower(&fl);
+    fl.style   = style;
+    fl.capture = capture;
+    signal(SIGHUP, _SigInt);
+    signal(SIGINT, _SigInt);
+    signal(SIGQUIT, _SigInt);
+
+    // Wake up now and then regardless, to notice repeats of the last entry,
+    // which don't move the index.
+    while (!g_stopTail) {
+      if (!_APELogMoved(&fl))
+        fflush(stdout);
+      WaitFor(WAIT_SITE_APE_LOG, _APELogReady, &fl, 100000000);
+      _FollowAPELog(&fl, &out);
+    }
+
+    _CloseTailOut(&out);
+    if (capture)
+      fclose(capture);
+    if (fl.lost)
+      fprintf(stderr, "[apelog: at least %" PRIu64 " entries lost in total]\n", fl.lost);
+    return 0;
+  }
+
+  if (capture)
+    fclose(capture);
+  return 0;
+}
+
+// Formats n entries, oldest first, writing them to f if it is non-NULL.
+// Timestamps are extended to 64 bits as _FollowAPELog does, and each entry's
+// slot is its position modulo the size of the ring. Returns the number of
+// bytes of output.
+static uint64_t _DecodeAPELogEntries(FILE *f, int style, const uint32_t (*e)[2], size_t n) {
+  static char buf[1<<16];
+  size_t len = 0;
+  uint64_t total = 0;
+
+  ape_log_follower fl = {};
+  fl.lastTs = n ? e[0][1] & 0x0FFFFFFF : 0;
+  for (size_t i=0; i<n; ++i) {
+    if (sizeof(buf) - len < 4096) {
+      if (f)
+        fwrite(buf, 1, len, f);
+      total += len;
+      len = 0;
+    }
+
+    uint64_t ts64 = ((e[i][0] & 0xFF) == APE_DBGLOG_TYPE__FMT_ARG)
+      ? fl.tsHigh | fl.lastTs : _APELogTs64(&fl, e[i][1]);
+    log_buf b = {buf + len, 0, sizeof(buf) - len};
+    APELogFormatEntry(&b, style, i % APE_DBGLOG_NUM_ENTRIES, &ts64, &e[i], n-i);
+    len += LogBufLineLen(&b);
+  }
+
+  if (f)
+    fwrite(buf, 1, len, f);
+  return total + len;
+}
+
+// Generates n entries which exercise every known type, and some which aren't
+// known, for benchmarking. Log records are generated with their arguments.
+static void _SynthesizeAPELog(uint32_t (*e)[2], size_t n) {
+  uint8_t types[256];
+  size_t numTypes = 0;
+  for (size_t i=0; i<256; ++i)
+    if (APELogKind(i) && i != APE_DBGLOG_TYPE__FMT_ARG)
+      types[numTypes++] = i;
+  types[numTypes++] = 0xD8;
+  types[numTypes++] = 0x00;
+
+  uint32_t x = 0x2545F491, ts = 0;
+  for (size_t i=0; i<n; ) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    // Advance by up to about a millisecond, so the 28-bit timestamp wraps now
+    // and then.
+    ts = (ts + (x & 0xFFFFF)) & 0x0FFFFFFF;
+    uint8_t type = types[(x >> 8) % numTypes];
+    if (type != APE_DBGLOG_TYPE__FMT) {
+      e[i][0] = (x & 0xFFFFFF00) | type;
+      e[i][1] = ts | ((x & 0x3) << 28);
+      ++i;
+      continue;
+    }
+
+    uint32_t nargs = (x >> 24) % 4;
+    if (n - i < 1 + nargs)
+      nargs = n - i - 1;
+    e[i][0] = (nargs << 28) | ((x & 0xFFF0) << 8) | type;
+    e[i][1] = ts;
+    ++i;
+    for (uint32_t j=0; j<nargs; ++j, ++i) {
+      e[i][0] = (j << 8) | APE_DBGLOG_TYPE__FMT_ARG;
+      e[i][1] = x * (j+1);
+    }
+  }
+}
+
+static int _BenchAPELogDecode(size_t n) {
+  uint32_t (*e)[2] = malloc(n * sizeof(*e));
+  if (!e) {
+    fprintf(stderr, "error: couldn't allocate %zu entries\n", n);
+    return 1;
+  }
+  _SynthesizeAPELog(e, n);
+
+  static const char *const styleNames[] = {[APE_LOG_TEXT] = "text", [APE_LOG_JSON] = "json"};
+  for (int style=APE_LOG_TEXT; style<=APE_LOG_JSON; ++style) {
+    uint64_t start = _ClockNs(CLOCK_MONOTONIC);
+    uint64_t bytes = _DecodeAPELogEntries(NULL, style, (const uint32_t (*)[2])e, n);
+    double secs = (_ClockNs(CLOCK_MONOTONIC) - start) / 1e9;
+    printf("%s: %zu entries in %.3f s: %.2f M entries/s, %.1f MB/s of output\n",
+      styleNames[style], n, secs, n / secs / 1e6, bytes / secs / 1e6);
+  }
+
+  free(e);
+  return 0;
+}
+
+static int _UsageAPELogDecode(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-j] <capture> [<ape_code.logfmt>]\n");
+  fprintf(stderr, "       ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "-b [<count>]\n");
+  fprintf(stderr, "  -j  output JSON, one object per entry\n");
+  fprintf(stderr, "  -b  benchmark decoding of <count> synthetic entries\n");
+  return -2;
+}
+
+static int _CmdAPELogDecode(int pargc, int argc, char **argv) {
+  // apelogdecode [-j] <capture> [<ape_code.logfmt>]
+  // apelogdecode -b [<count>]
+  if (argc > 1 && !strcmp(argv[1], "-b")) {
+    if (argc > 3)
+      return _UsageAPELogDecode(pargc, argc, argv);
+    return _BenchAPELogDecode((argc == 3) ? strtoull(argv[2], NULL, 0) : 4000000);
+  }
+
+  int style = APE_LOG_TEXT;
+  if (argc > 1 && !strcmp(argv[1], "-j")) {
+    style = APE_LOG_JSON;
+    --argc;
+    ++argv;
+    ++pargc;
+  }
+  if (argc < 2 || argc > 3)
+    return _UsageAPELogDecode(pargc, argc, argv);
+  if (argc == 3 && LoadLogFmt(LOG_SOURCE_APE, argv[2]) < 0)
+    return 1;
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", argv[1]);
+    return 1;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  size_t magicLen = strlen(APE_LOG_CAPTURE_MAGIC);
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (len < 0 || !data || fread(data, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "error: couldn't read file: %s\n", argv[1]);
+    fclose(f);
+    free(data);
+    return 1;
+  }
+  fclose(f);
+
+  if ((size_t)len < magicLen || memcmp(data, APE_LOG_CAPTURE_MAGIC, magicLen)) {
+    fprintf(stderr, "error: not an APE log capture: %s\n", argv[1]);
+    free(data);
+    return 1;
+  }
+  if ((len - magicLen) % 8)
+    fprintf(stderr, "warning: capture has a truncated entry at the end\n");
+
+  size_t n = (len - magicLen) / 8;
+  uint32_t (*e)[2] = malloc((n ? n : 1) * sizeof(*e));
+  if (!e) {
+    fprintf(stderr, "error: couldn't allocate %zu entries\n", n);
+    free(data);
+    return 1;
+  }
+
+  for (size_t i=0; i<n; ++i)
+    for (size_t j=0; j<2; ++j) {
+      const uint8_t *p = data + magicLen + 8*i + 4*j;
+      e[i][j] = p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+    }
+  free(data);
+
+  _DecodeAPELogEntries(stdout, style, (const uint32_t (*)[2])e, n);
+  free(e);
+  return 0;
+}
+
+// Bootcode and APE log state of a device function for tailall. The APE is
+// shared by the functions of a card, so its log is only followed through one
+// of them.
+typedef struct {
+  open_device_t *dev;
+  uint32_t       tail, drops;
+  tail_out       out;
+  char           prefix[32];
+
+  bool           ape;
+  ape_log_follower apeLog;
+  tail_out       apeOut;
+  char           apePrefix[32];
+} tailall_dev;
+
+typedef struct {
+  open_device_t *open;
+  tailall_dev   *devs;
+  size_t         numDevs;
+  size_t         start;   // Device to service first next time round.
+} tailall_state;
+
+static bool _TailAllReady(void *arg) {
+  const tailall_state *st = arg;
+  for (size_t i=0; i<st->numDevs && !g_stopTail; ++i) {
+    const tailall_dev *d = &st->devs[i];
+    DeviceSelect(d->dev);
+    if (_TailReady((void*)&d->tail))
+      return true;
+    if (d->ape && _APELogMoved(&d->apeLog))
+      return true;
+  }
+  return g_stopTail;
+}
+
+// Opens every supported device and starts following its logs. Output goes
+// to stdout, prefixed by device.
+static int _TailAllOpen(tailall_state *st, const tail_opts *opts) {
+  memset(st, 0, sizeof(*st));
+  int numDevs = DeviceOpenAll(&st->open);
+  if (numDevs < 0)
+    return -1;
+  if (!numDevs) {
+    fprintf(stderr, "error: no supported devices found\n");
+    return -1;
+  }
+
+  st->devs    = calloc(numDevs, sizeof(tailall_dev));
+  st->numDevs = numDevs;
+  if (!st->devs) {
+    fprintf(stderr, "error: out of memory\n");
+    DeviceCloseAll(st->open, numDevs);
+    return -1;
+  }
+
+  open_device_t *devs = st->open;
+  uint64_t now = _ClockNs(CLOCK_MONOTONIC);
+  for (int j=0; j<numDevs; ++j) {
+    tailall_dev *d = &st->devs[j];
+    d->dev = &devs[j];
+    DeviceSelect(d->dev);
+
+    _OpenTailOut(&d->out, opts, now);
+    snprintf(d->prefix, sizeof(d->prefix), "[%s p%u] ", d->dev->name, GetPCIFuncNo(d->dev->info.busAddr));
+    d->out.prefix = d->prefix;
+
+    _InitLogRing();
+    SetGencom32(GEN_DBG_LOG_ENABLE, GEN_DBG_LOG_ENABLE__MAGIC);
+    d->tail = GetGencom32(GEN_DBG_LOG_TAIL);
+
+    // Follow the APE log through the first function of each card, if the APE
+    // firmware has one.
+    d->ape = (!j || (devs[j-1].info.busAddr >> 3) != (d->dev->info.busAddr >> 3))
+          && GetReg(REG_APE__NCSI_DBGLOG_LEN_OFFSET);
+    if (d->ape) {
+      _OpenTailOut(&d->apeOut, opts, now);
+      snprintf(d->apePrefix, sizeof(d->apePrefix), "[%.*s ape] ", (int)strlen(d->dev->name)-2, d->dev->name);
+      d->apeOut.prefix = d->apePrefix;
+      _InitAPELogFollower(&d->apeLog);
+    }
+  }
+
+  return 0;
+}
+
+// Each device is serviced in turn, starting with a different one each time
+// round. A service takes at most a ring's worth from each log, so a busy
+// device can't hold up the others.
+static void _TailAllService(tailall_state *st) {
+  for (size_t k=0; k<st->numDevs && !g_stopTail; ++k) {
+    tailall_dev *d = &st->devs[(st->start + k) % st->numDevs];
+    DeviceSelect(d->dev);
+    _ServiceTail(&d->tail, &d->drops, &d->out);
+    if (d->ape)
+      _FollowAPELog(&d->apeLog, &d->apeOut);
+  }
+  st->start = (st->start + 1) % st->numDevs;
+}
+
+static void _TailAllClose(tailall_state *st) {
+  for (size_t k=0; k<st->numDevs; ++k) {
+    DeviceSelect(st->devs[k].dev);
+    SetGencom32(GEN_DBG_LOG_ENABLE, 0);
+    SetGencom32(GEN_DBG_LOG_RING_CTRL, 0);
+    _CloseTailOut(&st->devs[k].out);
+    if (st->devs[k].ape)
+      _CloseTailOut(&st->devs[k].apeOut);
+  }
+
+  free(st->devs);
+  DeviceCloseAll(st->open, st->numDevs);
+}
+
+static int _UsageTailAll(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-t] [<otg_stage1.logfmt> [<otg_stage2.logfmt> [<ape_code.logfmt>]]]\n");
+  return -2;
+}
+
+static int _CmdTailAll(int pargc, int argc, char **argv) {
+  // tailall [-t] [<otg_stage1.logfmt> [<otg_stage2.logfmt> [<ape_code.logfmt>]]]
+  tail_opts opts = {};
+  int i = _ParseTailArgs(argc, argv, &opts);
+  if (i < 0 || opts.captureFn || opts.statsInterval || argc-i > 3)
+    return _UsageTailAll(pargc, argc, argv);
+  if (_LoadTailLogFmts((argc-i > 2) ? 2 : argc-i, argv+i) < 0
+   || (argc-i > 2 && LoadLogFmt(LOG_SOURCE_APE, argv[i+2]) < 0))
+    return 1;
+
+  tailall_state st;
+  if (_TailAllOpen(&st, &opts) < 0)
+    return 1;
+
+  signal(SIGHUP, _SigInt);
+  signal(SIGINT, _SigInt);
+  signal(SIGQUIT, _SigInt);
+
+  while (!g_stopTail) {
+    if (!_TailAllReady(&st))
+      fflush(stdout);
+    WaitFor(WAIT_SITE_TAIL, _TailAllReady, &st, WAIT_FOREVER);
+    _TailAllService(&st);
+  }
+
+  _TailAllClose(&st);
+  return 1;
+}
+
+// Chrome trace event output, in the JSON array format, which trace viewers
+// accept even without its closing bracket, so a trace cut short is still
+// usable. Times are host monotonic time since the start of the trace.
+typedef struct {
+  FILE     *f;
+  uint64_t  startNs;
+  uint64_t  events;
+} trace_out;
+
+// Tracks of a device function: its bootcode log, and, for the function
+// through which the APE log of a card is followed, the APE log, with NC-SI
+// commands and link changes on tracks of their own. Each card is a process.
+enum {
+  TRACE_TID_APE      = 1,
+  TRACE_TID_NCSI     = 2,
+  TRACE_TID_LINK     = 3,
+  TRACE_TID_BOOTCODE = 16, // Plus the function number.
+};
+
+typedef struct {
+  trace_out *tr;
+  uint32_t   pid, tid;
+  bool       ncsiPending;  // An NC-SI command has arrived and is being
+  uint64_t   ncsiStartNs;  // handled, since this host time and this APE
+  uint64_t   ncsiStartTs;  // log timestamp.
+} trace_dev;
+
+// NC-SI allows 50ms for a response; spans longer than that are marked late.
+// A command is only given up on well after that, so that slow responses still
+// show up as spans.
+#define TRACE_NCSI_RESPONSE_NS 50000000ULL
+#define TRACE_NCSI_TIMEOUT_NS  (20*TRACE_NCSI_RESPONSE_NS)
+
+// Writes an event with the given phase. durNs is used only for complete
+// ('X') events, and args, if non-NULL, is the body of a JSON object.
+static void _TraceEvent(trace_out *tr, char ph, uint32_t pid, uint32_t tid,
+                        uint64_t ns, uint64_t durNs, const char *name, const char *args) {
+  char buf[8192];
+  log_buf b = {buf, 0, sizeof(buf)};
+  uint64_t rel = (ns > tr->startNs) ? ns - tr->startNs : 0;
+
+  LogBufPrintf(&b, "%s{\"ph\":\"%c\",\"pid\":%u,\"tid\":%u,\"ts\":%" PRIu64 ".%03u",
+    tr->events ? ",\n" : "[\n", ph, pid, tid, rel/1000, (unsigned)(rel%1000));
+  if (ph == 'X')
+    LogBufPrintf(&b, ",\"dur\":%" PRIu64 ".%03u", durNs/1000, (unsigned)(durNs%1000));
+  if (ph == 'i')
+    LogBufPuts(&b, ",\"s\":\"t\"");
+  LogBufPuts(&b, ",\"name\":");
+  LogBufJSONString(&b, name);
+  if (args)
+    LogBufPrintf(&b, ",\"args\":{%s}", args);
+  LogBufPuts(&b, "}");
+
+  // A truncated event would make the rest of the trace unreadable.
+  if (b.len >= b.cap) {
+    fprintf(stderr, "warning: dropping oversized trace event\n");
+    return;
+  }
+  fwrite(buf, 1, b.len, tr->f);
+  ++tr->events;
+}
+
+// Names a process (tid 0) or thread.
+static void _TraceName(trace_out *tr, uint32_t pid, uint32_t tid, const char *name) {
+  char args[128];
+  log_buf b = {args, 0, sizeof(args)};
+  LogBufPuts(&b, "\"name\":");
+  LogBufJSONString(&b, name);
+  _TraceEvent(tr, 'M', pid, tid, tr->startNs, 0, tid ? "thread_name" : "process_name", args);
+}
+
+static void _TraceBootcodeLine(void *arg, const char *line, size_t len, uint64_t nowNs) {
+  trace_dev *td = arg;
+  char buf[1025];
+  if (len && line[len-1] == '\n')
+    --len;
+  snprintf(buf, sizeof(buf), "%.*s", (int)len, line);
+  _TraceEvent(td->tr, 'i', td->pid, td->tid, nowNs, 0, buf, NULL);
+}
+
+// Ends a pending NC-SI command which will not be paired with a completion,
+// showing it as an instant.
+static void _TraceNCSIUnanswered(trace_dev *td, const char *why) {
+  char args[64];
+  snprintf(args, sizeof(args), "\"apeTs\":%" PRIu64, td->ncsiStartTs);
+  _TraceEvent(td->tr, 'i', td->pid, TRACE_TID_NCSI, td->ncsiStartNs, 0, why, args);
+  td->ncsiPending = false;
+}
+
+// An NC-SI command arriving from the BMC shows up as an RMU egress entry
+// (type 0x11) which isn't passthrough, and the completion of its handling as
+// an NC-SI entry, or an ncsi-fail entry if it failed, so the two are paired
+// into a span. An NC-SI entry without a command pending is shown as an
+// instant. Spans are timed by when the host saw each entry, which is as fine
+// as the polling. The APE timestamps are far coarser (see APE_DBGLOG_TS_NS),
+// but aren't delayed by the polling, so they bound the length: a host stall
+// between seeing the two entries can't stretch a span past what the APE saw.
+static uint64_t _TraceNCSISpanNs(const trace_dev *td, uint64_t ts64, uint64_t nowNs) {
+  uint64_t ns = nowNs - td->ncsiStartNs;
+  uint64_t apeTicks = ts64 - td->ncsiStartTs;
+  uint64_t loNs = apeTicks ? (apeTicks-1)*APE_DBGLOG_TS_NS : 0;
+  uint64_t hiNs = (apeTicks+1)*APE_DBGLOG_TS_NS;
+  return ns < loNs ? loNs : ns > hiNs ? hiNs : ns;
+}
+
+static void _TraceAPEEntry(void *arg, const uint32_t (*e)[2], size_t avail, uint64_t ts64, uint64_t nowNs) {
+  trace_dev *td = arg;
+  uint8_t type = e[0][0] & 0xFF;
+  if (type == APE_DBGLOG_TYPE__FMT_ARG)
+    return;
+
+  if (td->ncsiPending && nowNs - td->ncsiStartNs > TRACE_NCSI_TIMEOUT_NS)
+    _TraceNCSIUnanswered(td, "NC-SI command timed out");
+
+  char desc[1100];
+  log_buf b = {desc, 0, sizeof(desc)};
+  desc[0] = '\0';
+  APELogDescribe(&b, e, avail);
+  if (!desc[0])
+    snprintf(desc, sizeof(desc), "type 0x%02X arg 0x%06X", type, e[0][0] >> 8);
+
+  char args[128];
+  snprintf(args, sizeof(args), "\"type\":%u,\"arg\":%u,\"apeTs\":%" PRIu64, type, e[0][0] >> 8, ts64);
+
+  const char *kind = APELogKind(type);
+  if (type == 0x11 && !(e[0][0] & 0x0200)) {
+    if (td->ncsiPending)
+      _TraceNCSIUnanswered(td, "NC-SI command not completed");
+    td->ncsiPending = true;
+    td->ncsiStartNs = nowNs;
+    td->ncsiStartTs = ts64;
+  }
+
+  if (kind && (!strcmp(kind, "ncsi") || !strcmp(kind, "ncsi-fail"))) {
+    if (td->ncsiPending) {
+      uint64_t durNs = _TraceNCSISpanNs(td, ts64, nowNs);
+      if (durNs > TRACE_NCSI_RESPONSE_NS)
+        snprintf(args + strlen(args), sizeof(args) - strlen(args), ",\"late\":true");
+      _TraceEvent(td->tr, 'X', td->pid, TRACE_TID_NCSI, td->ncsiStartNs, durNs, desc, args);
+    } else
+      _TraceEvent(td->tr, 'i', td->pid, TRACE_TID_NCSI, nowNs, 0, desc, args);
+    td->ncsiPending = false;
+  } else if (kind && !strcmp(kind, "link"))
+    _TraceEvent(td->tr, 'i', td->pid, TRACE_TID_LINK, nowNs, 0, desc, args);
+  else
+    _TraceEvent(td->tr, 'i', td->pid, TRACE_TID_APE, nowNs, 0, desc, args);
+}
+
+static int _UsageTrace(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-d <seconds>] <out.json> [<otg_stage1.logfmt> [<otg_stage2.logfmt> [<ape_code.logfmt>]]]\n");
+  fprintf(stderr, "  -d <seconds>  stop after this long, rather than on interrupt\n");
+  return -2;
+}
+
+static int _CmdTrace(int pargc, int argc, char **argv) {
+  // trace [-d <seconds>] <out.json> [<otg_stage1.logfmt> [<otg_stage2.logfmt> [<ape_code.logfmt>]]]
+  double duration = 0;
+  if (argc > 2 && !strcmp(argv[1], "-d")) {
+    duration = strtod(argv[2], NULL);
+    argc  -= 2;
+    argv  += 2;
+    pargc += 2;
+  }
+  if (argc < 2 || argc > 5)
+    return _UsageTrace(pargc, argc, argv);
+  if (_LoadTailLogFmts((argc > 4) ? 2 : argc-2, argv+2) < 0
+   || (argc > 4 && LoadLogFmt(LOG_SOURCE_APE, argv[4]) < 0))
+    return 1;
+
+  trace_out tr = {.f = fopen(argv[1], "w")};
+  if (!tr.f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", argv[1]);
+    return 1;
+  }
+
+  tail_opts opts = {};
+  tailall_state st;
+  if (_TailAllOpen(&st, &opts) < 0) {
+    fclose(tr.f);
+    return 1;
+  }
+
+  trace_dev *tds = calloc(st.numDevs, sizeof(trace_dev));
+  if (!tds) {
+    fprintf(stderr, "error: out of memory\n");
+    _TailAllClose(&st);
+    fclose(tr.f);
+    return 1;
+  }
+
+  tr.startNs = _ClockNs(CLOCK_MONOTONIC);
+  uint32_t pid = 0;
+  for (size_t k=0; k<st.numDevs; ++k) {
+    tailall_dev *d = &st.devs[k];
+    trace_dev *td = &tds[k];
+    char name[64];
+    if (!k || (st.devs[k-1].dev->info.busAddr >> 3) != (d->dev->info.busAddr >> 3)) {
+      ++pid;
+      snprintf(name, sizeof(name), "%.*s", (int)strlen(d->dev->name)-2, d->dev->name);
+      _TraceName(&tr, pid, 0, name);
+    }
+
+    td->tr  = &tr;
+    td->pid = pid;
+    td->tid = TRACE_TID_BOOTCODE + GetPCIFuncNo(d->dev->info.busAddr);
+    snprintf(name, sizeof(name), "p%u bootcode", GetPCIFuncNo(d->dev->info.busAddr));
+    _TraceName(&tr, pid, td->tid, name);
+    d->out.lineHook = _TraceBootcodeLine;
+    d->out.hookArg  = td;
+
+    if (d->ape) {
+      _TraceName(&tr, pid, TRACE_TID_APE,  "APE");
+      _TraceName(&tr, pid, TRACE_TID_NCSI, "NC-SI");
+      _TraceName(&tr, pid, TRACE_TID_LINK, "link");
+      d->apeLog.entryHook = _TraceAPEEntry;
+      d->apeLog.hookArg   = td;
+    }
+  }
+
+  signal(SIGHUP, _SigInt);
+  signal(SIGINT, _SigInt);
+  signal(SIGQUIT, _SigInt);
+
+  uint64_t endNs = duration > 0 ? tr.startNs + (uint64_t)(duration*1e9) : 0;
+  while (!g_stopTail && (!endNs || _ClockNs(CLOCK_MONOTONIC) < endNs)) {
+    WaitFor(WAIT_SITE_TAIL, _TailAllReady, &st, endNs ? 100000000 : WAIT_FOREVER);
+    _TailAllService(&st);
+  }
+
+  _TailAllClose(&st);
+  fprintf(tr.f, "%s]\n", tr.events ? "\n" : "[\n");
+  fclose(tr.f);
+  fprintf(stderr, "%" PRIu64 " events written to %s\n", tr.events, argv[1]);
+  free(tds);
+  return 0;
+}
+
+// Registers sampled from a device function for metrics. They are all read in
+// one pass per scrape, before any are formatted, so that a scrape costs only
+// a few microseconds of MMIO per device.
+typedef struct {
+  uint32_t status, eeeMode;
+  uint32_t inOctetsGood, inOctetsBad;
+  uint32_t rxPoolModeStatus, rxPoolRet;
+
+  // Shared by the card, so only read through its first function.
+  uint32_t apeStatus, apeStatus2, apeCM3, apeLogIdx;
+} metrics_sample;
+
+typedef struct {
+  open_device_t *dev;
+  bool           ape;
+  bool           sampled;
+  metrics_sample cur;
+  uint64_t       scrapeNs;
+
+  // The 32-bit counters extended to 64 bits, and the number of APE log
+  // entries written, from the movement of the index. Entries are undercounted
+  // if more than a ring's worth are written between scrapes.
+  uint64_t       inOctetsGood, inOctetsBad;
+  uint64_t       apeLogEntries;
+} metrics_dev;
+
+static void _SampleMetrics(metrics_dev *d) {
+  uint32_t func = GetPCIFuncNo(d->dev->info.busAddr);
+  uint64_t start = _ClockNs(CLOCK_MONOTONIC);
+  metrics_sample s = {};
+
+  DeviceSelect(d->dev);
+  s.status           = GetReg(REG_STATUS);
+  s.eeeMode          = GetReg(REG_EEE_MODE);
+  s.inOctetsGood     = GetReg(REG_APE_NETWORK_STATS_IFHCINOCTETS_GOOD);
+  s.inOctetsBad      = GetReg(REG_APE_NETWORK_STATS_IFHCINOCTETS_BAD);
+  s.rxPoolModeStatus = GetReg(REG_APE__RX_POOL_MODE_STATUS(func));
+  s.rxPoolRet        = GetReg(REG_APE__RX_POOL_RET(func));
+  if (d->ape) {
+    s.apeStatus      = GetReg(REG_APE__STATUS);
+    s.apeStatus2     = GetReg(REG_APE__STATUS_2);
+    s.apeCM3         = GetReg(REG_APE__CM3);
+    s.apeLogIdx      = GetReg(REG_APE__NCSI_DBGLOG_INDEX);
+  }
+  d->scrapeNs = _ClockNs(CLOCK_MONOTONIC) - start;
+
+  if (d->sampled) {
+    d->inOctetsGood  += (uint32_t)(s.inOctetsGood - d->cur.inOctetsGood);
+    d->inOctetsBad   += (uint32_t)(s.inOctetsBad - d->cur.inOctetsBad);
+    d->apeLogEntries += (s.apeLogIdx - d->cur.apeLogIdx) % APE_DBGLOG_NUM_ENTRIES;
+  } else {
+    d->inOctetsGood  = s.inOctetsGood;
+    d->inOctetsBad   = s.inOctetsBad;
+  }
+  d->cur     = s;
+  d->sampled = true;
+}
+
+static inline uint32_t _Field(uint32_t x, uint32_t mask) {
+  return (x & mask) >> CTZL(mask);
+}
+
+static uint64_t _MetricInOctetsGood(const metrics_dev *d) { return d->inOctetsGood; }
+static uint64_t _MetricInOctetsBad(const metrics_dev *d)  { return d->inOctetsBad; }
+
+static uint64_t _MetricLinkSpeed(const metrics_dev *d) {
+  switch (d->cur.status & REG_STATUS__ETHERNET_LINK_STATUS__MASK) {
+    case REG_STATUS__ETHERNET_LINK_STATUS__1000: return 1000;
+    case REG_STATUS__ETHERNET_LINK_STATUS__100:  return 100;
+    case REG_STATUS__ETHERNET_LINK_STATUS__10:   return 10;
+    default:                                     return 0;
+  }
+}
+
+static uint64_t _MetricVmain(const metrics_dev *d) {
+  return !!(d->cur.status & REG_STATUS__VMAIN_POWER_STATUS);
+}
+static uint64_t _MetricEEETx(const metrics_dev *d) {
+  return !!(d->cur.eeeMode & REG_EEE_MODE__TX_LPI_ENABLE);
+}
+static uint64_t _MetricEEERx(const metrics_dev *d) {
+  return !!(d->cur.eeeMode & REG_EEE_MODE__RX_LPI_ENABLE);
+}
+static uint64_t _MetricRXPoolEnabled(const metrics_dev *d) {
+  return !!(d->cur.rxPoolModeStatus & REG_APE__RX_POOL_MODE_STATUS__ENABLE);
+}
+static uint64_t _MetricRXPoolFull(const metrics_dev *d) {
+  return _Field(d->cur.rxPoolModeStatus, REG_APE__RX_POOL_MODE_STATUS__FULLCNT__MASK);
+}
+static uint64_t _MetricRXQueueCount(const metrics_dev *d) {
+  return _Field(d->cur.rxPoolRet, REG_APE__RX_POOL_RET__COUNT__MASK);
+}
+static uint64_t _MetricRXQueueHead(const metrics_dev *d) {
+  return _Field(d->cur.rxPoolRet, REG_APE__RX_POOL_RET__HEAD__MASK);
+}
+static uint64_t _MetricRXQueueTail(const metrics_dev *d) {
+  return _Field(d->cur.rxPoolRet, REG_APE__RX_POOL_RET__TAIL__MASK);
+}
+static uint64_t _MetricAPEStatus(const metrics_dev *d)  { return d->cur.apeStatus; }
+static uint64_t _MetricAPEStatus2(const metrics_dev *d) { return d->cur.apeStatus2; }
+static uint64_t _MetricAPECM3(const metrics_dev *d)     { return d->cur.apeCM3; }
+static uint64_t _MetricAPECPUStatus(const metrics_dev *d) {
+  return _Field(d->cur.apeCM3, REG_APE__CM3__CPU_STATUS__MASK);
+}
+static uint64_t _MetricAPELogIndex(const metrics_dev *d)   { return d->cur.apeLogIdx % APE_DBGLOG_NUM_ENTRIES; }
+static uint64_t _MetricAPELogEntries(const metrics_dev *d) { return d->apeLogEntries; }
+static uint64_t _MetricScrapeNs(const metrics_dev *d)      { return d->scrapeNs; }
+
+typedef struct {
+  const char *name, *type, *help;
+  bool        ape;   // Only for the function through which the APE is read.
+  uint64_t  (*value)(const metrics_dev *d);
+  uint64_t    scale; // If nonzero, value is in units of 1/scale, and is shown
+                     // as a decimal, e.g. 1000000000 for seconds from ns.
+} metric_def;
+
+static const metric_def _metrics[] = {
+  {"otg_in_octets_good_total", "counter", "Octets received in good frames (IfHCInOctets)", false, _MetricInOctetsGood},
+  {"otg_in_octets_bad_total",  "counter", "Octets received in bad frames", false, _MetricInOctetsBad},
+  {"otg_link_speed_mbps",      "gauge",   "Ethernet link speed, or 0 if the link is down", false, _MetricLinkSpeed},
+  {"otg_vmain",                "gauge",   "Whether the port is on main rather than auxiliary power", false, _MetricVmain},
+  {"otg_eee_tx_lpi_enabled",   "gauge",   "Whether EEE TX low power idle is enabled", false, _MetricEEETx},
+  {"otg_eee_rx_lpi_enabled",   "gauge",   "Whether EEE RX low power idle is enabled", false, _MetricEEERx},
+  {"otg_rx_pool_enabled",      "gauge",   "Whether the APE RX pool is enabled", false, _MetricRXPoolEnabled},
+  {"otg_rx_pool_full_count",   "gauge",   "APE RX pool full count (FULLCNT)", false, _MetricRXPoolFull},
+  {"otg_rx_queue_count",       "gauge",   "Buffers in the APE RX return queue", false, _MetricRXQueueCount},
+  {"otg_rx_queue_head",        "gauge",   "APE RX return queue head", false, _MetricRXQueueHead},
+  {"otg_rx_queue_tail",        "gauge",   "APE RX return queue tail", false, _MetricRXQueueTail},
+  {"otg_scrape_duration_seconds", "gauge", "Time taken to read this function's registers", false, _MetricScrapeNs, 1000000000},
+  {"otg_ape_status",           "gauge",   "APE status word (APE 0x0004)", true, _MetricAPEStatus},
+  {"otg_ape_status2",          "gauge",   "APE status word 2 (APE 0x0030)", true, _MetricAPEStatus2},
+  {"otg_ape_cm3",              "gauge",   "APE Cortex-M3 status word (APE 0x0108)", true, _MetricAPECM3},
+  {"otg_ape_cpu_status",       "gauge",   "APE CPU status field (0 running, 1 halted, 3 sleeping, ...)", true, _MetricAPECPUStatus},
+  {"otg_ape_log_index",        "gauge",   "APE debug log index", true, _MetricAPELogIndex},
+  {"otg_ape_log_entries_total","counter", "APE debug log entries written since the exporter started", true, _MetricAPELogEntries},
+};
+
+// The number of decimal places needed to show a value in units of 1/scale
+// exactly, for a scale which is a power of ten.
+static int _MetricScaleDigits(uint64_t scale) {
+  int n = 0;
+  for (; scale > 1; scale /= 10)
+    ++n;
+  return n;
+}
+
+// Formats the last sample of every device. Returns a malloced string.
+static char *_FormatMetrics(const metrics_dev *devs, size_t numDevs, size_t *lenOut) {
+  char *text = NULL;
+  FILE *f = open_memstream(&text, lenOut);
+  if (!f)
+    return NULL;
+
+  for (size_t i=0; i<ARRAYLEN(_metrics); ++i) {
+    const metric_def *m = &_metrics[i];
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+    for (size_t k=0; k<numDevs; ++k) {
+      const metrics_dev *d = &devs[k];
+      if (!d->sampled || (m->ape && !d->ape))
+        continue;
+
+      if (m->ape)
+        fprintf(f, "%s{card=\"%.*s\"} ", m->name, (int)strlen(d->dev->name)-2, d->dev->name);
+      else
+        fprintf(f, "%s{device=\"%s\",function=\"%u\"} ", m->name, d->dev->name, GetPCIFuncNo(d->dev->info.busAddr));
+
+      uint64_t v = m->value(d);
+      if (m->scale)
+        fprintf(f, "%" PRIu64 ".%0*" PRIu64 "\n", v / m->scale, _MetricScaleDigits(m->scale), v % m->scale);
+      else
+        fprintf(f, "%" PRIu64 "\n", v);
+    }
+  }
+
+  fclose(f);
+  return text;
+}
+
+static int _WriteMetricsFile(const char *fn, const char *text, size_t len) {
+  // Write and rename, so a collector never reads a partial file.
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+  FILE *f = fopen(tmp, "w");
+  if (!f) {
+    fprintf(stderr, "error: couldn't write file: %s\n", fn);
+    return -1;
+  }
+
+  bool ok = fwrite(text, 1, len, f) == len;
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmp, fn) < 0) {
+    fprintf(stderr, "error: couldn't write file: %s\n", fn);
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static int _ListenMetrics(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    fprintf(stderr, "error: couldn't create socket\n");
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in sa = {
+    .sin_family      = AF_INET,
+    .sin_port        = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, 8) < 0) {
+    fprintf(stderr, "error: couldn't listen on port %d\n", port);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Answers one HTTP request with the metrics text, whatever was asked for.
+static void _ServeMetrics(int listenFd, const char *text, size_t len) {
+  int fd = accept(listenFd, NULL, NULL);
+  if (fd < 0)
+    return;
+
+  // Give a slow client a moment to send its request, but no more, so that
+  // sampling isn't held up.
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  char req[4096];
+  if (poll(&pfd, 1, 100) > 0)
+    (void)!read(fd, req, sizeof(req));
+
+  char hdr[128];
+  int hdrLen = snprintf(hdr, sizeof(hdr),
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+  if (write(fd, hdr, hdrLen) == hdrLen)
+    (void)!write(fd, text, len);
+  close(fd);
+}
+
+static int _UsageMetrics(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-i <seconds>] [-p <port> | -o <file>]\n");
+  fprintf(stderr, "  -i <seconds>  sample at this interval (default 10)\n");
+  fprintf(stderr, "  -p <port>     serve metrics over HTTP on this port of localhost\n");
+  fprintf(stderr, "  -o <file>     write metrics to this file after each sample, for a textfile collector\n");
+  fprintf(stderr, "With neither -p nor -o, sample once and print the metrics.\n");
+  return -2;
+}
+
+static int _CmdMetrics(int pargc, int argc, char **argv) {
+  // metrics [-i <seconds>] [-p <port> | -o <file>]
+  double interval = 10;
+  int port = 0;
+  const char *outFn = NULL;
+  for (int i=1; i<argc; ++i) {
+    if (!strcmp(argv[i], "-i") && i+1 < argc)
+      interval = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "-p") && i+1 < argc)
+      port = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-o") && i+1 < argc)
+      outFn = argv[++i];
+    else
+      return _UsageMetrics(pargc, argc, argv);
+  }
+  if ((port && outFn) || interval <= 0)
+    return _UsageMetrics(pargc, argc, argv);
+
+  open_device_t *open;
+  int numDevs = DeviceOpenAll(&open);
+  if (numDevs < 0)
+    return 1;
+  if (!numDevs) {
+    fprintf(stderr, "error: no supported devices found\n");
+    return 1;
+  }
+
+  metrics_dev *devs = calloc(numDevs, sizeof(metrics_dev));
+  if (!devs) {
+    fprintf(stderr, "error: out of memory\n");
+    DeviceCloseAll(open, numDevs);
+    return 1;
+  }
+  for (int k=0; k<numDevs; ++k) {
+    devs[k].dev = &open[k];
+    devs[k].ape = !k || (open[k-1].info.busAddr >> 3) != (open[k].info.busAddr >> 3);
+  }
+
+  int listenFd = -1;
+  if (port && (listenFd = _ListenMetrics(port)) < 0) {
+    free(devs);
+    DeviceCloseAll(open, numDevs);
+    return 1;
+  }
+
+  signal(SIGHUP, _SigInt);
+  signal(SIGINT, _SigInt);
+  signal(SIGQUIT, _SigInt);
+  signal(SIGPIPE, SIG_IGN);
+
+  int ec = 0;
+  char *text = NULL;
+  size_t len = 0;
+  uint64_t intervalNs = interval*1e9, nextNs = _ClockNs(CLOCK_MONOTONIC);
+  while (!g_stopTail) {
+    uint64_t now = _ClockNs(CLOCK_MONOTONIC);
+    if (now >= nextNs) {
+      for (int k=0; k<numDevs; ++k)
+        _SampleMetrics(&devs[k]);
+
+      free(text);
+      text = _FormatMetrics(devs, numDevs, &len);
+      if (!text) {
+        fprintf(stderr, "error: out of memory\n");
+        ec = 1;
+        break;
+      }
+
+      if (!port && !outFn) {
+        fwrite(text, 1, len, stdout);
+        break;
+      }
+      if (outFn && _WriteMetricsFile(outFn, text, len) < 0) {
+        ec = 1;
+        break;
+      }
+
+      nextNs += intervalNs;
+      if (nextNs <= now)
+        nextNs = now + intervalNs;
+      continue;
+    }
+
+    // Sleep until the next sample is due, answering any scrapes meanwhile.
+    int timeoutMs = (nextNs - now + 999999)/1000000;
+    if (listenFd < 0) {
+      usleep(timeoutMs*1000);
+      continue;
+    }
+    struct pollfd pfd = {.fd = listenFd, .events = POLLIN};
+    if (poll(&pfd, 1, timeoutMs) > 0)
+      _ServeMetrics(listenFd, text, len);
+  }
+
+  if (listenFd >= 0)
+    close(listenFd);
+  free(text);
+  free(devs);
+  DeviceCloseAll(open, numDevs);
+  return ec;
+}
+
+/* Snapshots
+ * ---------
+ * A snapshot is a copy of every mapped region of the RX CPU memory map, as
+ * documented in regs.yaml, taken as quickly as possible so that it reflects
+ * the state of the device at a single moment.
+ *
+ * The regions are split according to how they can be read: device registers
+ * and the APE register space are directly mapped by BAR1/2 and BAR3/4, and
+ * the first 32k of memory is visible through the memory window, so these are
+ * read with a tight loop of MMIO loads. Adjacent regions read the same way are
+ * coalesced into a single run. Anything else can only be read by halting the
+ * RX CPU for every word, which is slow and perturbs the device, so it is
+ * only included if asked for.
+ *
+ * The file is a snapshot_header, followed by numRuns snapshot_run entries
+ * sorted by address, followed by the words of each run. All values are
+ * little-endian.
+ */
+#define SNAPSHOT_MAGIC   "OTGSNAP1"
+#define SNAPSHOT_VERSION 1
+
+enum {
+  SNAPSHOT_METHOD_BAR12,   // Device registers.
+  SNAPSHOT_METHOD_BAR34,   // APE registers, SHM, etc.
+  SNAPSHOT_METHOD_WINDOW,  // First 32k of memory, through the memory window.
+  SNAPSHOT_METHOD_SLOW,    // Anything else, via GetRXWord.
+};
+
+static const char *const _snapshotMethodNames[] = {
+  [SNAPSHOT_METHOD_BAR12]  = "bar12",
+  [SNAPSHOT_METHOD_BAR34]  = "bar34",
+  [SNAPSHOT_METHOD_WINDOW] = "window",
+  [SNAPSHOT_METHOD_SLOW]   = "slow",
+};
+
+typedef struct __attribute__((packed)) {
+  char     magic[8];
+  uint32_t version;
+  uint32_t headerLen;      // Offset of the run index.
+  uint32_t numRuns;
+  uint32_t numWords;
+  uint64_t timeNs;         // CLOCK_REALTIME at the start of the snapshot.
+  uint64_t durationNs;     // Time taken to read the device.
+  uint32_t busAddr;        // As device_info_t.
+  uint16_t vendorID, deviceID;
+  uint16_t subsystemVendorID, subsystemID;
+  uint8_t  revisionID;
+  uint8_t  _reserved[3];
+  uint32_t chipID;         // REG_CHIP_ID
+  uint32_t macHigh, macLow; // REG_EMAC_MAC_ADDRESSES_0_HIGH/LOW
+} snapshot_header;
+
+typedef struct __attribute__((packed)) {
+  uint32_t addr;           // RX CPU address of the first word.
+  uint32_t numWords;
+  uint32_t offset;         // Offset of the first word from the start of the file.
+  uint32_t method;         // SNAPSHOT_METHOD_*
+} snapshot_run;
+
+// The ranges which can be read directly, as in GetRXWord.
+static const struct {
+  uint32_t start, end;     // Inclusive.
+  uint32_t method;
+} _snapshotFastRanges[] = {
+  {0x00000000, 0x00007FFF, SNAPSHOT_METHOD_WINDOW},
+  {0xC0000000, 0xC0007FFF, SNAPSHOT_METHOD_BAR12},
+  {0xC0010000, 0xC001FFFF, SNAPSHOT_METHOD_BAR34},
+};
+
+// Returns the method by which addr is read and sets *end to the last address
+// which is read the same way.
+static uint32_t _SnapshotMethod(uint32_t addr, uint32_t *end) {
+  uint32_t nextFast = 0xFFFFFFFF;
+  for (size_t i=0; i<ARRAYLEN(_snapshotFastRanges); ++i) {
+    if (addr >= _snapshotFastRanges[i].start && addr <= _snapshotFastRanges[i].end) {
+      uint32_t e = _snapshotFastRanges[i].end;
+      // Don't read past the end of BAR3/4, which may be smaller than 64k.
+      if (_snapshotFastRanges[i].method == SNAPSHOT_METHOD_BAR34
+       && e - _snapshotFastRanges[i].start >= g_mmio34->len)
+        e = _snapshotFastRanges[i].start + g_mmio34->len - 1;
+      if (addr <= e) {
+        *end = e;
+        return _snapshotFastRanges[i].method;
+      }
+    }
+    if (_snapshotFastRanges[i].start > addr && _snapshotFastRanges[i].start - 1 < nextFast)
+      nextFast = _snapshotFastRanges[i].start - 1;
+  }
+
+  *end = nextFast;
+  return SNAPSHOT_METHOD_SLOW;
+}
+
+// Builds the list of runs to read from the memory map, coalescing adjacent
+// regions read by the same method. Returns the number of runs, or -1 on error.
+static ssize_t _SnapshotPlan(bool slow, snapshot_run **runsOut) {
+  snapshot_run *runs = NULL;
+  size_t numRuns = 0, cap = 0;
+  for (size_t i=0; i<ARRAYLEN(g_regRegions); ++i) {
+    const reg_region *rr = &g_regRegions[i];
+    if (!rr->mapped)
+      continue;
+
+    uint32_t addr = rr->start;
+    while (1) {
+      uint32_t end;
+      uint32_t method = _SnapshotMethod(addr, &end);
+      if (end > rr->end)
+        end = rr->end;
+
+      if (method != SNAPSHOT_METHOD_SLOW || slow) {
+        snapshot_run *last = numRuns ? &runs[numRuns-1] : NULL;
+        if (last && last->method == method && last->addr + last->numWords*4 == addr)
+          last->numWords += (end - addr)/4 + 1;
+        else {
+          if (numRuns == cap) {
+            cap = cap ? cap*2 : 16;
+            snapshot_run *newRuns = realloc(runs, cap*sizeof(snapshot_run));
+            if (!newRuns) {
+              free(runs);
+              fprintf(stderr, "error: out of memory\n");
+              return -1;
+            }
+            runs = newRuns;
+          }
+          runs[numRuns++] = (snapshot_run) {.addr = addr, .numWords = (end - addr)/4 + 1, .method = method};
         }
-        printf("  INT 0x%02X RX Packet: port%u head=0x%02X tail=0x%02X bufCount=0x%X",
-          intNo, portNo,
-          (arg >> 8) & 0xFF, arg & 0xFF, (arg>>18) & 0xF);
-      } break;
+      }
+
+      if (end >= rr->end)
+        break;
+      addr = end + 1;
+    }
+  }
+
+  *runsOut = runs;
+  return numRuns;
+}
+
+static void _SnapshotRead(const snapshot_run *run, uint32_t *out) {
+  const volatile uint32_t *p;
+  switch (run->method) {
+    case SNAPSHOT_METHOD_BAR12:
+      p = PtrAdd(g_bar12, run->addr - REGMEM_BASE);
+      for (uint32_t i=0; i<run->numWords; ++i)
+        out[i] = p[i];
+      break;
+    case SNAPSHOT_METHOD_BAR34:
+      p = PtrAdd(g_bar34, run->addr - (REGMEM_BASE+APE_OFFSET));
+      for (uint32_t i=0; i<run->numWords; ++i)
+        out[i] = p[i];
+      break;
+    case SNAPSHOT_METHOD_WINDOW: {
+      // The window is assumed to be at zero elsewhere (see GetRXWord), but
+      // make sure of it. Words are swapped in pairs, as for GetRXWordWindow.
+      uint32_t oldBase = GetReg(REG_MEMORY_BASE);
+      SetReg(REG_MEMORY_BASE, 0);
+      p = PtrAdd(g_bar12, 32*1024);
+      for (uint32_t i=0; i<run->numWords; ++i)
+        out[i] = p[(run->addr/4 + i) ^ 1];
+      SetReg(REG_MEMORY_BASE, oldBase);
+      break;
+    }
+    default:
+      for (uint32_t i=0; i<run->numWords; ++i)
+        out[i] = GetRXWord(run->addr + i*4);
+      break;
+  }
+}
+
+static int _UsageSnapshot(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-a] <out.bin>\n");
+  fprintf(stderr,
+    "  Reads every mapped region of the memory map documented in regs.yaml\n"
+    "  which can be read directly (device registers, APE registers and SHM,\n"
+    "  and the first 32k of memory) and writes it to <out.bin>, along with\n"
+    "  the identity of the device. Reads have whatever side effects the\n"
+    "  hardware gives them.\n"
+    "  -a  Also read the remaining regions (RX CPU memory, ROM, etc.). This\n"
+    "      halts the RX CPU for every word and is much slower.\n"
+    "  Use snapshotget to read a snapshot.\n"
+    );
+  return -2;
+}
+
+static int _CmdSnapshot(int pargc, int argc, char **argv) {
+  bool slow = false;
+  if (argc > 1 && !strcmp(argv[1], "-a")) {
+    slow = true;
+    --argc;
+    ++argv;
+    ++pargc;
+  }
+  if (argc != 2)
+    return _UsageSnapshot(pargc, argc, argv);
+
+  snapshot_run *runs;
+  ssize_t numRuns = _SnapshotPlan(slow, &runs);
+  if (numRuns < 0)
+    return 1;
+
+  size_t numWords = 0;
+  for (ssize_t i=0; i<numRuns; ++i) {
+    runs[i].offset = sizeof(snapshot_header) + numRuns*sizeof(snapshot_run) + numWords*4;
+    numWords += runs[i].numWords;
+  }
+
+  uint32_t *words = malloc(numWords*4);
+  if (!words) {
+    fprintf(stderr, "error: out of memory\n");
+    free(runs);
+    return 1;
+  }
+
+  snapshot_header hdr = {
+    .magic             = SNAPSHOT_MAGIC,
+    .version           = htole32(SNAPSHOT_VERSION),
+    .headerLen         = htole32(sizeof(snapshot_header)),
+    .numRuns           = htole32(numRuns),
+    .numWords          = htole32(numWords),
+    .busAddr           = htole32(g_devInfo.busAddr),
+    .vendorID          = htole16(g_devInfo.config.vendorID),
+    .deviceID          = htole16(g_devInfo.config.deviceID),
+    .subsystemVendorID = htole16(g_devInfo.config.subsystemVendorID),
+    .subsystemID       = htole16(g_devInfo.config.subsystemID),
+    .revisionID        = g_devInfo.config.revisionID,
+  };
+
+  // Read everything first, and only then do anything slow.
+  uint64_t timeNs = _ClockNs(CLOCK_REALTIME), startNs = _ClockNs(CLOCK_MONOTONIC);
+  uint32_t *w = words;
+  for (ssize_t i=0; i<numRuns; ++i) {
+    _SnapshotRead(&runs[i], w);
+    w += runs[i].numWords;
+  }
+  uint64_t durationNs = _ClockNs(CLOCK_MONOTONIC) - startNs;
+
+  hdr.timeNs     = htole64(timeNs);
+  hdr.durationNs = htole64(durationNs);
+  hdr.chipID     = htole32(GetReg(REG_CHIP_ID));
+  hdr.macHigh    = htole32(GetReg(REG_EMAC_MAC_ADDRESSES_0_HIGH));
+  hdr.macLow     = htole32(GetReg(REG_EMAC_MAC_ADDRESSES_0_LOW));
+
+  for (size_t i=0; i<numWords; ++i)
+    words[i] = htole32(words[i]);
+  for (ssize_t i=0; i<numRuns; ++i) {
+    runs[i].addr     = htole32(runs[i].addr);
+    runs[i].numWords = htole32(runs[i].numWords);
+    runs[i].offset   = htole32(runs[i].offset);
+    runs[i].method   = htole32(runs[i].method);
+  }
+
+  int ec = 0;
+  FILE *f = fopen(argv[1], "wb");
+  if (!f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", argv[1]);
+    ec = 1;
+  } else if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+          || fwrite(runs, sizeof(snapshot_run), numRuns, f) != (size_t)numRuns
+          || fwrite(words, 4, numWords, f) != numWords
+          || fclose(f)) {
+    fprintf(stderr, "error: couldn't write file: %s\n", argv[1]);
+    ec = 1;
+  } else
+    fprintf(stderr, "%zu words in %zd runs read in %" PRIu64 " us\n", numWords, numRuns, durationNs/1000);
+
+  free(words);
+  free(runs);
+  return ec;
+}
+
+static int _UsageSnapshotGet(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-d] <snapshot.bin> [<address>[+num-words]...]\n");
+  fprintf(stderr,
+    "  Shows words from a snapshot taken with the snapshot command, as for get,\n"
+    "  including the g/, r/ and a/ prefixes and -d. Words which weren't read\n"
+    "  are not shown. With no addresses, shows the snapshot's header and the\n"
+    "  runs it contains.\n"
+    );
+  return -2;
+}
+
+typedef struct {
+  snapshot_header     hdr;
+  const snapshot_run *runs;
+  uint32_t            numRuns;
+  const uint8_t      *data;
+  size_t              len;
+} snapshot_file;
+
+// Looks up the word at addr. Returns false if it isn't in the snapshot.
+static bool _SnapshotLookup(const snapshot_file *s, uint32_t addr, uint32_t *v) {
+  size_t lo = 0, hi = s->numRuns;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (le32toh(s->runs[mid].addr) + le32toh(s->runs[mid].numWords)*4 <= addr)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  if (lo >= s->numRuns || le32toh(s->runs[lo].addr) > addr || (addr & 3))
+    return false;
+
+  const uint8_t *p = s->data + le32toh(s->runs[lo].offset) + (addr - le32toh(s->runs[lo].addr));
+  uint32_t w;
+  memcpy(&w, p, 4);
+  *v = le32toh(w);
+  return true;
+}
 
-      case 0xDA:
-        printf("  fault: chip1 0x%06x", arg);
-        break;
+static int _LoadSnapshot(const char *fn, snapshot_file *s) {
+  FILE *f = fopen(fn, "rb");
+  if (!f) {
+    fprintf(stderr, "error: couldn't open file: %s\n", fn);
+    return -1;
+  }
 
-      case 0xE0: {
-        uint32_t subtype = (arg >> 16) & 0xFF;
-        char typebuf[64];
-        const char *type;
-        switch (subtype) {
-          default:
-            snprintf(typebuf, sizeof(typebuf), "unknown subtype: BrcmOem.0x%02X", subtype);
-            type = typebuf;
-            break;
-        }
-        printf("  %s", type);
-      } break;
-      case 0xF0: {
-        uint32_t subtype = (arg >> 16) & 0xFF;
-        char typebuf[64];
-        const char *type;
-        switch (subtype) {
-          default:
-            snprintf(typebuf, sizeof(typebuf), "unknown subtype: 0x%02X", subtype);
-            type = typebuf;
-            break;
-        }
-        printf("  %s", type);
-      } break;
-      case 0xF4: {
-        printf("  FIX: p%02x", arg & 0xFF);
-        if (arg & 0x002000) printf("  ARPMerr");
-        if (arg & 0x004000) printf("  ARPMresetted");
-        if (arg & 0x008000) printf("  RegRepair");
-        if (arg & 0x080000) printf("  PhyBusy");
-        if (arg & 0x100000) printf("  MacResetted");
-        if (arg & 0x200000) printf("  MacPhyMismatch");
-        if (arg & 0x400000) printf("  DriverBusy");
-        if (arg & 0x800000) printf("  DriverDead");
-      } break;
-      default:
-        break;
-    }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (len < 0 || !data || fread(data, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "error: couldn't read file: %s\n", fn);
+    fclose(f);
+    free(data);
+    return -1;
+  }
+  fclose(f);
+
+  memset(s, 0, sizeof(*s));
+  if ((size_t)len >= sizeof(snapshot_header))
+    memcpy(&s->hdr, data, sizeof(snapshot_header));
+  if ((size_t)len < sizeof(snapshot_header) || memcmp(s->hdr.magic, SNAPSHOT_MAGIC, 8)
+   || le32toh(s->hdr.version) != SNAPSHOT_VERSION) {
+    fprintf(stderr, "error: not a snapshot: %s\n", fn);
+    free(data);
+    return -1;
+  }
+
+  // Check the index, so that lookups needn't.
+  uint32_t headerLen = le32toh(s->hdr.headerLen), numRuns = le32toh(s->hdr.numRuns);
+  if (headerLen > (size_t)len || numRuns > (len - headerLen)/sizeof(snapshot_run))
+    goto corrupt;
+  s->runs    = (const snapshot_run*)(data + headerLen);
+  s->numRuns = numRuns;
+  s->data    = data;
+  s->len     = len;
+  for (uint32_t i=0; i<numRuns; ++i) {
+    uint32_t addr = le32toh(s->runs[i].addr), n = le32toh(s->runs[i].numWords);
+    uint32_t off = le32toh(s->runs[i].offset);
+    if (off > (size_t)len || n > (len - off)/4 || (uint64_t)addr + n*4ULL > 0x100000000ULL
+     || (i && addr < le32toh(s->runs[i-1].addr) + le32toh(s->runs[i-1].numWords)*4))
+      goto corrupt;
+  }
+  return 0;
+
+corrupt:
+  fprintf(stderr, "error: snapshot is corrupt: %s\n", fn);
+  free(data);
+  return -1;
+}
 
+static void _PrintSnapshotInfo(const snapshot_file *s) {
+  const snapshot_header *h = &s->hdr;
+  char busAddr[32];
+  PCIBusAddrToString(le32toh(h->busAddr), busAddr, sizeof(busAddr));
+  uint32_t macHigh = le32toh(h->macHigh), macLow = le32toh(h->macLow);
+  uint64_t timeNs = le64toh(h->timeNs);
+  time_t t = timeNs/1000000000;
+  char timeStr[64];
+  strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+
+  printf("Device:     %s  %04x:%04x (subsystem %04x:%04x) rev %02x\n", busAddr,
+    le16toh(h->vendorID), le16toh(h->deviceID), le16toh(h->subsystemVendorID),
+    le16toh(h->subsystemID), h->revisionID);
+  printf("Chip ID:    0x%08X\n", le32toh(h->chipID));
+  printf("MAC:        %02x:%02x:%02x:%02x:%02x:%02x\n", (macHigh>>8)&0xFF, macHigh&0xFF,
+    macLow>>24, (macLow>>16)&0xFF, (macLow>>8)&0xFF, macLow&0xFF);
+  printf("Taken:      %s.%09" PRIu64 " UTC\n", timeStr, timeNs % 1000000000);
+  printf("Duration:   %" PRIu64 " us\n", le64toh(h->durationNs)/1000);
+  printf("Words:      %u in %u runs\n", le32toh(h->numWords), s->numRuns);
+  for (uint32_t i=0; i<s->numRuns; ++i) {
+    uint32_t addr = le32toh(s->runs[i].addr), end = addr + le32toh(s->runs[i].numWords)*4 - 1;
+    uint32_t method = le32toh(s->runs[i].method);
+    printf("  0x%04X_%04X-0x%04X_%04X  %-6s", addr>>16, addr&0xFFFF, end>>16, end&0xFFFF,
+      method < ARRAYLEN(_snapshotMethodNames) ? _snapshotMethodNames[method] : "?");
+
+    // Name the regions which the run covers.
+    const char *sep = "  ";
+    for (const reg_region *rr = RegRegionLookup(addr); rr && rr < &g_regRegions[ARRAYLEN(g_regRegions)] && rr->start <= end; ++rr) {
+      if (!rr->mapped)
+        continue;
+      printf("%s%s", sep, RegString(rr->name));
+      sep = ", ";
+    }
     printf("\n");
   }
+}
 
-//
-// Types:
-//   24 (0x18)  "int24: enter V(main|aux)" (arg bit 0x08_0000 means Vmain, else Vaux)
-//   20 (0x14)  "int20: "
-//     arg bit 0x00_0001: "PCIEreset"
-//     arg bit 0x00_0004: "P0_DsChg"
-//     arg bit 0x00_0002: "P0_GRCrst"
-//     arg bit 0x00_0100: "P1_DsChg"
-//     arg bit 0x00_0080: "P1_GRCrst"
-//     arg bit 0x00_4000: "P2_DsChg"
-//     arg bit 0x00_2000: "P2_GRCrst"
-//     arg bit 0x10_0000: "P3_DsChg"
-//     arg bit 0x08_0000: "P3_GRCrst"
-//
-//  LINK STATUS CHANGE
-//  ------------------
-//    Interrupt 0x19: Link Status Change for Ports 0 (Type 0x19), 2 (Type 0x41)
-//    Interrupt 0x1A: Link Status Change for Ports 1 (Type 0x1A), 3 (Type 0x42)
-//
-//  25 (0x19):  "int25: p0 D$x ps=$y ms=$z lnk=$w $s"
-//     where $x = logArg bits 8-9
-//           $y = logArg bits 4-6
-//           $z = logArg bits 0-3
-//           $w = based on bits 19-20:
-//             0: "1000mb", 1: "100mb", 2: "10mb", 3: "nolnk"
-//           $s = "Vmain" if logArg bit 0x0_2000 is set, "Vaux" otherwise.
-//  26 (0x1A):  "int26: p1 D$x ps=$y ms=$z lnk=$w $s"
-//    Same format and encoding as above.
-//  65 (0x41):  "int25: p2 D$x ps=$y ms=$z lnk=$w $s"
-//    Same format and encoding as above.
-//  66 (0x42):  "int26: p3 D$x ps=$y ms=$z lnk=$w $s"
-//    Same format and encoding as above.
-//
-//  RX PACKET
-//  ---------
-//    Interrupt 0x0B: RX Packet for Ports 0 (Type 0x0B), 2 (Type 0x33)
-//    Interrupt 0x1B: RX Packet for Ports 1 (Type 0x1B), 3 (Type 0x43)
-//
-//  11 (0x0B):  "int11: p0 rx pkt head=$head tail=$tail bufCnt=$bufCnt"
-//    $head = logArg bits 8-15
-//    $tail = logArg bits 0-7
-//    $bufCnt = logArg bits 18-21
-//  27 (0x1B):  "int27: p1 rx pkt head=$head tail=$tail bufCnt=$bufCnt"
-//    Same format and encoding as above.
-//  51 (0x33):  "int11: p2 rx pkt head=$head tail=$tail bufCnt=$bufCnt"
-//    Same format and encoding as above.
-//  67 (0x43):  "int27: p3 rx pkt head=$head tail=$tail bufCnt=$bufCnt"
-//    Same format and encoding as above.
-//  17 (0x11):  "int17: rmu egress $x $y saHit:$saHit len:$len $z"
-//    $x = if logArg bit 0x02, "pt", otherwise "cmd"
-//    $y = if logArg bit 0x01, "bad", otherwise ""
-//    $saHit = if logArg bit 0x04, bits 9-12, otherwise (-1)
-//    $len = bits 13-23
-//    $z = if logArg bit 0x08, "vlan", otherwise ""
-//  8 (0x08):  "int13: h2b $Xlwords $y$z"
-//    $X = logArg bits 2-23
-//    $y = if logArg bit 0x02, "underflow", else ""
-//    $z = if logArg bit 0x01, "!empty", else ""
-//  0xE0, 0xE1, 0xF0:
-//    "$x_$s (ch:$y/$z) $w"
-//    $x = logArg 16-23
-//    $s = based on logArg 16-23:
-//      if log type is 0xF0:
-//        0:  "ClrInitState"
-//        1:  "SelPkg"
-//        2:  "DeSelPkg"
-//        3:  "EnableCh"
-//        4:  "DisableCh"
-//        5:  "ResetCh"
-//        6:  "EnableChTx"
-//        7:  "DisableChTx"
-//        8:  "EnableAEN"
-//        9:  "SetLnk"
-//       10:  "GetLnkStatus"
-//       11:  "SetVlanFilt"
-//       12:  "EnableVlan"
-//       13:  "DisableVlan"
-//       14:  "SetMacAddr"
-//       15:  ?
-//       16:  "EnBcastFilt"
-//       17:  "DisBcastFilt"
-//       18:  "EnMcastFilt"
-//       19:  "DisMcastFilt"
-//       20:  "SetNcsiFc"
-//       21:  "GetVerId"
-//       22:  "GetCaps"
-//       23:  "GetParams"
-//       24:  "GetChPktStat"
-//       25:  "GetNcsiStat"
-//       26:  "GetPtStat"
-//       80:  "OEM"
-//       else: "invalid"
-//     if log type is 0xE0:
-//       0:   "BrcmOem.SetVirMac"
-//       1:   "BrcmOem.GetNcsiParam"
-//       5:   "BrcmOem.GetTempRead"
-//       else: "invalid"
-//     if log type is 0xE1:
-//       -1:   "DellOem.GetInventory"
-//       1:   "DellOem.GetExtCap"
-//       2:   "DellOem.GetPartInfo"
-//       3:   "DellOem.GetFcoeCap"
-//       4:   "DellOem.GetVirLink"
-//       5:   "DellOem.GetLanStat"
-//       6:   "DellOem.GetFcoeStat"
-//       7:   "DellOem.SetAddr"
-//       8:   "DellOem.GetAddr"
-//       9:   "DellOem.SetLicense"
-//      10:   "DellOem.GetLicense"
-//      11:   "DellOem.SetPtCtrl"
-//      12:   "DellOem.GetPtCtrl"
-//      13:   "DellOem.SetPartTxBw"
-//      14:   "DellOem.GetPartTxBw"
-//      15:   ?
-//      16:   "DellOem.SetMcIpAddr"
-//      17:   "DellOem.GetTeamInfo"
-//      18:   "DellOem.DisablePort"
-//      19:   "DellOem.GetTemp"
-//      20:   "DellOem.SetLinkTune"
-//      21:   "DellOem.EnableOobWoL"
-//      22:   "DellOem.DisOobWoL"
-//      else: "invalid"
-//  $y = logArg bits 13-23 (hex format)
-//  $z = logArg bits 8-12  (hex format)
-//  $w = based on logArb bits 0-7:
-//     0: "OK"
-//     1: "ErrInstanceId"
-//     2: "ErrCmdType"
-//     3: "ErrPayloadLen"
-//     4: "ErrChksum"
-//     5: "ErrInitReq"
-//     6: "ErrPkgId"
-//     7: "ErrChId"
-//     8: "ErrSysBusy"
-//     9: "OemOK"
-//    10: "ErrOemIana"
-//    11: "ErrOemCmdType"
-//    12: "ErrOemPkgPayloadLen"
-//    13: "ErrOemCmdPayloadLen"
-//    14: "ErrHdrRev"
-//   128: "RMU->SMbus"
-//   129: "SMBus->RMU"
-//   else: print as hex ("%02x_???")
-//  0xEE: "card: $x°C Tdead(g3):$y,$z TfanOnAux(g4):$w,$a"
-//    todo
-//    $x = if logArg bit 0x80, "N2B", else "H2B"
-//    $y = logArg bits 0-6
-//    $z = logArg bits 16-23 (hex)
-//    $w = logArg bits 8-15 (hex)
-//    $a =
-//      if logArg bit 0x1_0000 and logArg bit 0x0_0100, "n2b"
-//      if logArg bit 0x1_0000 but not logArg bit 0x0_0100, "_n2b"
-//      if not logArg bit 0x1_0000 but logArg bit 0x0_0100, "+n2b"
-//      else ""
-//    $b =
-//      if logArg bit 0x2_0000 and logArg bit 0x0_0200, "b2n"
-//      if logArg bit 0x2_0000 and not logArg bit 0x0_0200, "_b2n"
-//      if not logArg bit 0x2_0000 and logArg bit 0x0_0200, "+b2n"
-//      else ""
-//    $c =
-//      if logArg bit 0x4_0000 and logArg bit 0x0_0400, "h2b"
-//      if logArg bit 0x4_0000 and not logArg bit 0x0_0400, "_h2b"
-//      if not logArg bit 0x4_0000 and logArg bit 0x0_0400, "+h2b"
-//      else ""
-//    $d =
-//      if logArg bit 0x8_0000 and logArg bit 0x0_0800, "b2h"
-//      if logArg bit 0x8_0000 and not logArg bit 0x0_0800, "_b2h"
-//      if not logArg bit 0x8_0000 and logArg bit 0x0_0800, "+b2h"
-//      else ""
-//  0xF5: "!failed rsps=$x reason=$y-$z"
-//    $x = bits 16-23 (hex)
-//    $y = bits 0-7   (hex)
-//    $z = bits 8-15  (hex)
-//  0xF1: "aen: "
-//    bits 0-7:
-//      0: LinkChg
-//      1: CfgReq
-//      2: DrvrChg
-//
-//    todo
-//  0xF2: "!!!: crashed PC=$x"
-//    $x: logArg (hex)
-//  0xF3:
-//    if bits 8-23 are nonzero,
-//      "drv: p$x present $y.$z"
-//    else "drv: p$x absent"
-//    $x = bits 0-7
-//    $y = bits 16-23
-//    $z = bits 8-15
-//  0xF6: "drv: p$x "
-//    $x = bits 0-7
-//    bits 16-23:
-//      0x01: "DIAG"
-//      0x10: "ODI"
-//      0x12: "UNDI"
-//      0x13: "UEFI"
-//      0xF0: "LINUX"
-//      0xF4: "SOLARIS"
-//      0xF6: "FREEBSD"
-//      0xF8: "NETWARE"
-//      0xF1,0xF2,0xF3,0xF5,0xF7,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF: print hex
-//      other: "NDIS" + print hex
-//    bits 8-15:
-//      1: "start"
-//      2: "unload"
-//      3: "WOL"
-//      4: "suspend"
-//  0xF4: "fix: p$x"
-//    $x = bits 0-7
-//    bit 0x002000: "ARPMerr"
-//    bit 0x004000: "ARPMresetted"
-//    bit 0x008000: "RegRepair"
-//    bit 0x080000: "PhyBusy"       -- generated if MIIWait times out, port number in low bits
-//    bit 0x100000: "MacResetted"
-//    bit 0x200000: "MacPhyMismatch"
-//    bit 0x400000: "DriverBusy"
-//    bit 0x800000: "DriverDead"
-//  0xF7: "mctpCtrl:Rq$x D$y $z $w_"
-//    $x = bit 7
-//    $y = bit 6
-//    $z = bits 0-4
-//    $w = bits 8-15
-//    based on $w:
-//      1: "SetEndpointID"
-//      2: "GetEndpointID"
-//      4: "GetMCTPVerSupport"
-//      5: "GetMsgTypeSupport"
-//    if bit 7 is NOT set:
-//      based on bits 16-23:
-//        0: "SUCCESS"
-//        1: "ERROR"
-//        2: "InvalidData"
-//        3: "InvalidLen"
-//        4: "NotReady"
-//        5: "UnsupportedCmd"
-//  0xD8: "card: $x.$y°C"
-//    todo
-//  0xDB: "VPD: update chip$x $y version"
-//    $x = bits 8-15
-//    $y = if bits 0-7 are nonzero, "IMFW", else "BOOT"
-//  0xD9: "fault: chip0 $x"
-//    $x = bits 0-23
-//  0xDA: "fault: chip1 $x"
-//    $x = bits 0-23
-//  0xDC: "gpio: ..."
-//    todo
+static int _CmdSnapshotGet(int pargc, int argc, char **argv) {
+  bool decode = false;
+  if (argc > 1 && !strcmp(argv[1], "-d")) {
+    decode = true;
+    --argc;
+    ++argv;
+    ++pargc;
+  }
+  if (argc < 2)
+    return _UsageSnapshotGet(pargc, argc, argv);
 
-  return 0;
+  snapshot_file s;
+  if (_LoadSnapshot(argv[1], &s) < 0)
+    return 1;
+
+  if (argc == 2)
+    _PrintSnapshotInfo(&s);
+
+  int ec = 0;
+  for (char **a = argv+2; *a; ++a) {
+    uint32_t ad, numWords;
+    if (_ResolveAddress(*a, &ad, &numWords, NULL, NULL) < 0) {
+      ec = _UsageSnapshotGet(pargc, argc, argv);
+      break;
+    }
+
+    for (uint32_t i=0; i<numWords; ++i, ad += 4) {
+      uint32_t v;
+      if (!_SnapshotLookup(&s, ad, &v))
+        continue;
+      if (decode)
+        _PrintDecodedWord(ad, v);
+      else
+        printf("[0x%04X_%04X] = 0x%04X_%04X\n", ad>>16, ad&0xFFFF, v>>16, v&0xFFFF);
+    }
+  }
+
+  free((void*)s.data);
+  return ec;
 }
 
 static int _CmdAPECrash(int pargc, int argc, char **argv) {
@@ -2262,6 +4452,454 @@ static int _CmdAPECrash(int pargc, int argc, char **argv) {
   return 0;
 }
 
+static int _UsageAPEWatch(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "set <comp> <addr> [r|w|rw] [<ignore-bits>]\n");
+  fprintf(stderr, "       ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "clear [<comp>]\n");
+  fprintf(stderr, "       ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "log [-f]\n");
+  return -2;
+}
+
+static bool _ParseU32(const char *s, uint32_t *v) {
+  char *tail = NULL;
+  *v = strtoul(s, &tail, 0);
+  return tail && tail != s && !*tail;
+}
+
+// Prints and consumes the watchpoint hits logged so far.
+static int _DrainAPEWatch(uint32_t *drops) {
+  uint32_t prod = GetReg(REG_APE__APEDBG_WATCH_PROD);
+  uint32_t cons = GetReg(REG_APE__APEDBG_WATCH_CONS);
+  if (prod - cons > REG_APE__APEDBG_WATCH_LEN) {
+    fprintf(stderr, "error: watchpoint ring indices are inconsistent\n");
+    return -1;
+  }
+
+  for (; cons != prod; ++cons) {
+    uint32_t e = REG_APE__APEDBG_WATCH_BASE + (cons % REG_APE__APEDBG_WATCH_LEN)*16;
+    uint32_t comp = GetReg(e + 12);
+    printf("comp %u: pc=0x%08X addr=0x%08X", comp & ~REG_APE__APEDBG_WATCH_NO_VALUE, GetReg(e), GetReg(e + 4));
+    if (comp & REG_APE__APEDBG_WATCH_NO_VALUE)
+      printf(" value=?\n");
+    else
+      printf(" value=0x%08X\n", GetReg(e + 8));
+  }
+  SetReg(REG_APE__APEDBG_WATCH_CONS, cons);
+
+  uint32_t d = GetReg(REG_APE__APEDBG_WATCH_DROPS);
+  if (d != *drops) {
+    printf("%u hits dropped\n", d - *drops);
+    *drops = d;
+  }
+
+  fflush(stdout);
+  return 0;
+}
+
+static int _CmdAPEWatch(int pargc, int argc, char **argv) {
+  // apewatch set <comp> <addr> [r|w|rw] [<ignore-bits>]
+  // apewatch clear [<comp>]
+  // apewatch log [-f]
+  if (argc < 2)
+    return _UsageAPEWatch(pargc, argc, argv);
+
+  int n;
+  if (!strcmp(argv[1], "set")) {
+    uint32_t comp, addr, maskBits = 0, mode = REG_APE__APEDBG_WATCH_MODE__WRITE;
+    if (argc < 4 || argc > 6 || !_ParseU32(argv[2], &comp) || !_ParseU32(argv[3], &addr))
+      return _UsageAPEWatch(pargc, argc, argv);
+
+    if (argc > 4) {
+      if (!strcmp(argv[4], "r"))
+        mode = REG_APE__APEDBG_WATCH_MODE__READ;
+      else if (!strcmp(argv[4], "w"))
+        mode = REG_APE__APEDBG_WATCH_MODE__WRITE;
+      else if (!strcmp(argv[4], "rw"))
+        mode = REG_APE__APEDBG_WATCH_MODE__RW;
+      else
+        return _UsageAPEWatch(pargc, argc, argv);
+    }
+
+    if (argc > 5 && !_ParseU32(argv[5], &maskBits))
+      return _UsageAPEWatch(pargc, argc, argv);
+
+    n = SetAPEWatchShell(comp, addr, maskBits, mode);
+  } else if (!strcmp(argv[1], "clear")) {
+    uint32_t comp = REG_APE__APEDBG_WATCH_ALL;
+    if (argc > 3 || (argc == 3 && !_ParseU32(argv[2], &comp)))
+      return _UsageAPEWatch(pargc, argc, argv);
+
+    n = ClearAPEWatchShell(comp);
+  } else if (!strcmp(argv[1], "log")) {
+    bool follow = (argc == 3 && !strcmp(argv[2], "-f"));
+    if (argc > 3 || (argc == 3 && !follow))
+      return _UsageAPEWatch(pargc, argc, argv);
+
+    // Only report drops which happen from now on.
+    uint32_t drops = follow ? GetReg(REG_APE__APEDBG_WATCH_DROPS) : 0;
+    if (!follow)
+      return _DrainAPEWatch(&drops) < 0;
+
+    signal(SIGHUP, _SigInt);
+    signal(SIGINT, _SigInt);
+    signal(SIGQUIT, _SigInt);
+    while (!g_stopTail) {
+      if (_DrainAPEWatch(&drops) < 0)
+        return 1;
+      usleep(1000);
+    }
+    return 0;
+  } else
+    return _UsageAPEWatch(pargc, argc, argv);
+
+  if (n == -2)
+    fprintf(stderr, "error: running shell does not support watchpoints\n");
+  if (n < 0)
+    return 1;
+
+  fprintf(stderr, "%d comparators\n", n);
+  return 0;
+}
+
+// ELF32 symbol tables, for symbolizing APE addresses.
+typedef struct {
+  uint32_t    addr, size;
+  const char *name;
+} elf_sym;
+
+typedef struct {
+  elf_sym *syms;  // Function symbols, sorted by address.
+  size_t   numSyms;
+  elf_sym *objs;  // Data symbols, in file order.
+  size_t   numObjs;
+} elf_symtab;
+
+static int _CompareELFSym(const void *a, const void *b) {
+  const elf_sym *x = a, *y = b;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// Loads the function and data symbols of a little-endian ELF32 file such as
+// ape_code_poc.elf. Names point into the mapped file, which is never unmapped.
+static int ELFLoadSymtab(const char *fn, elf_symtab *t) {
+  memset(t, 0, sizeof(*t));
+
+  int fd = open(fn, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "error: couldn't open file: %s\n", fn);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < sizeof(Elf32_Ehdr)) {
+    fprintf(stderr, "error: couldn't stat file, or undersized\n");
+    close(fd);
+    return -1;
+  }
+
+  const uint8_t *virt = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (virt == MAP_FAILED) {
+    fprintf(stderr, "error: couldn't mmap file\n");
+    return -1;
+  }
+
+  const Elf32_Ehdr *eh = (const Elf32_Ehdr*)virt;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_ident[EI_CLASS] != ELFCLASS32
+   || eh->e_ident[EI_DATA] != ELFDATA2LSB) {
+    fprintf(stderr, "error: not a little-endian ELF32 file: %s\n", fn);
+    return -1;
+  }
+
+  uint32_t shoff = le32toh(eh->e_shoff), shnum = le16toh(eh->e_shnum);
+  if (shoff > st.st_size || shnum > (st.st_size - shoff)/sizeof(Elf32_Shdr)) {
+    fprintf(stderr, "error: malformed ELF section table\n");
+    return -1;
+  }
+
+  const Elf32_Shdr *sh = (const Elf32_Shdr*)(virt + shoff);
+  for (uint32_t i=0; i<shnum; ++i) {
+    if (le32toh(sh[i].sh_type) != SHT_SYMTAB)
+      continue;
+
+    uint32_t off = le32toh(sh[i].sh_offset), len = le32toh(sh[i].sh_size);
+    uint32_t strIdx = le32toh(sh[i].sh_link);
+    if (strIdx >= shnum || off > st.st_size || len > st.st_size - off)
+      break;
+
+    uint32_t strOff = le32toh(sh[strIdx].sh_offset), strLen = le32toh(sh[strIdx].sh_size);
+    if (strOff > st.st_size || strLen > st.st_size - strOff || !strLen || virt[strOff + strLen - 1])
+      break;
+
+    const Elf32_Sym *sym = (const Elf32_Sym*)(virt + off);
+    size_t numSyms = len / sizeof(Elf32_Sym);
+    t->syms = calloc(numSyms ? numSyms : 1, sizeof(elf_sym));
+    t->objs = calloc(numSyms ? numSyms : 1, sizeof(elf_sym));
+    if (!t->syms || !t->objs) {
+      fprintf(stderr, "error: out of memory\n");
+      return -1;
+    }
+
+    for (size_t j=0; j<numSyms; ++j) {
+      uint32_t name = le32toh(sym[j].st_name);
+      if (name >= strLen)
+        continue;
+
+      if (ELF32_ST_TYPE(sym[j].st_info) == STT_OBJECT) {
+        t->objs[t->numObjs].addr = le32toh(sym[j].st_value);
+        t->objs[t->numObjs].size = le32toh(sym[j].st_size);
+        t->objs[t->numObjs].name = (const char*)virt + strOff + name;
+        ++t->numObjs;
+        continue;
+      }
+
+      if (ELF32_ST_TYPE(sym[j].st_info) != STT_FUNC)
+        continue;
+
+      // Thumb function addresses have bit 0 set.
+      t->syms[t->numSyms].addr = le32toh(sym[j].st_value) & ~1U;
+      t->syms[t->numSyms].size = le32toh(sym[j].st_size);
+      t->syms[t->numSyms].name = (const char*)virt + strOff + name;
+      ++t->numSyms;
+    }
+
+    qsort(t->syms, t->numSyms, sizeof(elf_sym), _CompareELFSym);
+    return 0;
+  }
+
+  fprintf(stderr, "error: no usable symbol table in %s\n", fn);
+  return -1;
+}
+
+// Returns the function containing addr, or NULL. Symbols with no size are
+// assumed to extend to the next symbol.
+static const elf_sym *ELFLookup(const elf_symtab *t, uint32_t addr) {
+  size_t lo = 0, hi = t->numSyms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (t->syms[mid].addr <= addr)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+
+  if (!lo)
+    return NULL;
+
+  const elf_sym *s = &t->syms[lo-1];
+  if (s->size && addr - s->addr >= s->size)
+    return NULL;
+  return s;
+}
+
+// Returns the data symbol with the given name, or NULL.
+static const elf_sym *ELFFindObject(const elf_symtab *t, const char *name) {
+  for (size_t i=0; i<t->numObjs; ++i)
+    if (!strcmp(t->objs[i].name, name))
+      return &t->objs[i];
+  return NULL;
+}
+
+typedef struct {
+  const char *name;
+  uint32_t    addr;    // Function address, or the PC itself if unknown.
+  size_t      count;
+} prof_entry;
+
+static int _ComparePC(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int _CompareProfEntry(const void *a, const void *b) {
+  const prof_entry *x = a, *y = b;
+  if (x->count != y->count)
+    return (x->count < y->count) - (x->count > y->count);
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static bool g_stopProf = false;
+
+static void _SigIntProf(int signo) {
+  g_stopProf = true;
+}
+
+static int _UsageAPEProf(int pargc, int argc, char **argv) {
+  fprintf(stderr, "usage: ");
+  PrintCommand(pargc, argc, argv);
+  fprintf(stderr, "[-d | -r <cycles>] <ape_code.elf> [<seconds>]\n");
+  fprintf(stderr, "  -r <cycles>  sample period (default %u)\n", APE_PROF_RELOAD__DEFAULT+1);
+  fprintf(stderr, "  -d           stop sampling, which otherwise continues after apeprof exits\n");
+  return -2;
+}
+
+// Accesses a field of the image's gAProf, at prof in APE memory.
+#define APE_PROF_GET(prof, field)    GetAPEWord((prof) + offsetof(ape_prof, field))
+#define APE_PROF_SET(prof, field, v) SetAPEWord((prof) + offsetof(ape_prof, field), (v))
+
+// Waits for the image to be sampling with the given reload value, or any if
+// 0. The image only notices changes on its next tick, which may be up to
+// 2**24 cycles away.
+static bool _WaitAPEProfActive(uint32_t prof, uint32_t reload) {
+  uint64_t start = _ClockNs(CLOCK_MONOTONIC);
+  do {
+    uint32_t active = APE_PROF_GET(prof, activeReload);
+    if (active && (!reload || active == reload))
+      return true;
+    usleep(1000);
+  } while (_ClockNs(CLOCK_MONOTONIC) - start < 2000000000);
+  return false;
+}
+
+static int _CmdAPEProf(int pargc, int argc, char **argv) {
+  // apeprof [-d | -r <cycles>] <ape_code.elf> [<seconds>]
+  bool disable = false;
+  uint32_t reload = 0;
+  if (argc > 1 && !strcmp(argv[1], "-d")) {
+    disable = true;
+    argc -= 1;
+    argv += 1;
+    pargc += 1;
+  } else if (argc > 2 && !strcmp(argv[1], "-r")) {
+    reload = strtoul(argv[2], NULL, 0) - 1;
+    if (!reload || reload > APE_PROF_RELOAD__MAX) {
+      fprintf(stderr, "error: sample period must be 2 to %u cycles\n", APE_PROF_RELOAD__MAX+1);
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+    pargc += 2;
+  }
+
+  if (argc < 2 || argc > (disable ? 2 : 3))
+    return _UsageAPEProf(pargc, argc, argv);
+
+  double seconds = (argc > 2) ? strtod(argv[2], NULL) : 0;
+
+  elf_symtab symtab;
+  if (ELFLoadSymtab(argv[1], &symtab) < 0)
+    return 1;
+
+  const elf_sym *profSym = ELFFindObject(&symtab, "gAProf");
+  if (!profSym || profSym->size != sizeof(ape_prof)) {
+    fprintf(stderr, "error: %s has no profiler ring\n", argv[1]);
+    return 1;
+  }
+
+  uint32_t prof = profSym->addr;
+  if (APE_PROF_GET(prof, magic) != APE_PROF_MAGIC) {
+    fprintf(stderr, "error: the running APE image has no profiler ring; is it the one in %s?\n", argv[1]);
+    return 1;
+  }
+
+  if (disable) {
+    APE_PROF_SET(prof, ctrl, 0);
+    return 0;
+  }
+
+  // Sampling stays enabled until apeprof -d or the image restarts, so that
+  // later runs need not wait for the image to pick it up.
+  if (reload)
+    APE_PROF_SET(prof, reload, reload);
+  APE_PROF_SET(prof, ctrl, APE_PROF_CTRL__ENABLE);
+  if (!_WaitAPEProfActive(prof, reload)) {
+    fprintf(stderr, "error: APE image is not sampling\n");
+    return 1;
+  }
+
+  signal(SIGHUP, _SigIntProf);
+  signal(SIGINT, _SigIntProf);
+  signal(SIGQUIT, _SigIntProf);
+
+  size_t numPCs = 0, capPCs = 4096;
+  uint32_t *pcs = malloc(capPCs*sizeof(uint32_t));
+  if (!pcs) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+
+  // Discard anything already in the ring.
+  uint32_t cons   = APE_PROF_GET(prof, prod);
+  uint32_t drops0 = APE_PROF_GET(prof, drops);
+  APE_PROF_SET(prof, cons, cons);
+
+  fprintf(stderr, "sampling every %u cycles%s\n", APE_PROF_GET(prof, activeReload)+1,
+    seconds ? "" : ", interrupt to stop");
+
+  uint64_t start = _ClockNs(CLOCK_MONOTONIC);
+  while (!g_stopProf && (!seconds || _ClockNs(CLOCK_MONOTONIC) - start < seconds*1e9)) {
+    uint32_t prod = APE_PROF_GET(prof, prod);
+    if (prod - cons > APE_PROF_LEN) {
+      fprintf(stderr, "error: profiler ring indices are inconsistent, was the APE reset?\n");
+      break;
+    }
+
+    for (; cons != prod; ++cons) {
+      if (numPCs == capPCs) {
+        uint32_t *p = realloc(pcs, 2*capPCs*sizeof(uint32_t));
+        if (!p) {
+          fprintf(stderr, "error: out of memory\n");
+          return 1;
+        }
+        pcs = p;
+        capPCs *= 2;
+      }
+
+      pcs[numPCs++] = GetAPEWord(prof + offsetof(ape_prof, pcs) + (cons % APE_PROF_LEN)*4);
+    }
+
+    APE_PROF_SET(prof, cons, cons);
+    usleep(1000);
+  }
+
+  uint32_t drops = APE_PROF_GET(prof, drops) - drops0;
+  if (!numPCs) {
+    fprintf(stderr, "no samples\n");
+    return 1;
+  }
+
+  // Sort so that samples in the same function are adjacent, then count.
+  qsort(pcs, numPCs, sizeof(uint32_t), _ComparePC);
+
+  size_t numEntries = 0;
+  prof_entry *entries = calloc(numPCs, sizeof(prof_entry));
+  if (!entries) {
+    fprintf(stderr, "error: out of memory\n");
+    return 1;
+  }
+
+  for (size_t i=0; i<numPCs; ++i) {
+    const elf_sym *sym = ELFLookup(&symtab, pcs[i]);
+    uint32_t addr = sym ? sym->addr : pcs[i];
+    if (numEntries && entries[numEntries-1].addr == addr && (sym != NULL) == (entries[numEntries-1].name != NULL)) {
+      ++entries[numEntries-1].count;
+      continue;
+    }
+
+    entries[numEntries].name  = sym ? sym->name : NULL;
+    entries[numEntries].addr  = addr;
+    entries[numEntries].count = 1;
+    ++numEntries;
+  }
+
+  qsort(entries, numEntries, sizeof(prof_entry), _CompareProfEntry);
+
+  printf("%zu samples, %u dropped\n", numPCs, drops);
+  printf("%8s %7s  %-10s  %s\n", "SAMPLES", "%", "ADDR", "FUNCTION");
+  for (size_t i=0; i<numEntries; ++i)
+    printf("%8zu %6.2f%%  0x%08X  %s\n", entries[i].count, 100.0*entries[i].count/numPCs,
+      entries[i].addr, entries[i].name ? entries[i].name : "?");
+
+  free(entries);
+  free(pcs);
+  return 0;
+}
+
 int _CmdAPEReset(int pargc, int argc, char **argv) {
   MaskOrReg(REG_APE__MODE, REG_APE__MODE__FAST_BOOT, REG_APE__MODE__HALT);
 
@@ -2289,8 +4927,11 @@ typedef struct {
   const char *tagline;
   int (*func)(int pargc, int argc, char **argv);
   bool anyDevice;
+  bool noDevice; // The device argument is ignored, e.g. "-".
 } command_def_t;
 
+static int _CmdWaitStats(int pargc, int argc, char **argv);
+
 static const command_def_t _commands[] = {
   {.name = "info",
    .func = _CmdInfo,
@@ -2305,6 +4946,11 @@ static const command_def_t _commands[] = {
    .tagline = "Get contents of device memory (binary output).",
    .func = _CmdDump,
   },
+  {.name = "decode",
+   .tagline = "Decode a register value using regs.yaml",
+   .func = _CmdDecode,
+   .noDevice = true,
+  },
   {.name = "set",
    .tagline = "Sets a device word",
    .func = _CmdSet,
@@ -2369,10 +5015,43 @@ static const command_def_t _commands[] = {
    .tagline = "Chainload APE image (assumes APE shell currently running)",
    .func = _CmdChainAPE,
   },
+  {.name = "reloadape",
+   .tagline = "Reload APE image, uploading only what has changed (assumes APE shell running)",
+   .func = _CmdReloadAPE,
+  },
   {.name = "tail",
    .tagline = "Stream out OTG debug log from device",
    .func = _CmdTail,
   },
+  {.name = "tailall",
+   .tagline = "Stream out OTG and APE debug logs from every supported device",
+   .func = _CmdTailAll,
+   .noDevice = true,
+  },
+  {.name = "trace",
+   .tagline = "Record bootcode and APE logs of all devices as a Chrome trace",
+   .func = _CmdTrace,
+   .noDevice = true,
+  },
+  {.name = "metrics",
+   .tagline = "Export management state of all devices as Prometheus metrics",
+   .func = _CmdMetrics,
+   .noDevice = true,
+  },
+  {.name = "snapshot",
+   .tagline = "Capture the device's registers and memory to a file",
+   .func = _CmdSnapshot,
+  },
+  {.name = "snapshotget",
+   .tagline = "Show words from a snapshot file",
+   .func = _CmdSnapshotGet,
+   .noDevice = true,
+  },
+  {.name = "tailreplay",
+   .tagline = "Replay a log stream captured with tail -w",
+   .func = _CmdTailReplay,
+   .noDevice = true,
+  },
   {.name = "apeinfo",
    .tagline = "APE info",
    .func = _CmdAPEInfo,
@@ -2381,16 +5060,60 @@ static const command_def_t _commands[] = {
    .tagline = "APE debug log",
    .func = _CmdAPELog,
   },
+  {.name = "apelogdecode",
+   .tagline = "Decode an APE debug log captured with apelog -w",
+   .func = _CmdAPELogDecode,
+   .noDevice = true,
+  },
   {.name = "apecrash",
    .tagline = "Show APE crash info",
    .func = _CmdAPECrash,
   },
+  {.name = "apewatch",
+   .tagline = "Set and clear APE watchpoints, and show their hits (assumes APE shell running)",
+   .func = _CmdAPEWatch,
+  },
+  {.name = "apeprof",
+   .tagline = "Sample APE PCs and show where time is spent",
+   .func = _CmdAPEProf,
+  },
   {.name = "apereset",
    .tagline = "Reset APE",
    .func = _CmdAPEReset,
   },
+  {.name = "waitstats",
+   .tagline = "Run a command and show device wait latency histograms",
+   .func = _CmdWaitStats,
+  },
 };
 
+static int _CmdWaitStats(int pargc, int argc, char **argv) {
+  // waitstats <command> <args...>
+  if (argc < 2) {
+    fprintf(stderr, "usage: waitstats <command> <args...>\n");
+    fprintf(stderr, "  OTG_WAIT_SPIN_US      busy-spin time before sleeping (default %" PRIu64 ")\n", g_waitSpinNs/1000);
+    fprintf(stderr, "  OTG_WAIT_MAX_SLEEP_US maximum backoff sleep (default %" PRIu64 ")\n", g_waitMaxSleepNs/1000);
+    return 1;
+  }
+
+  const command_def_t *cmd = NULL;
+  for (size_t i=0; i<ARRAYLEN(_commands); ++i)
+    if (!strcmp(_commands[i].name, argv[1]) && _commands[i].func != _CmdWaitStats) {
+      cmd = &_commands[i];
+      break;
+    }
+
+  if (!cmd) {
+    fprintf(stderr, "error: unknown command: \"%s\"\n", argv[1]);
+    return 1;
+  }
+
+  int ec = cmd->func(pargc+1, argc-1, argv+1);
+  fflush(stdout);
+  PrintWaitStats(stderr);
+  return ec;
+}
+
 int main(int argc, char **argv) {
   int ec;
 
@@ -2402,14 +5125,6 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  ec = DeviceResolveByString(argv[1], &g_devInfo);
-  if (ec < 0)
-    return 1;
-
-  ec = DeviceLoadInfo(&g_devInfo);
-  if (ec < 0)
-    return 1;
-
   const command_def_t *cmd = NULL;
   for (size_t i=0; i<ARRAYLEN(_commands); ++i)
     if (!strcmp(_commands[i].name, argv[2])) {
@@ -2419,10 +5134,20 @@ int main(int argc, char **argv) {
 
   if (!cmd) {
     fprintf(stderr, "error: unknown command: \"%s\"\n", argv[2]);
-    ec = 1;
-    goto error;
+    return 1;
   }
 
+  if (cmd->noDevice)
+    return cmd->func(2, argc-2, argv+2);
+
+  ec = DeviceResolveByString(argv[1], &g_devInfo);
+  if (ec < 0)
+    return 1;
+
+  ec = DeviceLoadInfo(&g_devInfo);
+  if (ec < 0)
+    return 1;
+
   g_devInfo.type = DeviceDetermineSupport(&g_devInfo, _supportTable);
   if (g_devInfo.type < 0 && !cmd->anyDevice) {
     fprintf(stderr, "error: unsupported device\n");
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <assert.h>
 #include <argp.h>
 #include <fcntl.h>
@@ -11,6 +12,7 @@
 #include <unistd.h>
 #include "otg.h"
 #include "otg_common.c"
+#include "otg_vpd.c"
 
 static const size_t HUMAN_SIZE_LEN = 64;
 
@@ -33,218 +35,83 @@ static const struct argp _argpInfo = {
   .args_doc = "<image-filename>",
 };
 
-static void _DumpVPDInner(const uint8_t *vpd, size_t vpdLen, size_t *ckOffsetPtr) {
-  enum {
-    VSTATE_KW1 = 0,
-    VSTATE_KW2,
-    VSTATE_LEN,
-    VSTATE_DATA,
-  };
-  enum {
-    VPD_KW_PART_NUMBER         = 0x504E, // 'PN'
-    VPD_KW_ENGINEERING_CHANGES = 0x4543, // 'EC'
-    VPD_KW_SERIAL_NUMBER       = 0x534E, // 'SN'
-    VPD_KW_MANUFACTURE_ID      = 0x4D4E, // 'MN'
-    VPD_KW_RV                  = 0x5256, // 'RV'
-    VPD_KW_ASSET_TAG           = 0x5941, // 'YA'
-    VPD_KW_READ_WRITE_AREA     = 0x5257, // 'RW'
-    VPD_KW_V0                  = 0x5630, // 'V0' ] Unknown Vendor-Specific
-    VPD_KW_V1                  = 0x5631, // 'V1' ]
-    VPD_KW_V2                  = 0x5632, // 'V2' ]
-    VPD_KW_V3                  = 0x5633, // 'V3' ]
-    VPD_KW_V4                  = 0x5634, // 'V4' ]
-    VPD_KW_V5                  = 0x5635, // 'V5' ]
-    VPD_KW_V6                  = 0x5636, // 'V6' ]
-  };
-  uint16_t kw;
-  uint8_t origLen, len;
-  int state = VSTATE_KW1;
-  const uint8_t *vpdEnd = vpd + vpdLen;
-  char *buf = NULL;
-  char *bufp = NULL;
-  size_t bufLen = 0;
-  const uint8_t *vpdStart = vpd;
-  for (;vpd != vpdEnd || (state == VSTATE_DATA && !len); ++vpd) {
-    switch (state) {
-      case VSTATE_KW1:
-        kw = *vpd;
-        state = VSTATE_KW2;
+static void _DumpVPDKeywords(const vpd_index *idx, uint8_t section) {
+  for (size_t i=0; i<idx->numEntries; ++i) {
+    const vpd_entry *e = &idx->entries[i];
+    if (e->section != section)
+      continue;
+
+    int len = e->len;
+    const char *buf = (const char*)VPDValue(idx, e);
+    switch (e->kw) {
+      case VPD_KW_PART_NUMBER:
+        printf("    Part Number:         \"%.*s\"\n", len, buf);
         break;
-      case VSTATE_KW2:
-        kw = (kw<<8) | *vpd;
-        state = VSTATE_LEN;
+      case VPD_KW_ENGINEERING_CHANGES:
+        printf("    Engineering Changes: \"%.*s\"\n", len, buf);
         break;
-      case VSTATE_LEN:
-        origLen = len = *vpd;
-        state = VSTATE_DATA;
-        bufp = buf;
+      case VPD_KW_SERIAL_NUMBER:
+        printf("    Serial Number:       \"%.*s\"\n", len, buf);
         break;
-      case VSTATE_DATA:
-        if (len > bufLen) {
-          bufLen = len;
-          buf = bufp = realloc(buf, len+1);
-          memset(buf, 0, len+1);
-        }
-        if (!len) {
-          *bufp++ = 0;
-          switch (kw) {
-            case VPD_KW_PART_NUMBER:
-              printf("    Part Number:         \"%s\"\n", buf);
-              break;
-            case VPD_KW_ENGINEERING_CHANGES:
-              printf("    Engineering Changes: \"%s\"\n", buf);
-              break;
-            case VPD_KW_SERIAL_NUMBER:
-              printf("    Serial Number:       \"%s\"\n", buf);
-              break;
-            case VPD_KW_MANUFACTURE_ID:
-              printf("    Manufacture ID:      \"%s\"\n", buf);
-              break;
-            case VPD_KW_RV:
-              printf("    (Checksum/End)\n");
-              if (ckOffsetPtr)
-                *ckOffsetPtr = (vpd - vpdStart);
-              break;
-            case VPD_KW_ASSET_TAG:
-              printf("    Asset Tag:           \"%s\"\n", buf);
-              break;
-            case VPD_KW_READ_WRITE_AREA:
-              printf("    (Read/Write Reserved Area)\n");
-              break;
-            case VPD_KW_V0:
-            case VPD_KW_V1:
-            case VPD_KW_V2:
-            case VPD_KW_V3:
-            case VPD_KW_V4:
-            case VPD_KW_V5:
-            case VPD_KW_V6:
-              printf("    V%c:                  \"%s\"\n", kw & 0xFF, buf);
-              break;
-            default:
-              printf("    Unknown VPD KW 0x%04X ('%c%c')\n", kw, kw>>8, kw & 0xFF);
-              break;
-          }
-          state = VSTATE_KW1;
-          --vpd;
-          break;
-        }
-
-        *bufp++ = *vpd;
-        --len;
-
+      case VPD_KW_MANUFACTURE_ID:
+        printf("    Manufacture ID:      \"%.*s\"\n", len, buf);
+        break;
+      case VPD_KW_RV:
+        printf("    (Checksum/End)\n");
+        break;
+      case VPD_KW_ASSET_TAG:
+        printf("    Asset Tag:           \"%.*s\"\n", len, buf);
+        break;
+      case VPD_KW_READ_WRITE_AREA:
+        printf("    (Read/Write Reserved Area)\n");
+        break;
+      case VPD_KW_V0:
+      case VPD_KW_V1:
+      case VPD_KW_V2:
+      case VPD_KW_V3:
+      case VPD_KW_V4:
+      case VPD_KW_V5:
+      case VPD_KW_V6:
+        printf("    V%c:                  \"%.*s\"\n", e->kw & 0xFF, len, buf);
         break;
       default:
-        abort();
+        printf("    Unknown VPD KW 0x%04X ('%c%c')\n", e->kw, e->kw>>8, e->kw & 0xFF);
+        break;
     }
   }
 }
 
 static int _DumpVPD(uint8_t *vpd, size_t vpdBufLen) {
-  uint8_t *vpdEnd = vpd + vpdBufLen;
-  enum {
-    STATE_DRIFTING = 0,
-    STATE_LEN1,
-    STATE_LEN2,
-    STATE_DATA,
-  };
-  enum {
-    VPD_TYPE_IDENTIFIER_STRING = 0x02,
-    VPD_TYPE_READ_ONLY         = 0x10,
-    VPD_TYPE_READ_WRITE        = 0x11,
-    VPD_TYPE_END               = 0x0F,
-  };
-  int state = STATE_DRIFTING;
-  uint8_t vpdType;
-  uint16_t vpdLen, vpdOrigLen;
-  uint8_t *buf = NULL;
-  size_t bufLen = 0;
-  uint8_t *bufp = realloc(NULL, 1);
-  size_t ckOffset = 0;
-  uint8_t *vpdStart = vpd;
-  bool errCRC = false;
-  for (;vpd != vpdEnd || (state == STATE_DATA && !vpdLen); ++vpd) {
-    switch (state) {
-    case STATE_DRIFTING:
-      if (*vpd & 0x80) {
-        // Large tag
-        vpdType = *vpd & 0x7F;
-        state = STATE_LEN1;
-      } else {
-        // Small tag
-        vpdType = ((*vpd) >> 3) & 0x0F;
-        vpdLen  = (*vpd) & 0x07;
-        state = STATE_DATA;
-      }
-      break;
-    case STATE_LEN1:
-      vpdLen = vpdOrigLen = *vpd;
-      state = STATE_LEN2;
-      bufp = buf;
-      break;
-    case STATE_LEN2:
-      vpdLen |= ((uint32_t)(*vpd)) << 8;
-      vpdOrigLen = vpdLen;
-      state = STATE_DATA;
-      bufp = buf;
-      break;
-    case STATE_DATA:
-      if (vpdLen > bufLen) {
-        bufLen = vpdLen;
-        buf = bufp = realloc(buf, bufLen+1);
-        memset(buf, 0, bufLen+1);
-      }
-
-      if (!vpdLen) {
-        *bufp++ = 0;
-        switch (vpdType) {
-        case VPD_TYPE_IDENTIFIER_STRING:
-          printf("  Identifier: \"%s\"\n", buf);
-          break;
-        case VPD_TYPE_READ_ONLY:
-          printf("  Read-Only VPD Data:\n");
-          _DumpVPDInner(buf, vpdOrigLen, &ckOffset);
-          break;
-        case VPD_TYPE_READ_WRITE:
-          printf("  Read-Write VPD Data:\n");
-          _DumpVPDInner(buf, vpdOrigLen, NULL);
-          break;
-        case VPD_TYPE_END:
-          printf("  End of VPD data\n");
-
-          if (ckOffset) {
-            uint8_t sum = 0;
-            uint8_t *ckRangeEnd = vpdStart + ckOffset + 1;
-            for (vpd = vpdStart; vpd != ckRangeEnd; ++vpd)
-              sum += *vpd;
-            if (sum) {
-              printf("  VPD RO Checksum:        MISMATCH (0x%02X)\n", sum);
-              errCRC = true;
-            } else
-              printf("  VPD RO Checksum:        OK\n");
-          }
-
-          return errCRC ? 1 : 0;
-        default:
-          printf("  (Unknown VPD Data)\n");
-          break;
-        }
+  vpd_index idx;
+  int err = VPDParse(&idx, vpd, vpdBufLen);
+
+  if (idx.idLen)
+    printf("  Identifier: \"%.*s\"\n", idx.idLen, (const char*)vpd + idx.idOffset);
+  if (idx.roLen) {
+    printf("  Read-Only VPD Data:\n");
+    _DumpVPDKeywords(&idx, VPD_TYPE_READ_ONLY);
+  }
+  if (idx.rwLen) {
+    printf("  Read-Write VPD Data:\n");
+    _DumpVPDKeywords(&idx, VPD_TYPE_READ_WRITE);
+  }
 
-        state = STATE_DRIFTING;
-        --vpd;
-        break;
-      }
+  if (err) {
+    printf("  Warning: malformed VPD data (%s)\n", VPDErrorString(err));
+    return 1;
+  }
 
-      *bufp++ = *vpd;
-      --vpdLen;
-      break;
+  printf("  End of VPD data\n");
+  if (idx.rvIdx < 0)
+    return 0;
 
-    default:
-      return -1;
-    }
+  if (!VPDCheckRV(&idx)) {
+    printf("  VPD RO Checksum:        MISMATCH (expected 0x%02X)\n", VPDComputeRV(&idx));
+    return 1;
   }
 
-  printf("  Warning: malformed VPD data\n");
-  return 1;
+  printf("  VPD RO Checksum:        OK\n");
+  return 0;
 }
 
 static size_t _extVPDIdx = SIZE_MAX;
@@ -601,6 +468,10 @@ static const struct argp _argpSet = {
     "            extended VPD region is present.\n"
     "  vpdext  - Like vpd, but always copies to the extended VPD region.\n"
     "            Fails if extended VPD region is not present.\n"
+    "  vpdkw   - Change the value of a single existing VPD keyword, in\n"
+    "            whichever region vpd would write to. Format: PN=value\n"
+    "            The following keywords are moved as needed and the RV\n"
+    "            checksum is updated.\n"
     ,
   .args_doc = "<image-filename> <parameter-name> <value>",
 };
@@ -616,6 +487,7 @@ enum {
   PARAM_TYPE_VPD,
   PARAM_TYPE_VPD_STD,
   PARAM_TYPE_VPD_EXT,
+  PARAM_TYPE_VPD_KW,
 };
 
 static const param_t _params[] = {
@@ -627,6 +499,7 @@ static const param_t _params[] = {
   X(vpd,    vpd, VPD)
   X(vpdstd, vpd, VPD_STD)
   X(vpdext, vpd, VPD_EXT)
+  X(vpdkw,  vpd, VPD_KW)
 #undef X
   {},
 };
@@ -729,7 +602,12 @@ static int _CmdSet(int pargc, int argc, char **argv) {
 
     case PARAM_TYPE_VPD:
     case PARAM_TYPE_VPD_STD:
-    case PARAM_TYPE_VPD_EXT: {
+    case PARAM_TYPE_VPD_EXT:
+    case PARAM_TYPE_VPD_KW: {
+      bool setKW = (type == PARAM_TYPE_VPD_KW);
+      if (setKW)
+        type = PARAM_TYPE_VPD;
+
       int vpdIdx = -1;
       if (type != PARAM_TYPE_VPD_STD)
         for (size_t i=0; i<ARRAYLEN(hdr->dir); ++i) {
@@ -756,9 +634,39 @@ static int _CmdSet(int pargc, int argc, char **argv) {
         vpdLen   = (ntohl(hdr->dir[vpdIdx].typeSize) & 0x3FFFFF)*4;
       }
 
+      if (vpdStart > st.st_size || vpdLen > st.st_size - vpdStart) {
+        fprintf(stderr, "error: VPD region is outside the image\n");
+        return 1;
+      }
+
       void *vpdBuf = calloc(1, vpdLen+1);
       assert(vpdBuf);
 
+      vpd_index idx;
+      if (setKW) {
+        const char *eq = strchr(value, '=');
+        if (!eq || eq - value != 2) {
+          fprintf(stderr, "error: expected KW=value\n");
+          return 2;
+        }
+
+        memcpy(vpdBuf, (uint8_t*)virt + vpdStart, vpdLen);
+        int err = VPDParse(&idx, vpdBuf, vpdLen);
+        if (!err)
+          err = VPDSet(&idx, (value[0]<<8) | value[1], eq+1, strlen(eq+1));
+        if (err) {
+          fprintf(stderr, "error: cannot set VPD keyword: %s\n", VPDErrorString(err));
+          return 1;
+        }
+
+        ssize_t wr = pwrite(fd, vpdBuf, vpdLen, vpdStart);
+        if (wr < vpdLen) {
+          fprintf(stderr, "error: failed to write value\n");
+          return 1;
+        }
+        break;
+      }
+
       FILE *fi = fopen(value, "rb");
       if (!fi) {
         fprintf(stderr, "error: could not open file: %s\n", value);
@@ -776,6 +684,12 @@ static int _CmdSet(int pargc, int argc, char **argv) {
         return 1;
       }
 
+      int err = VPDParse(&idx, vpdBuf, vpdLen);
+      if (err)
+        fprintf(stderr, "warning: VPD data is malformed (%s)\n", VPDErrorString(err));
+      else if (!VPDCheckRV(&idx))
+        fprintf(stderr, "warning: VPD RO checksum is incorrect\n");
+
       ssize_t wr = pwrite(fd, vpdBuf, vpdLen, vpdStart);
       if (wr < vpdLen) {
         fprintf(stderr, "error: failed to write value\n");
@@ -827,11 +741,720 @@ static int _CmdSet(int pargc, int argc, char **argv) {
   return 0;
 }
 
+/* Inventory
+ * ---------
+ * Extracts a fixed set of fields from any number of images and emits them as
+ * one CSV or JSON row per image. By default only the headers are parsed, so
+ * that audits over large numbers of NVM dumps run quickly; checksums (which
+ * for the APE image means decompressing every section) are only verified if
+ * asked for.
+ */
+enum {
+  INV_FORMAT_CSV = 0,
+  INV_FORMAT_JSON,
+};
+
+enum {
+  INV_TYPE_STR = 1,
+  INV_TYPE_NUM,
+};
+
+#define INV_COLUMNS(X)                                        \
+  X(FILE,               file,               STR)              \
+  X(ERROR,              error,              STR)              \
+  X(SIZE,               size,               NUM)              \
+  X(PART_NO,            part_no,            STR)              \
+  X(MAC0,               mac0,               STR)              \
+  X(MAC1,               mac1,               STR)              \
+  X(MAC2,               mac2,               STR)              \
+  X(MAC3,               mac3,               STR)              \
+  X(PCI_VENDOR,         pci_vendor,         STR)              \
+  X(PCI_DEVICE,         pci_device,         STR)              \
+  X(PCI_SUBSYS_VENDOR,  pci_subsys_vendor,  STR)              \
+  X(SUBSYS_F0_GPHY,     subsys_f0_gphy,     STR)              \
+  X(SUBSYS_F1_GPHY,     subsys_f1_gphy,     STR)              \
+  X(SUBSYS_F2_GPHY,     subsys_f2_gphy,     STR)              \
+  X(SUBSYS_F3_GPHY,     subsys_f3_gphy,     STR)              \
+  X(SUBSYS_F0_SERDES,   subsys_f0_serdes,   STR)              \
+  X(SUBSYS_F1_SERDES,   subsys_f1_serdes,   STR)              \
+  X(SUBSYS_F2_SERDES,   subsys_f2_serdes,   STR)              \
+  X(SUBSYS_F3_SERDES,   subsys_f3_serdes,   STR)              \
+  X(F0_CFG_FEATURE,     f0_cfg_feature,     STR)              \
+  X(F0_CFG_HW,          f0_cfg_hw,          STR)              \
+  X(F0_CFG_HW2,         f0_cfg_hw2,         STR)              \
+  X(F1_CFG_FEATURE,     f1_cfg_feature,     STR)              \
+  X(F1_CFG_HW,          f1_cfg_hw,          STR)              \
+  X(F1_CFG_HW2,         f1_cfg_hw2,         STR)              \
+  X(F2_CFG_FEATURE,     f2_cfg_feature,     STR)              \
+  X(F2_CFG_HW,          f2_cfg_hw,          STR)              \
+  X(F2_CFG_HW2,         f2_cfg_hw2,         STR)              \
+  X(F3_CFG_FEATURE,     f3_cfg_feature,     STR)              \
+  X(F3_CFG_HW,          f3_cfg_hw,          STR)              \
+  X(F3_CFG_HW2,         f3_cfg_hw2,         STR)              \
+  X(CFG_SHARED,         cfg_shared,         STR)              \
+  X(CFG5,               cfg5,               STR)              \
+  X(VPD_PN,             vpd_pn,             STR)              \
+  X(VPD_EC,             vpd_ec,             STR)              \
+  X(VPD_SN,             vpd_sn,             STR)              \
+  X(VPD_MN,             vpd_mn,             STR)              \
+  X(VPD_YA,             vpd_ya,             STR)              \
+  X(APE_NAME,           ape_name,           STR)              \
+  X(APE_VERSION,        ape_version,        STR)              \
+  X(APE_SEC0_SIZE,      ape_sec0_size,      NUM)              \
+  X(APE_SEC0_COMP_SIZE, ape_sec0_comp_size, NUM)              \
+  X(APE_SEC1_SIZE,      ape_sec1_size,      NUM)              \
+  X(APE_SEC1_COMP_SIZE, ape_sec1_comp_size, NUM)              \
+  X(APE_SEC2_SIZE,      ape_sec2_size,      NUM)              \
+  X(APE_SEC2_COMP_SIZE, ape_sec2_comp_size, NUM)              \
+  X(APE_SEC3_SIZE,      ape_sec3_size,      NUM)              \
+  X(APE_SEC3_COMP_SIZE, ape_sec3_comp_size, NUM)              \
+  X(S2_SIZE,            s2_size,            NUM)              \
+  X(CRC,                crc,                STR)           /**/
+
+enum {
+#define X(Id, Name, Type) PP_CAT(INV_COL_,Id),
+  INV_COLUMNS(X)
+#undef X
+  INV_COL__COUNT,
+};
+
+static const struct {
+  const char *name;
+  uint8_t type;
+} _invColumns[] = {
+#define X(Id, Name, Type) {(#Name), (PP_CAT(INV_TYPE_,Type)),},
+  INV_COLUMNS(X)
+#undef X
+};
+
+// VPD values are at most 255 bytes long, so every field fits.
+static char _invRow[INV_COL__COUNT][256];
+static bool _invHas[INV_COL__COUNT];
+
+static void _InvSet(int col, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(_invRow[col], sizeof(_invRow[col]), fmt, ap);
+  va_end(ap);
+  _invHas[col] = true;
+}
+
+static void _InvSetBytes(int col, const void *buf, size_t len) {
+  if (len >= sizeof(_invRow[col]))
+    len = sizeof(_invRow[col])-1;
+  memcpy(_invRow[col], buf, len);
+  _invRow[col][len] = 0;
+  _invHas[col] = true;
+}
+
+static void _InvEmitCSVString(const char *s) {
+  if (!strpbrk(s, ",\"\r\n")) {
+    fputs(s, stdout);
+    return;
+  }
+
+  putchar('"');
+  for (; *s; ++s) {
+    if (*s == '"')
+      putchar('"');
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+static void _InvEmitJSONString(const char *s) {
+  putchar('"');
+  for (; *s; ++s) {
+    uint8_t ch = *s;
+    if (ch == '"' || ch == '\\')
+      printf("\\%c", ch);
+    else if (ch < 0x20 || ch >= 0x7F)
+      printf("\\u%04x", ch);
+    else
+      putchar(ch);
+  }
+  putchar('"');
+}
+
+static void _InvEmitHeader(int format) {
+  if (format == INV_FORMAT_JSON) {
+    printf("[");
+    return;
+  }
+
+  for (size_t i=0; i<INV_COL__COUNT; ++i)
+    printf("%s%s", i ? "," : "", _invColumns[i].name);
+  printf("\n");
+}
+
+static void _InvEmitRow(int format, bool first) {
+  if (format == INV_FORMAT_JSON) {
+    printf("%s\n  {", first ? "" : ",");
+    for (size_t i=0; i<INV_COL__COUNT; ++i) {
+      printf("%s\"%s\": ", i ? ", " : "", _invColumns[i].name);
+      if (!_invHas[i])
+        printf("null");
+      else if (_invColumns[i].type == INV_TYPE_NUM)
+        fputs(_invRow[i], stdout);
+      else
+        _InvEmitJSONString(_invRow[i]);
+    }
+    printf("}");
+    return;
+  }
+
+  for (size_t i=0; i<INV_COL__COUNT; ++i) {
+    if (i)
+      putchar(',');
+    if (_invHas[i])
+      _InvEmitCSVString(_invRow[i]);
+  }
+  putchar('\n');
+}
+
+static void _InvEmitFooter(int format) {
+  if (format == INV_FORMAT_JSON)
+    printf("\n]\n");
+}
+
+// Finds the first directory entry of the given type with a nonzero size.
+static const otg_directory_entry *_InvFindDirEntry(const otg_header *hdr, uint32_t type) {
+  for (size_t i=0; i<ARRAYLEN(hdr->dir); ++i)
+    if ((ntohl(hdr->dir[i].typeSize) & OTG_HEADER_TAG_TYPE_MASK) == type
+        && (ntohl(hdr->dir[i].typeSize) & 0x003FFFFF))
+      return &hdr->dir[i];
+  return NULL;
+}
+
+// CRC32 as used for the image header and stage checksums, over numWords words
+// at offset. Returns false if the range is out of bounds or the stored CRC
+// (the word following the range) does not match.
+static bool _InvCheckCRC(const uint8_t *virt, size_t size, size_t offset, size_t numWords) {
+  if (offset > size || (size-offset)/4 < numWords+1)
+    return false;
+  uint32_t expectedCRC = ntohl(*(uint32_t*)(virt + offset + numWords*4));
+  uint32_t actualCRC = SwapEndian32(ComputeCRC(virt + offset, numWords, 0xFFFFFFFF) ^ 0xFFFFFFFF);
+  return actualCRC == expectedCRC;
+}
+
+// Verifies the trailing and per-section checksums of an embedded APE image.
+// The image may be word-swapped, as it is when stored in NVM.
+static bool _InvCheckAPE(const uint8_t *ape, size_t apeSize, const ape_header *ahdr, bool swapped) {
+  if (apeSize < sizeof(ape_header) + 4 || (apeSize % 4))
+    return false;
+
+  uint32_t trExpected = le32toh(*(uint32_t*)(ape + apeSize - 4));
+  if (trExpected != (ComputeCRC(ape, (apeSize-4)/4, 0xFFFFFFFF) ^ 0xFFFFFFFF))
+    return false;
+
+  uint32_t *buf = malloc(apeSize);
+  assert(buf);
+  memcpy(buf, ape, apeSize);
+  if (swapped)
+    for (size_t i=0; i<apeSize/4; ++i)
+      buf[i] = SwapEndian32(buf[i]);
+
+  bool ok = true;
+  for (size_t i=0; i<ahdr->numSections && i<ARRAYLEN(ahdr->sections) && ok; ++i) {
+    uint32_t offsetFlags = le32toh(ahdr->sections[i].offsetFlags);
+    uint32_t offset      = offsetFlags & 0xFFFFFF;
+    uint32_t uncompSize  = le32toh(ahdr->sections[i].uncompressedSize);
+    uint32_t compSize    = le32toh(ahdr->sections[i].compressedSize);
+    uint32_t checksum    = le32toh(ahdr->sections[i].checksum);
+    if (offsetFlags & APE_SECTION_FLAG_ZERO_ON_FAST_BOOT)
+      continue;
+
+    if (!(offsetFlags & APE_SECTION_FLAG_COMPRESSED))
+      compSize = uncompSize;
+    if (offset > apeSize || compSize > apeSize - offset) {
+      ok = false;
+      break;
+    }
+
+    uint8_t *uncomp = (uint8_t*)buf + offset;
+    if (offsetFlags & APE_SECTION_FLAG_COMPRESSED) {
+      uncomp = malloc(uncompSize);
+      assert(uncomp);
+      if (DecompressBuf((uint8_t*)buf + offset, compSize, uncomp, uncompSize) != uncompSize)
+        ok = false;
+    }
+
+    if (ok) {
+      uint32_t actual = 0;
+      if (offsetFlags & APE_SECTION_FLAG_CHECKSUM_IS_CRC32)
+        actual = ComputeCRC(uncomp, uncompSize/4, 0);
+      else {
+        for (size_t j=0; j<uncompSize/4; ++j)
+          actual += le32toh(((uint32_t*)uncomp)[j]);
+        actual += checksum;
+        checksum = 0;
+      }
+      ok = (actual == checksum);
+    }
+
+    if (uncomp != (uint8_t*)buf + offset)
+      free(uncomp);
+  }
+
+  free(buf);
+  return ok;
+}
+
+// Fills _invRow from a mapped image. Returns an error string if the image
+// could not be parsed at all; fields which were extracted before the error
+// are still emitted.
+static const char *_InvParse(const uint8_t *virt, size_t size, bool checkCRC) {
+  const otg_header *hdr = (const otg_header*)virt;
+  if (size < sizeof(otg_header))
+    return "short file";
+  if (ntohl(hdr->magic) != HEADER_MAGIC)
+    return "bad magic";
+
+  bool crcOK = true;
+  if (checkCRC) {
+    uint8_t sum = hdr->dirCRC;
+    for (size_t i=0x14; i<0x74; ++i)
+      sum += virt[i];
+    crcOK = !sum
+      && _InvCheckCRC(virt, size, 0, 4)
+      && _InvCheckCRC(virt, size, offsetof(otg_header, mfrFormatRev), 0x008C/4 - 1)
+      && _InvCheckCRC(virt, size, offsetof(otg_header, mfr2Unk), 0x008C/4 - 1);
+  }
+
+  char name[sizeof(hdr->partNo)+1] = {};
+  memcpy(name, hdr->partNo, sizeof(hdr->partNo));
+  _InvSet(INV_COL_PART_NO, "%s", name);
+
+  const uint32_t macs[][2] = {
+    {hdr->mac0[0], hdr->mac0[1]},
+    {hdr->mac1[0], hdr->mac1[1]},
+    {hdr->mac2[0], hdr->mac2[1]},
+    {hdr->mac3[0], hdr->mac3[1]},
+  };
+  for (size_t i=0; i<ARRAYLEN(macs); ++i)
+    _InvSet(INV_COL_MAC0+i, "%04X%08X", ntohl(macs[i][0]), ntohl(macs[i][1]));
+
+  _InvSet(INV_COL_PCI_VENDOR,        "%04X", ntohs(hdr->pciVendor));
+  _InvSet(INV_COL_PCI_DEVICE,        "%04X", ntohs(hdr->pciDevice));
+  _InvSet(INV_COL_PCI_SUBSYS_VENDOR, "%04X", ntohs(hdr->pciSubsystemVendor));
+  _InvSet(INV_COL_SUBSYS_F0_GPHY,    "%04X", ntohs(hdr->pciSubsystemF0GPHY));
+  _InvSet(INV_COL_SUBSYS_F1_GPHY,    "%04X", ntohs(hdr->pciSubsystemF1GPHY));
+  _InvSet(INV_COL_SUBSYS_F2_GPHY,    "%04X", ntohs(hdr->pciSubsystemF2GPHY));
+  _InvSet(INV_COL_SUBSYS_F3_GPHY,    "%04X", ntohs(hdr->pciSubsystemF3GPHY));
+  _InvSet(INV_COL_SUBSYS_F0_SERDES,  "%04X", ntohs(hdr->pciSubsystemF0SERDES));
+  _InvSet(INV_COL_SUBSYS_F1_SERDES,  "%04X", ntohs(hdr->pciSubsystemF1SERDES));
+  _InvSet(INV_COL_SUBSYS_F2_SERDES,  "%04X", ntohs(hdr->pciSubsystemF2SERDES));
+  _InvSet(INV_COL_SUBSYS_F3_SERDES,  "%04X", ntohs(hdr->pciSubsystemF3SERDES));
+
+  const uint32_t cfgs[][3] = {
+    {hdr->func0CfgFeature, hdr->func0CfgHW, hdr->func0CfgHW2},
+    {hdr->func1CfgFeature, hdr->func1CfgHW, hdr->func1CfgHW2},
+    {hdr->func2CfgFeature, hdr->func2CfgHW, hdr->func2CfgHW2},
+    {hdr->func3CfgFeature, hdr->func3CfgHW, hdr->func3CfgHW2},
+  };
+  for (size_t i=0; i<ARRAYLEN(cfgs); ++i)
+    for (size_t j=0; j<3; ++j)
+      _InvSet(INV_COL_F0_CFG_FEATURE + i*3 + j, "0x%08X", ntohl(cfgs[i][j]));
+  _InvSet(INV_COL_CFG_SHARED, "0x%08X", ntohl(hdr->cfgShared));
+  _InvSet(INV_COL_CFG5,       "0x%08X", ntohl(hdr->cfg5));
+
+  // Keywords are taken from the extended VPD area if present, since that is
+  // what "otgimg set ... vpd" writes to.
+  const uint8_t *vpd = hdr->vpd;
+  size_t vpdLen = sizeof(hdr->vpd);
+  const otg_directory_entry *ent = _InvFindDirEntry(hdr, OTG_HEADER_TAG_TYPE__EXTENDED_VPD);
+  if (ent) {
+    size_t offset = ntohl(ent->offset);
+    size_t len    = (ntohl(ent->typeSize) & 0x003FFFFF)*4;
+    if (offset > size || len > size - offset)
+      return "bad extended VPD";
+    vpd    = virt + offset;
+    vpdLen = len;
+  }
+
+  vpd_index vidx;
+  int vpdErr = VPDParse(&vidx, (uint8_t*)vpd, vpdLen);
+  static const uint16_t vpdKWs[] = {
+    VPD_KW_PART_NUMBER, VPD_KW_ENGINEERING_CHANGES, VPD_KW_SERIAL_NUMBER,
+    VPD_KW_MANUFACTURE_ID, VPD_KW_ASSET_TAG,
+  };
+  for (size_t i=0; i<ARRAYLEN(vpdKWs); ++i) {
+    const vpd_entry *e = VPDFind(&vidx, vpdKWs[i]);
+    if (e)
+      _InvSetBytes(INV_COL_VPD_PN+i, VPDValue(&vidx, e), e->len);
+  }
+  if (checkCRC)
+    crcOK = crcOK && !vpdErr && VPDCheckRV(&vidx);
+
+  ent = _InvFindDirEntry(hdr, OTG_HEADER_TAG_TYPE__APE_CODE);
+  if (ent) {
+    size_t offset  = ntohl(ent->offset);
+    size_t apeSize = (ntohl(ent->typeSize) & 0x003FFFFF)*4;
+    if (offset > size || apeSize > size - offset || apeSize < sizeof(ape_header))
+      return "bad APE directory entry";
+
+    // The APE image is stored word-swapped in NVM; accept either order.
+    const uint8_t *ape = virt + offset;
+    ape_header ahdr;
+    memcpy(&ahdr, ape, sizeof(ahdr));
+    bool swapped = !memcmp("\x1AMCB", ahdr.magic, 4) || !memcmp("\x1A" "BUB", ahdr.magic, 4);
+    if (swapped)
+      for (size_t i=0; i<sizeof(ahdr)/4; ++i)
+        ((uint32_t*)&ahdr)[i] = SwapEndian32(((uint32_t*)&ahdr)[i]);
+    if (memcmp("BCM\x1A", ahdr.magic, 4) && memcmp("BUB\x1A", ahdr.magic, 4))
+      return "bad APE magic";
+
+    char apeName[sizeof(ahdr.imageName)+1] = {};
+    memcpy(apeName, ahdr.imageName, sizeof(ahdr.imageName));
+    _InvSet(INV_COL_APE_NAME, "%s", apeName);
+    _InvSet(INV_COL_APE_VERSION, "0x%08X", le32toh(ahdr.imageVersion));
+    for (size_t i=0; i<ahdr.numSections && i<ARRAYLEN(ahdr.sections); ++i) {
+      _InvSet(INV_COL_APE_SEC0_SIZE + i*2, "%u", le32toh(ahdr.sections[i].uncompressedSize));
+      _InvSet(INV_COL_APE_SEC0_COMP_SIZE + i*2, "%u", le32toh(ahdr.sections[i].compressedSize));
+    }
+
+    if (checkCRC && crcOK)
+      crcOK = _InvCheckAPE(ape, apeSize, &ahdr, swapped);
+  }
+
+  size_t s1Offset = ntohl(hdr->s1Offset);
+  size_t s1Size   = ntohl(hdr->s1Size)*4;
+  if (s1Offset > size || s1Size > size - s1Offset || size - s1Offset - s1Size < sizeof(otg_s2header))
+    return "bad stage1 offset/size";
+  if (checkCRC && crcOK)
+    crcOK = s1Size >= 4 && _InvCheckCRC(virt, size, s1Offset, s1Size/4 - 1);
+
+  size_t s2Offset = s1Offset + s1Size;
+  const otg_s2header *s2hdr = (const otg_s2header*)(virt + s2Offset);
+  size_t s2Size = ntohl(s2hdr->s2Size);
+  if (ntohl(s2hdr->magic) != HEADER_MAGIC)
+    return "bad stage2 magic";
+  if (s2Size < 4 || s2Size > size - s2Offset - sizeof(otg_s2header))
+    return "bad stage2 size";
+  _InvSet(INV_COL_S2_SIZE, "%zu", s2Size);
+  if (checkCRC && crcOK)
+    crcOK = _InvCheckCRC(virt, size, s2Offset + 8, (s2Size-4)/4);
+
+  if (checkCRC)
+    _InvSet(INV_COL_CRC, crcOK ? "ok" : "mismatch");
+  return NULL;
+}
+
+static int _invFormat = INV_FORMAT_CSV;
+static bool _invCheckCRC = false;
+
+static error_t _InvParseOpt(int key, char *arg, struct argp_state *state) {
+  switch (key) {
+    case 'f':
+      if (!strcmp(arg, "csv"))
+        _invFormat = INV_FORMAT_CSV;
+      else if (!strcmp(arg, "json"))
+        _invFormat = INV_FORMAT_JSON;
+      else
+        argp_error(state, "unknown format \"%s\"", arg);
+      return 0;
+    case 'c':
+      _invCheckCRC = true;
+      return 0;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+}
+
+static const struct argp_option _argpInventoryOpts[] = {
+  {"format", 'f', "csv|json", 0, "Output format (default csv)"},
+  {"check",  'c', NULL,       0, "Also verify all checksums, decompressing the APE image (slow)"},
+  {},
+};
+
+static const struct argp _argpInventory = {
+  .options = _argpInventoryOpts,
+  .parser = _InvParseOpt,
+  .doc = "Extract a fixed set of fields from one or more firmware images, one row per image.\v"
+    "Images which cannot be parsed still produce a row, with the error column set.\n",
+  .args_doc = "<image-filename>...",
+};
+
+static int _CmdInventory(int pargc, int argc, char **argv) {
+  int argidx;
+  error_t argerr = argp_parse(&_argpInventory, argc, argv, 0, &argidx, NULL);
+  if (argerr || !argv[argidx]) {
+    argp_help(&_argpInventory, stderr, ARGP_HELP_STD_USAGE, argv[0]);
+    return 2;
+  }
+
+  int rc = 0;
+  _InvEmitHeader(_invFormat);
+  for (int i=argidx; i<argc; ++i) {
+    memset(_invHas, 0, sizeof(_invHas));
+    _InvSet(INV_COL_FILE, "%s", argv[i]);
+
+    const char *err = NULL;
+    int fd = open(argv[i], O_RDONLY);
+    struct stat st;
+    if (fd < 0)
+      err = "cannot open";
+    else if (fstat(fd, &st) < 0)
+      err = "cannot stat";
+    else if (st.st_size < sizeof(otg_header))
+      err = "short file";
+    else {
+      _InvSet(INV_COL_SIZE, "%zu", (size_t)st.st_size);
+      void *virt = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (virt == MAP_FAILED)
+        err = "cannot map";
+      else {
+        err = _InvParse(virt, st.st_size, _invCheckCRC);
+        munmap(virt, st.st_size);
+      }
+    }
+
+    if (fd >= 0)
+      close(fd);
+    if (err) {
+      _InvSet(INV_COL_ERROR, "%s", err);
+      rc = 1;
+    }
+
+    _InvEmitRow(_invFormat, i == argidx);
+  }
+
+  _InvEmitFooter(_invFormat);
+  return rc;
+}
+
+/* VPD Self Test
+ * -------------
+ * Exercises otg_vpd.c without any image files: parsing of a well-formed
+ * block, VPDSet round trips at every length up to and past the available
+ * space, and parsing of mutated and truncated blocks. Every buffer is
+ * allocated at exactly its length, so an out-of-bounds access is caught by
+ * ASan or valgrind. The PRNG is seeded with a constant, so failures are
+ * reproducible.
+ */
+static uint32_t _testRand = 0x1F123BB5;
+
+static uint32_t _TestRand(void) {
+  _testRand ^= _testRand << 13;
+  _testRand ^= _testRand >> 17;
+  _testRand ^= _testRand << 5;
+  return _testRand;
+}
+
+static size_t _VPDTestPut(uint8_t *p, const char *kw, const char *val, size_t len) {
+  p[0] = kw[0];
+  p[1] = kw[1];
+  p[2] = len;
+  memcpy(p+3, val, len);
+  return 3 + len;
+}
+
+// Builds a typical VPD block: identifier string, read-only resource ending in
+// RV with reserved space, read-write resource ending in RW, end tag.
+static size_t _VPDTestBuild(uint8_t *buf) {
+  static const char id[] = "Broadcom NetXtreme Gigabit Ethernet";
+  size_t n = 0;
+  buf[n++] = 0x82;
+  buf[n++] = sizeof(id)-1;
+  buf[n++] = 0;
+  memcpy(buf+n, id, sizeof(id)-1);
+  n += sizeof(id)-1;
+
+  size_t ro = n;
+  buf[n++] = 0x90;
+  n += 2;
+  n += _VPDTestPut(buf+n, "PN", "BCM95719", 8);
+  n += _VPDTestPut(buf+n, "EC", "106679-15", 9);
+  n += _VPDTestPut(buf+n, "SN", "0123456789", 10);
+  n += _VPDTestPut(buf+n, "MN", "14e4", 4);
+  n += _VPDTestPut(buf+n, "V0", "5719-v1.46", 10);
+  n += _VPDTestPut(buf+n, "RV", "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 16);
+  buf[ro+1] = (n - ro - 3) & 0xFF;
+  buf[ro+2] = (n - ro - 3) >> 8;
+
+  size_t rw = n;
+  buf[n++] = 0x91;
+  n += 2;
+  n += _VPDTestPut(buf+n, "YA", "asset", 5);
+  n += _VPDTestPut(buf+n, "RW", "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", 20);
+  buf[rw+1] = (n - rw - 3) & 0xFF;
+  buf[rw+2] = (n - rw - 3) >> 8;
+
+  buf[n++] = 0x78;
+
+  vpd_index idx;
+  VPDParse(&idx, buf, n);
+  VPDUpdateRV(&idx);
+  return n;
+}
+
+static bool _VPDTestValue(const vpd_index *idx, uint16_t kw, const void *val, size_t len) {
+  const vpd_entry *e = VPDFind(idx, kw);
+  return e && e->len == len && !memcmp(VPDValue(idx, e), val, len);
+}
+
+// Checks invariants which must hold for any index, whatever the data.
+static bool _VPDTestIndexSane(const vpd_index *idx) {
+  for (size_t i=0; i<idx->numEntries; ++i) {
+    const vpd_entry *e = &idx->entries[i];
+    if (e->offset > idx->dataLen || e->len > idx->dataLen - e->offset)
+      return false;
+    const vpd_entry *f = VPDFind(idx, e->kw);
+    if (!f || f->kw != e->kw || f > e)
+      return false;
+  }
+  return idx->rvIdx < (int)idx->numEntries;
+}
+
+static unsigned _VPDTestWellFormed(void) {
+  unsigned failures = 0;
+  uint8_t tmpl[256];
+  size_t len = _VPDTestBuild(tmpl);
+
+  uint8_t *buf = malloc(len);
+  assert(buf);
+  memcpy(buf, tmpl, len);
+
+  vpd_index idx;
+  if (VPDParse(&idx, buf, len) || idx.endOffset != len || !VPDCheckRV(&idx)
+   || !_VPDTestValue(&idx, VPD_KW_PART_NUMBER, "BCM95719", 8)
+   || !_VPDTestValue(&idx, VPD_KW_SERIAL_NUMBER, "0123456789", 10)
+   || !_VPDTestValue(&idx, VPD_KW_ASSET_TAG, "asset", 5)
+   || VPDFind(&idx, 0x5858)) {
+    printf("FAIL: well-formed VPD not parsed correctly\n");
+    ++failures;
+  }
+
+  // Set PN (in RO, before RV) and YA (in RW, before RW) at every length, both
+  // within and past the available space.
+  static const uint16_t kws[] = {VPD_KW_PART_NUMBER, VPD_KW_V0, VPD_KW_ASSET_TAG};
+  uint8_t val[256];
+  for (size_t k=0; k<ARRAYLEN(kws); ++k)
+    for (size_t vlen=0; vlen<=64; ++vlen) {
+      memcpy(buf, tmpl, len);
+      VPDParse(&idx, buf, len);
+      for (size_t i=0; i<vlen; ++i)
+        val[i] = 'A' + (_TestRand() % 26);
+
+      const vpd_entry *e = VPDFind(&idx, kws[k]);
+      size_t slack = (e->section == VPD_TYPE_READ_ONLY) ? 16 - 1 : 20;
+      int err = VPDSet(&idx, kws[k], val, vlen);
+      bool fits = vlen <= e->len + slack;
+      if (fits ? err != VPD_ERR_NONE : err != VPD_ERR_NO_SPACE) {
+        printf("FAIL: VPDSet of %c%c to %zu bytes: %s\n", kws[k]>>8, kws[k]&0xFF, vlen, VPDErrorString(err));
+        ++failures;
+        continue;
+      }
+      if (err) {
+        if (memcmp(buf, tmpl, len)) {
+          printf("FAIL: failed VPDSet of %c%c to %zu bytes modified the data\n", kws[k]>>8, kws[k]&0xFF, vlen);
+          ++failures;
+        }
+        continue;
+      }
+
+      // Reparse from scratch, as a reader of the image would.
+      vpd_index idx2;
+      if (VPDParse(&idx2, buf, len) || idx2.endOffset != len || !VPDCheckRV(&idx2)
+       || !_VPDTestValue(&idx2, kws[k], val, vlen)
+       || (kws[k] != VPD_KW_SERIAL_NUMBER && !_VPDTestValue(&idx2, VPD_KW_SERIAL_NUMBER, "0123456789", 10))
+       || (kws[k] != VPD_KW_ASSET_TAG && !_VPDTestValue(&idx2, VPD_KW_ASSET_TAG, "asset", 5))) {
+        printf("FAIL: VPDSet of %c%c to %zu bytes did not round trip\n", kws[k]>>8, kws[k]&0xFF, vlen);
+        ++failures;
+      }
+    }
+
+  if (VPDSet(&idx, VPD_KW_RV, "", 0) != VPD_ERR_RESERVED || VPDSet(&idx, 0x5858, "", 0) != VPD_ERR_NOT_FOUND) {
+    printf("FAIL: VPDSet of RV or a missing keyword not refused\n");
+    ++failures;
+  }
+
+  free(buf);
+  return failures;
+}
+
+// Parses mutated and truncated copies of a well-formed block, and sets
+// keywords in those which still parse. Returns the number of failures and
+// adds the number of cases run to *cases.
+static unsigned _VPDTestMutations(size_t iterations, unsigned *cases) {
+  unsigned failures = 0;
+  uint8_t tmpl[256], work[512];
+  size_t tmplLen = _VPDTestBuild(tmpl);
+
+  for (size_t it=0; it<iterations; ++it) {
+    memcpy(work, tmpl, tmplLen);
+    size_t len = tmplLen;
+    switch (_TestRand() % 4) {
+      case 0: // Flip bytes.
+        for (size_t j=1+_TestRand()%4; j; --j)
+          work[_TestRand() % len] = _TestRand();
+        break;
+      case 1: // Truncate.
+        len = _TestRand() % (len+1);
+        break;
+      case 2: // Corrupt a length byte.
+        work[3 + sizeof("Broadcom NetXtreme Gigabit Ethernet")-1 + 3 + 2] = _TestRand();
+        work[_TestRand() % len] = _TestRand();
+        break;
+      default: // Garbage.
+        len = _TestRand() % sizeof(work);
+        for (size_t j=0; j<len; ++j)
+          work[j] = _TestRand();
+        break;
+    }
+
+    uint8_t *buf = malloc(len ? len : 1);
+    assert(buf);
+    memcpy(buf, work, len);
+
+    vpd_index idx;
+    int err = VPDParse(&idx, buf, len);
+    if (!_VPDTestIndexSane(&idx)) {
+      printf("FAIL: mutation %zu: index refers outside the data\n", it);
+      ++failures;
+    } else if (!err && idx.numEntries) {
+      // Set a random keyword to a random length. Success must leave valid VPD
+      // of the same extent; failure must leave the data untouched.
+      const vpd_entry *e = &idx.entries[_TestRand() % idx.numEntries];
+      uint16_t kw = e->kw;
+      size_t vlen = _TestRand() % 48;
+      uint8_t val[48];
+      memset(val, 'x', sizeof(val));
+      memcpy(work, buf, len);
+      size_t endOffset = idx.endOffset;
+
+      err = VPDSet(&idx, kw, val, vlen);
+      vpd_index idx2;
+      if (err ? memcmp(work, buf, len) != 0
+              : (VPDParse(&idx2, buf, len) || idx2.endOffset != endOffset || !_VPDTestValue(&idx2, kw, val, vlen))) {
+        printf("FAIL: mutation %zu: VPDSet of %c%c to %zu bytes %s\n", it, kw>>8, kw&0xFF, vlen,
+          err ? "modified the data on failure" : "did not round trip");
+        ++failures;
+      }
+    }
+
+    free(buf);
+    ++*cases;
+  }
+
+  return failures;
+}
+
+static int _CmdVPDTest(int pargc, int argc, char **argv) {
+  unsigned cases = 0;
+  unsigned failures = _VPDTestWellFormed();
+  failures += _VPDTestMutations(100000, &cases);
+  printf("%u mutated VPD blocks, %u failures\n", cases, failures);
+  return failures ? 1 : 0;
+}
+
 static const struct argp _argp = {
   .args_doc = "<command> [command-args...]",
   .doc = "otg firmware image servicing tool.\vCommands:\n"
-    "  info     show information about a firmware image\n"
-    "  set      set a parameter in a firmware image\n"
+    "  info       show information about a firmware image\n"
+    "  set        set a parameter in a firmware image\n"
+    "  inventory  extract fields from many firmware images as CSV or JSON\n"
+    "  vpdtest    test the VPD parser against generated and mutated VPD data\n"
     ,
 };
 
@@ -849,6 +1472,14 @@ static const command_def_t _commands[] = {
     .name = "set",
     .func = _CmdSet,
   },
+  {
+    .name = "inventory",
+    .func = _CmdInventory,
+  },
+  {
+    .name = "vpdtest",
+    .func = _CmdVPDTest,
+  },
   {},
 };
 